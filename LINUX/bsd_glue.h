@@ -92,6 +92,23 @@
 #define skb_set_queue_mapping(a, b)	do { (void)(a); (void)(b); } while (0)
 #endif
 
+#ifdef NETMAP_LINUX_HAVE_GRO_CELLS
+#include <net/gro_cells.h>
+#endif
+
+#ifdef NETMAP_LINUX_HAVE_EVENTFD
+#include <linux/eventfd.h>
+#ifdef NETMAP_LINUX_HAVE_EVENTFD_SIGNAL_NOCOUNT
+#define NM_EVENTFD_SIGNAL(ctx)	eventfd_signal(ctx)
+#else
+#define NM_EVENTFD_SIGNAL(ctx)	eventfd_signal(ctx, 1)
+#endif
+#endif /* HAVE_EVENTFD */
+
+#ifndef NETMAP_LINUX_HAVE_SKB_GET_HASH
+#define skb_get_hash(m)	skb_get_rxhash(m)
+#endif
+
 #ifndef NETMAP_LINUX_HAVE_HRTIMER_FORWARD_NOW
 /* Forward a hrtimer so it expires after the hrtimer's current now */
 static inline u64 hrtimer_forward_now(struct hrtimer *timer,
@@ -168,6 +185,7 @@ struct thread;
 /* Atomic variables. */
 #define NM_ATOMIC_TEST_AND_SET(p)	test_and_set_bit(0, (p))
 #define NM_ATOMIC_CLEAR(p)		clear_bit(0, (p))
+#define NM_ATOMIC_TEST_AND_CLEAR(p)	test_and_clear_bit(0, (p))
 
 #define NM_ATOMIC_SET(p, v)             atomic_set(p, v)
 #define NM_ATOMIC_INC(p)                atomic_inc(p)
@@ -191,6 +209,7 @@ struct thread;
 #define m_freem(m)		dev_kfree_skb_any(m)	// free a sk_buff
 
 #define GET_MBUF_REFCNT(m)	NM_ATOMIC_READ(&((m)->users))
+#define MBUF_CLONED(m)		skb_cloned(m)	// data shared with a clone
 #define netmap_get_mbuf(size)	alloc_skb(size, GFP_ATOMIC)
 /*
  * on tx we force skb->queue_mapping = ring_nr,
@@ -215,6 +234,7 @@ struct thread;
 #define m_copydata(m, o, l, b)          skb_copy_bits(m, o, b, l)
 
 #define copyin(_from, _to, _len)	copy_from_user(_to, _from, _len)
+#define copyout(_from, _to, _len)	copy_to_user(_to, _from, _len)
 
 /*
  * struct ifnet is remapped into struct net_device on linux.
@@ -349,6 +369,7 @@ static inline int ilog2(uint64_t n)
 #define netmap_knlist_destroy(x)	// XXX todo
 
 #define	tsleep(a, b, c, t)	msleep(10)
+#define	maybe_yield()		cond_resched()
 // #define	wakeup(sw)				// XXX double check
 
 #define microtime		do_gettimeofday		// debugging
@@ -25,6 +25,7 @@
 
 #include "bsd_glue.h"
 #include <linux/file.h>   /* fget(int fd) */
+#include <linux/kthread.h>
 
 #include <net/netmap.h>
 #include <dev/netmap/netmap_kern.h>
@@ -126,6 +127,8 @@ uint16_t nm_csum_fold(rawsum_t cur_sum)
  *   until the timer expires;
  * - when the timer expires and there are pending packets,
  *   a notification is sent up and the timer is restarted.
+ * The timer period is the per-ring mit->mit_delay, recomputed by
+ * generic_mit_update() at each notification.
  */
 NETMAP_LINUX_TIMER_RTYPE
 generic_timer_handler(struct hrtimer *t)
@@ -148,6 +151,10 @@ generic_timer_handler(struct hrtimer *t)
         netmap_common_irq(mit->mit_na->ifp, mit->mit_ring_idx, &work_done);
         generic_rate(0, 0, 0, 0, 0, 1);
     }
+    generic_mit_update(mit);
+    if (mit->mit_delay == 0) {
+        return HRTIMER_NORESTART;
+    }
     netmap_mitigation_restart(mit);
 
     return HRTIMER_RESTART;
@@ -167,12 +174,12 @@ void netmap_mitigation_init(struct nm_generic_mit *mit, int idx,
 
 void netmap_mitigation_start(struct nm_generic_mit *mit)
 {
-    hrtimer_start(&mit->mit_timer, ktime_set(0, netmap_generic_mit), HRTIMER_MODE_REL);
+    hrtimer_start(&mit->mit_timer, ktime_set(0, mit->mit_delay), HRTIMER_MODE_REL);
 }
 
 void netmap_mitigation_restart(struct nm_generic_mit *mit)
 {
-    hrtimer_forward_now(&mit->mit_timer, ktime_set(0, netmap_generic_mit));
+    hrtimer_forward_now(&mit->mit_timer, ktime_set(0, mit->mit_delay));
 }
 
 int netmap_mitigation_active(struct nm_generic_mit *mit)
@@ -317,41 +324,694 @@ void netmap_catch_tx(struct netmap_generic_adapter *gna, int enable)
     }
 }
 
-/* Transmit routine used by generic_netmap_txsync(). Returns 0 on success
-   and -1 on error (which may be packet drops or other errors). */
-int generic_xmit_frame(struct ifnet *ifp, struct mbuf *m,
-	void *addr, u_int len, u_int ring_nr)
+/* Empty an sk_buff of the tx pool, releasing the page fragments
+ * of the previous packet.
+ */
+static void
+generic_skb_reset(struct mbuf *m)
 {
-    netdev_tx_t ret;
+    struct skb_shared_info *sh = skb_shinfo(m);
+    int i;
 
-    /* Empty the sk_buff. */
+    for (i = 0; i < sh->nr_frags; i++) {
+	m->truesize -= skb_frag_size(&sh->frags[i]);
+	put_page(skb_frag_page(&sh->frags[i]));
+    }
+    sh->nr_frags = 0;
+    m->len -= m->data_len;
+    m->data_len = 0;
     if (unlikely(skb_headroom(m)))
 	skb_push(m, skb_headroom(m));
     skb_trim(m, 0);
+}
+
+static void
+generic_skb_add_frag(struct mbuf *m, struct page *page, u_int off, u_int len)
+{
+    skb_fill_page_desc(m, skb_shinfo(m)->nr_frags, page, off, len);
+    m->len += len;
+    m->data_len += len;
+    m->truesize += len;
+}
+
+/* bytes of a zero-copy packet still copied in the linear area,
+ * where the drivers and the stack expect the headers
+ */
+#define NM_GENERIC_TXZC_HDR	128
+
+/* Zero-copy fragments must not outlive the skb. The skb carries no
+ * ubuf_info, so nothing would make the stack copy them before keeping
+ * them: on devices that loop packets back into the stack (veth,
+ * bridges, loopback, ...) GRO or TCP coalescing could steal the page
+ * fragments, and netmap would return the slot to userspace while the
+ * stack still reads the buffer. Only devices with a parent bus device,
+ * i.e. hardware NICs, which hand the fragments to the NIC and free
+ * them, use zero-copy.
+ */
+static inline int
+generic_txzc_ok(struct ifnet *ifp, u_int len)
+{
+    return netmap_generic_txzc > 0 && len >= netmap_generic_txzc &&
+	ifp->dev.parent != NULL && !(ifp->flags & IFF_LOOPBACK);
+}
+
+/* Append a netmap fragment to the packet in m, return 0 on success,
+ * -1 if out of memory and EMSGSIZE if the packet does not fit in the
+ * skb (the caller drops it). Short fragments are copied in the
+ * linear area. Longer ones (netmap_generic_txzc) are
+ * referenced in place: the page fragments point to the pages of the
+ * netmap buffer, so the tx pool skb must not be reused, nor any slot
+ * of the packet returned to userspace, until the driver and any clone
+ * have released it (see generic_netmap_tx_clean()). Otherwise the
+ * data goes in pages of its own.
+ */
+static int
+generic_skb_append(struct ifnet *ifp, struct mbuf *m, char *addr, u_int len)
+{
+    struct skb_shared_info *sh = skb_shinfo(m);
+    int sg = (ifp->features & NETIF_F_SG);
+    int zc = sg && generic_txzc_ok(ifp, len);
+    struct page *page;
+    u_int n;
+
+    if (sh->nr_frags == 0 && (!sg || (!zc && len <= skb_tailroom(m)))) {
+	if (unlikely(len > skb_tailroom(m))) {
+	    RD(5, "no scatter-gather, packet too long");
+	    return EMSGSIZE;
+	}
+	skb_copy_to_linear_data_offset(m, skb_headlen(m), addr, len);
+	skb_put(m, len);
+	return 0;
+    }
+    if (zc) {
+	if (sh->nr_frags == 0 && skb_headlen(m) == 0) {
+	    n = min_t(u_int, len, NM_GENERIC_TXZC_HDR);
+	    skb_copy_to_linear_data(m, addr, n);
+	    skb_put(m, n);
+	    addr += n;
+	    len -= n;
+	}
+	n = (offset_in_page(addr) + len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	if (sh->nr_frags + n <= MAX_SKB_FRAGS) {
+	    for (; len > 0; addr += n, len -= n) {
+		page = virt_to_page(addr);
+		n = min_t(u_int, len, PAGE_SIZE - offset_in_page(addr));
+		get_page(page);
+		generic_skb_add_frag(m, page, offset_in_page(addr), n);
+	    }
+	    return 0;
+	}
+	/* too many fragments, copy */
+    }
+    if (len == 0)
+	return 0;
+    if (unlikely(sh->nr_frags >= MAX_SKB_FRAGS)) {
+	RD(5, "too many fragments");
+	return EMSGSIZE;
+    }
+    page = alloc_pages(GFP_ATOMIC | __GFP_COMP, get_order(len));
+    if (unlikely(page == NULL))
+	return -1;
+    memcpy(page_address(page), addr, len);
+    generic_skb_add_frag(m, page, 0, len);
+    return 0;
+}
 
-    /* TODO Support the slot flags (NS_MOREFRAG, NS_INDIRECT). */
-    skb_copy_to_linear_data(m, addr, len); // skb_store_bits(m, 0, addr, len);
-    skb_put(m, len);
+/* The generic txsync holds the tx queue lock across a batch and
+ * calls the driver directly, bypassing the qdisc, so that the
+ * xmit_more hint lets the driver ring the doorbell once per batch.
+ */
+void generic_xmit_batch(struct ifnet *ifp, u_int ring_nr, int start)
+{
+#ifdef NETMAP_LINUX_HAVE_NETDEV_START_XMIT
+    struct netdev_queue *txq = netdev_get_tx_queue(ifp, ring_nr);
+
+    if (start) {
+	local_bh_disable();
+	HARD_TX_LOCK(ifp, txq, smp_processor_id());
+    } else {
+	HARD_TX_UNLOCK(ifp, txq);
+	local_bh_enable();
+    }
+#endif /* HAVE_NETDEV_START_XMIT */
+}
+
+/* Transmit routine used by generic_netmap_txsync(). Returns 0 on success
+   and -1 on error (which may be packet drops or other errors).
+   The fragments of a packet (NS_MOREFRAG) are appended to m with
+   NM_XMIT_FRAG and NM_XMIT_APPEND, and the packet is sent with the
+   last one (or by a call with NM_XMIT_APPEND and len 0). */
+int generic_xmit_frame(struct ifnet *ifp, struct mbuf *m,
+	void *addr, u_int len, u_int ring_nr, int flags)
+{
+    netdev_tx_t ret;
+    int error;
+
+    if (!(flags & NM_XMIT_APPEND))
+	generic_skb_reset(m);
+    /* TODO Support NS_INDIRECT. */
+    if (len > 0) {
+	error = generic_skb_append(ifp, m, addr, len);
+	if (unlikely(error)) {
+	    if (error == EMSGSIZE)	/* dropped, release the pages */
+		generic_skb_reset(m);
+	    return error;
+	}
+    }
+    if (flags & NM_XMIT_FRAG)
+	return 0;
     NM_ATOMIC_INC(&m->users);
     m->dev = ifp;
     /* Tell generic_ndo_start_xmit() to pass this mbuf to the driver. */
     m->priority = NM_MAGIC_PRIORITY_TX;
     skb_set_queue_mapping(m, ring_nr);
 
+#ifdef NETMAP_LINUX_HAVE_NETDEV_START_XMIT
+    {
+	/* we hold the queue lock, see generic_xmit_batch() */
+	struct netdev_queue *txq = netdev_get_tx_queue(ifp, ring_nr);
+
+	if (unlikely(netif_xmit_frozen_or_stopped(txq)))
+	    ret = NETDEV_TX_BUSY;
+	else
+	    ret = netdev_start_xmit(m, ifp, txq, !!(flags & NM_XMIT_MORE));
+	if (likely(ret == NETDEV_TX_OK))
+	    return 0;
+	if (!dev_xmit_complete(ret)) {
+	    /* not consumed, drop the reference of the driver */
+	    m_freem(m);
+	    return -1;
+	}
+    }
+#else /* !HAVE_NETDEV_START_XMIT */
     ret = dev_queue_xmit(m);
 
     if (likely(ret == NET_XMIT_SUCCESS)) {
         return 0;
     }
+#endif /* !HAVE_NETDEV_START_XMIT */
     if (unlikely(ret != NET_XMIT_DROP)) {
         /* If something goes wrong in the TX path, there is nothing
            intelligent we can do (for now) apart from error reporting. */
-        RD(5, "dev_queue_xmit failed: HARD ERROR %d", ret);
+        RD(5, "xmit failed: HARD ERROR %d", ret);
     }
     return -1;
 }
 #endif /* WITH_GENERIC */
 
+#ifdef WITH_KTHREAD
+/* ####################### SYNC KTHREAD SUPPORT ###################### */
+
+struct nm_kthread {
+    struct task_struct *task;
+    wait_queue_head_t wq;
+    volatile int wakeup;
+    void (*fn)(void *);
+    void *arg;
+};
+
+static int
+nm_kthread_main(void *data)
+{
+    struct nm_kthread *t = data;
+
+    t->fn(t->arg);
+    /* kthread_stop() wants us to wait for it */
+    while (!kthread_should_stop())
+        schedule_timeout_interruptible(1);
+    return 0;
+}
+
+struct nm_kthread *
+nm_kthread_create(void (*fn)(void *), void *arg, int cpu, const char *name)
+{
+    struct nm_kthread *t;
+
+    t = kzalloc(sizeof(*t), GFP_ATOMIC);
+    if (t == NULL)
+        return NULL;
+    init_waitqueue_head(&t->wq);
+    t->fn = fn;
+    t->arg = arg;
+    t->task = kthread_create(nm_kthread_main, t, "nm_%s", name);
+    if (IS_ERR(t->task)) {
+        D("cannot create kthread for %s", name);
+        kfree(t);
+        return NULL;
+    }
+    if (cpu >= 0 && cpu < nr_cpu_ids && cpu_online(cpu))
+        kthread_bind(t->task, cpu);
+    wake_up_process(t->task);
+    return t;
+}
+
+void
+nm_kthread_stop(struct nm_kthread *t)
+{
+    kthread_stop(t->task);
+    kfree(t);
+}
+
+int
+nm_kthread_should_stop(struct nm_kthread *t)
+{
+    (void)t;
+    return kthread_should_stop();
+}
+
+void
+nm_kthread_sleep(struct nm_kthread *t, u_int timeout_us)
+{
+    wait_event_interruptible_timeout(t->wq,
+        t->wakeup || kthread_should_stop(), usecs_to_jiffies(timeout_us));
+    t->wakeup = 0;
+}
+
+void
+nm_kthread_wakeup(struct nm_kthread *t)
+{
+    t->wakeup = 1;
+    wake_up_interruptible(&t->wq);
+}
+#endif /* WITH_KTHREAD */
+
+/*
+ * Batched delivery to the stack of the packets from the host tx
+ * rings (NM_SEND_UP_BATCH). The packets of a txsync are queued on
+ * the per-cpu gro cells of the adapter, which run them through GRO
+ * when the bottom half is enabled again at the end of the batch.
+ * Without gro cells the batch is handed over as a list.
+ */
+void
+netmap_linux_gro_init(struct netmap_adapter *na)
+{
+#ifdef NETMAP_LINUX_HAVE_GRO_CELLS
+    struct netmap_hw_adapter *hwna = (struct netmap_hw_adapter *)na;
+
+    hwna->nm_gro_on = (gro_cells_init(&hwna->nm_gro, na->ifp) == 0);
+#endif /* HAVE_GRO_CELLS */
+}
+
+void
+netmap_linux_gro_fini(struct netmap_adapter *na)
+{
+#ifdef NETMAP_LINUX_HAVE_GRO_CELLS
+    struct netmap_hw_adapter *hwna = (struct netmap_hw_adapter *)na;
+
+    if (hwna->nm_gro_on) {
+	gro_cells_destroy(&hwna->nm_gro);
+	hwna->nm_gro_on = 0;
+    }
+#endif /* HAVE_GRO_CELLS */
+}
+
+void
+netmap_linux_send_up(struct ifnet *ifp, struct mbq *q)
+{
+    struct mbuf *m;
+#ifdef NETMAP_LINUX_HAVE_GRO_CELLS
+    struct netmap_hw_adapter *hwna = (struct netmap_hw_adapter *)NA(ifp);
+    int gro = NETMAP_CAPABLE(ifp) && hwna->nm_gro_on;
+#endif /* HAVE_GRO_CELLS */
+#ifdef NETMAP_LINUX_HAVE_RX_LIST
+    LIST_HEAD(list);
+#endif /* HAVE_RX_LIST */
+
+    local_bh_disable();
+    while ((m = mbq_dequeue(q)) != NULL) {
+	if (netmap_verbose & NM_VERB_HOST)
+	    D("sending up pkt %p size %d", m, MBUF_LEN(m));
+	/* let the generic rx handler pass it */
+	m->priority = NM_MAGIC_PRIORITY_RX;
+#ifdef NETMAP_LINUX_HAVE_GRO_CELLS
+	if (gro) {
+	    gro_cells_receive(&hwna->nm_gro, m);
+	    continue;
+	}
+#endif /* HAVE_GRO_CELLS */
+#ifdef NETMAP_LINUX_HAVE_RX_LIST
+	list_add_tail(&m->list, &list);
+#else
+	netif_receive_skb(m);
+#endif /* HAVE_RX_LIST */
+    }
+#ifdef NETMAP_LINUX_HAVE_RX_LIST
+    if (!list_empty(&list))
+	netif_receive_skb_list(&list);
+#endif /* HAVE_RX_LIST */
+    local_bh_enable();
+}
+
+/*
+ * Ring eventfds (NIOCSETEVFD). nm_evfd_signal() runs from the
+ * notify callbacks, possibly in interrupt context, so the context
+ * is published with RCU and detach waits for a grace period
+ * before releasing it.
+ */
+int
+nm_evfd_attach(struct netmap_kring *kring, int fd)
+{
+#ifdef NETMAP_LINUX_HAVE_EVENTFD
+    struct eventfd_ctx *ctx = eventfd_ctx_fdget(fd);
+
+    if (IS_ERR(ctx))
+	return -PTR_ERR(ctx);
+    rcu_assign_pointer(kring->nkr_evfd, ctx);
+    return 0;
+#else
+    return EOPNOTSUPP;
+#endif /* HAVE_EVENTFD */
+}
+
+void
+nm_evfd_detach(struct netmap_kring *kring)
+{
+#ifdef NETMAP_LINUX_HAVE_EVENTFD
+    struct eventfd_ctx *ctx = kring->nkr_evfd;
+
+    if (ctx == NULL)
+	return;
+    RCU_INIT_POINTER(kring->nkr_evfd, NULL);
+    synchronize_rcu();
+    eventfd_ctx_put(ctx);
+#endif /* HAVE_EVENTFD */
+}
+
+void
+nm_evfd_signal(struct netmap_kring *kring)
+{
+#ifdef NETMAP_LINUX_HAVE_EVENTFD
+    struct eventfd_ctx *ctx;
+
+    rcu_read_lock();
+    ctx = rcu_dereference(kring->nkr_evfd);
+    if (ctx)
+	NM_EVENTFD_SIGNAL(ctx);
+    rcu_read_unlock();
+#endif /* HAVE_EVENTFD */
+}
+
+#ifdef WITH_MONITOR
+/*
+ * Monitor filters (NIOCSETMONF). The BPF engine of linux only runs
+ * on skbs, so classic BPF programs are validated and interpreted
+ * here, directly on the netmap buffers.
+ */
+struct nm_bpf {
+    u_int len;
+    struct sock_filter insns[0];
+};
+
+/* the checks of bpf_validate() in FreeBSD: known opcodes, memory
+ * words in range, forward jumps inside the program, no division by
+ * a constant zero, and a return at the end.
+ */
+static int
+nm_bpf_validate(const struct sock_filter *f, u_int len)
+{
+    u_int i;
+
+    if (len == 0 || len > NM_BPF_MAXINSNS)
+	return 0;
+    for (i = 0; i < len; i++) {
+	const struct sock_filter *p = &f[i];
+
+	switch (BPF_CLASS(p->code)) {
+	case BPF_LD:
+	case BPF_LDX:
+	    switch (BPF_MODE(p->code)) {
+	    case BPF_IMM:
+	    case BPF_ABS:
+	    case BPF_IND:
+	    case BPF_LEN:
+		break;
+	    case BPF_MSH:
+		if (p->code != (BPF_LDX|BPF_MSH|BPF_B))
+		    return 0;
+		break;
+	    case BPF_MEM:
+		if (p->k >= BPF_MEMWORDS)
+		    return 0;
+		break;
+	    default:
+		return 0;
+	    }
+	    break;
+	case BPF_ST:
+	case BPF_STX:
+	    if (p->k >= BPF_MEMWORDS)
+		return 0;
+	    break;
+	case BPF_ALU:
+	    switch (BPF_OP(p->code)) {
+	    case BPF_ADD: case BPF_SUB: case BPF_MUL: case BPF_OR:
+	    case BPF_AND: case BPF_XOR: case BPF_LSH: case BPF_RSH:
+	    case BPF_NEG:
+		break;
+	    case BPF_DIV:
+	    case BPF_MOD:
+		if (BPF_SRC(p->code) == BPF_K && p->k == 0)
+		    return 0;
+		break;
+	    default:
+		return 0;
+	    }
+	    break;
+	case BPF_JMP:
+	    switch (BPF_OP(p->code)) {
+	    case BPF_JA:
+		if (p->k >= len - i - 1)
+		    return 0;
+		break;
+	    case BPF_JEQ: case BPF_JGT: case BPF_JGE: case BPF_JSET:
+		if (p->jt >= len - i - 1 || p->jf >= len - i - 1)
+		    return 0;
+		break;
+	    default:
+		return 0;
+	    }
+	    break;
+	case BPF_RET:
+	case BPF_MISC:
+	    break;
+	}
+    }
+    return BPF_CLASS(f[len - 1].code) == BPF_RET;
+}
+
+struct nm_bpf *
+nm_bpf_create(const void *insns, u_int len)
+{
+    struct nm_bpf *f;
+
+    if (!nm_bpf_validate(insns, len))
+	return NULL;
+    f = malloc(sizeof(*f) + len * sizeof(struct sock_filter), M_DEVBUF,
+	    M_NOWAIT);
+    if (f == NULL)
+	return NULL;
+    f->len = len;
+    memcpy(f->insns, insns, len * sizeof(struct sock_filter));
+    return f;
+}
+
+#define NM_BPF_LD32(p)	((u32)(p)[0] << 24 | (u32)(p)[1] << 16 | \
+			 (u32)(p)[2] << 8 | (p)[3])
+#define NM_BPF_LD16(p)	((u32)(p)[0] << 8 | (p)[1])
+
+u_int
+nm_bpf_run(struct nm_bpf *f, const void *pkt, u_int len)
+{
+    const struct sock_filter *pc = f->insns;
+    const u8 *p = pkt;
+    u32 A = 0, X = 0, k, mem[BPF_MEMWORDS];
+
+    /* a program can load a memory word before storing it */
+    memset(mem, 0, sizeof(mem));
+    for (;; pc++) {
+	switch (pc->code) {
+	default:		/* cannot happen after validation */
+	    return 0;
+	case BPF_RET|BPF_K:
+	    return pc->k;
+	case BPF_RET|BPF_A:
+	    return A;
+	case BPF_LD|BPF_W|BPF_ABS:
+	case BPF_LD|BPF_W|BPF_IND:
+	    k = pc->k;
+	    if (BPF_MODE(pc->code) == BPF_IND) {
+		if (X > len || k > len - X)
+		    return 0;
+		k += X;
+	    }
+	    if (k > len || len - k < 4)
+		return 0;
+	    A = NM_BPF_LD32(p + k);
+	    continue;
+	case BPF_LD|BPF_H|BPF_ABS:
+	case BPF_LD|BPF_H|BPF_IND:
+	    k = pc->k;
+	    if (BPF_MODE(pc->code) == BPF_IND) {
+		if (X > len || k > len - X)
+		    return 0;
+		k += X;
+	    }
+	    if (k > len || len - k < 2)
+		return 0;
+	    A = NM_BPF_LD16(p + k);
+	    continue;
+	case BPF_LD|BPF_B|BPF_ABS:
+	case BPF_LD|BPF_B|BPF_IND:
+	    k = pc->k;
+	    if (BPF_MODE(pc->code) == BPF_IND) {
+		if (X > len || k > len - X)
+		    return 0;
+		k += X;
+	    }
+	    if (k >= len)
+		return 0;
+	    A = p[k];
+	    continue;
+	case BPF_LD|BPF_W|BPF_LEN:
+	    A = len;
+	    continue;
+	case BPF_LDX|BPF_W|BPF_LEN:
+	    X = len;
+	    continue;
+	case BPF_LDX|BPF_MSH|BPF_B:
+	    if (pc->k >= len)
+		return 0;
+	    X = (p[pc->k] & 0xf) << 2;
+	    continue;
+	case BPF_LD|BPF_IMM:
+	    A = pc->k;
+	    continue;
+	case BPF_LDX|BPF_IMM:
+	    X = pc->k;
+	    continue;
+	case BPF_LD|BPF_MEM:
+	    A = mem[pc->k];
+	    continue;
+	case BPF_LDX|BPF_MEM:
+	    X = mem[pc->k];
+	    continue;
+	case BPF_ST:
+	    mem[pc->k] = A;
+	    continue;
+	case BPF_STX:
+	    mem[pc->k] = X;
+	    continue;
+	case BPF_JMP|BPF_JA:
+	    pc += pc->k;
+	    continue;
+	case BPF_JMP|BPF_JGT|BPF_K:
+	    pc += (A > pc->k) ? pc->jt : pc->jf;
+	    continue;
+	case BPF_JMP|BPF_JGE|BPF_K:
+	    pc += (A >= pc->k) ? pc->jt : pc->jf;
+	    continue;
+	case BPF_JMP|BPF_JEQ|BPF_K:
+	    pc += (A == pc->k) ? pc->jt : pc->jf;
+	    continue;
+	case BPF_JMP|BPF_JSET|BPF_K:
+	    pc += (A & pc->k) ? pc->jt : pc->jf;
+	    continue;
+	case BPF_JMP|BPF_JGT|BPF_X:
+	    pc += (A > X) ? pc->jt : pc->jf;
+	    continue;
+	case BPF_JMP|BPF_JGE|BPF_X:
+	    pc += (A >= X) ? pc->jt : pc->jf;
+	    continue;
+	case BPF_JMP|BPF_JEQ|BPF_X:
+	    pc += (A == X) ? pc->jt : pc->jf;
+	    continue;
+	case BPF_JMP|BPF_JSET|BPF_X:
+	    pc += (A & X) ? pc->jt : pc->jf;
+	    continue;
+	case BPF_ALU|BPF_ADD|BPF_X:
+	    A += X;
+	    continue;
+	case BPF_ALU|BPF_SUB|BPF_X:
+	    A -= X;
+	    continue;
+	case BPF_ALU|BPF_MUL|BPF_X:
+	    A *= X;
+	    continue;
+	case BPF_ALU|BPF_DIV|BPF_X:
+	    if (X == 0)
+		return 0;
+	    A /= X;
+	    continue;
+	case BPF_ALU|BPF_MOD|BPF_X:
+	    if (X == 0)
+		return 0;
+	    A %= X;
+	    continue;
+	case BPF_ALU|BPF_AND|BPF_X:
+	    A &= X;
+	    continue;
+	case BPF_ALU|BPF_OR|BPF_X:
+	    A |= X;
+	    continue;
+	case BPF_ALU|BPF_XOR|BPF_X:
+	    A ^= X;
+	    continue;
+	case BPF_ALU|BPF_LSH|BPF_X:
+	    A = X < 32 ? A << X : 0;
+	    continue;
+	case BPF_ALU|BPF_RSH|BPF_X:
+	    A = X < 32 ? A >> X : 0;
+	    continue;
+	case BPF_ALU|BPF_ADD|BPF_K:
+	    A += pc->k;
+	    continue;
+	case BPF_ALU|BPF_SUB|BPF_K:
+	    A -= pc->k;
+	    continue;
+	case BPF_ALU|BPF_MUL|BPF_K:
+	    A *= pc->k;
+	    continue;
+	case BPF_ALU|BPF_DIV|BPF_K:
+	    A /= pc->k;
+	    continue;
+	case BPF_ALU|BPF_MOD|BPF_K:
+	    A %= pc->k;
+	    continue;
+	case BPF_ALU|BPF_AND|BPF_K:
+	    A &= pc->k;
+	    continue;
+	case BPF_ALU|BPF_OR|BPF_K:
+	    A |= pc->k;
+	    continue;
+	case BPF_ALU|BPF_XOR|BPF_K:
+	    A ^= pc->k;
+	    continue;
+	case BPF_ALU|BPF_LSH|BPF_K:
+	    A = pc->k < 32 ? A << pc->k : 0;
+	    continue;
+	case BPF_ALU|BPF_RSH|BPF_K:
+	    A = pc->k < 32 ? A >> pc->k : 0;
+	    continue;
+	case BPF_ALU|BPF_NEG:
+	    A = -A;
+	    continue;
+	case BPF_MISC|BPF_TAX:
+	    X = A;
+	    continue;
+	case BPF_MISC|BPF_TXA:
+	    A = X;
+	    continue;
+	}
+    }
+}
+
+void
+nm_bpf_destroy(struct nm_bpf *f)
+{
+    free(f, M_DEVBUF);
+}
+#endif /* WITH_MONITOR */
+
 /* Use ethtool to find the current NIC rings lengths, so that the netmap
    rings can have the same lengths. */
 int
@@ -575,6 +1235,11 @@ linux_netmap_ioctl(struct file *file, u_int cmd, u_long data /* arg */)
 	union {
 		struct nm_ifreq ifr;
 		struct nmreq nmr;
+		struct nm_mem_info nmi;
+		struct nm_syncv nsv;
+		struct nm_evfd_req nef;
+		struct nm_monf_req nmf;
+		struct nm_mit_req nmi_mit;
 	} arg;
 	size_t argsize = 0;
 
@@ -585,6 +1250,21 @@ linux_netmap_ioctl(struct file *file, u_int cmd, u_long data /* arg */)
 	case NIOCCONFIG:
 		argsize = sizeof(arg.ifr);
 		break;
+	case NIOCMEMINFO:
+		argsize = sizeof(arg.nmi);
+		break;
+	case NIOCSYNCV:
+		argsize = sizeof(arg.nsv);
+		break;
+	case NIOCSETEVFD:
+		argsize = sizeof(arg.nef);
+		break;
+	case NIOCSETMONF:
+		argsize = sizeof(arg.nmf);
+		break;
+	case NIOCSETMIT:
+		argsize = sizeof(arg.nmi_mit);
+		break;
 	default:
 		argsize = sizeof(arg.nmr);
 		break;
@@ -640,6 +1320,37 @@ static struct file_operations netmap_fops = {
 };
 
 
+/*
+ * td is the file of the ioctl on linux, see devfs_get_cdevpriv()
+ * in bsd_glue.h
+ */
+int
+netmap_fd_get_priv(struct thread *td, int fd,
+	struct netmap_priv_d **priv, void **ref)
+{
+	struct file *filp = fget(fd);
+
+	(void)td;
+	if (!filp)
+		return EBADF;
+	if (filp->f_op != &netmap_fops || filp->private_data == NULL) {
+		fput(filp);
+		return EBADF;
+	}
+	*priv = (struct netmap_priv_d *)filp->private_data;
+	*ref = filp;
+	return 0;
+}
+
+
+void
+netmap_fd_put_priv(struct thread *td, void *ref)
+{
+	(void)td;
+	fput((struct file *)ref);
+}
+
+
 
 #ifdef WITH_V1000
 /* ##################### V1000 BACKEND SUPPORT ##################### */
@@ -821,7 +1532,7 @@ static int netmap_common_sendmsg(struct netmap_adapter *na, struct msghdr *m,
     nm_buf_size = ring->nr_buf_size;
 
     i = last = ring->cur;
-    avail = ring->tail + ring->num_slots - ring->cur;
+    avail = nm_ring_tail(kring) + ring->num_slots - ring->cur;
     if (avail >= ring->num_slots)
 	avail -= ring->num_slots;
 
@@ -976,7 +1687,7 @@ static int netmap_common_recvmsg(struct netmap_adapter *na,
 	ring = na->rx_rings[0].ring;
 	i = ring->cur;
 
-	avail = ring->tail + ring->num_slots - ring->cur;
+	avail = nm_ring_tail(&na->rx_rings[0]) + ring->num_slots - ring->cur;
 	if (avail >= ring->num_slots)
 	    avail -= ring->num_slots;
 
@@ -1449,6 +2160,69 @@ netmap_bns_unregister(void)
 #endif
 
 
+/* ######################## ALLOCATOR STATS ####################### */
+
+/*
+ * Read-only module parameter exporting the statistics of the
+ * memory allocators (dev.netmap.mem_stats on FreeBSD).
+ * The output is truncated to one page.
+ */
+static int
+linux_netmap_mem_stats_get(char *buffer, const struct kernel_param *kp)
+{
+	(void)kp;	/* UNUSED */
+	return netmap_mem_print_stats(buffer, PAGE_SIZE);
+}
+
+static struct kernel_param_ops linux_netmap_mem_stats_ops = {
+	.get = linux_netmap_mem_stats_get,
+};
+module_param_cb(mem_stats, &linux_netmap_mem_stats_ops, NULL, 0444);
+
+/* busy-poll statistics of poll() (dev.netmap.poll_stats on FreeBSD) */
+static int
+linux_netmap_poll_stats_get(char *buffer, const struct kernel_param *kp)
+{
+	(void)kp;	/* UNUSED */
+	return netmap_poll_print_stats(buffer, PAGE_SIZE);
+}
+
+static struct kernel_param_ops linux_netmap_poll_stats_ops = {
+	.get = linux_netmap_poll_stats_get,
+};
+module_param_cb(poll_stats, &linux_netmap_poll_stats_ops, NULL, 0444);
+
+#ifdef WITH_PIPES
+/* pipe load balancers (dev.netmap.pipe_lb_stats on FreeBSD) */
+static int
+linux_netmap_pipe_lb_stats_get(char *buffer, const struct kernel_param *kp)
+{
+	(void)kp;	/* UNUSED */
+	return netmap_pipe_lb_print_stats(buffer, PAGE_SIZE);
+}
+
+static struct kernel_param_ops linux_netmap_pipe_lb_stats_ops = {
+	.get = linux_netmap_pipe_lb_stats_get,
+};
+module_param_cb(pipe_lb_stats, &linux_netmap_pipe_lb_stats_ops, NULL, 0444);
+#endif /* WITH_PIPES */
+
+#ifdef WITH_GENERIC
+/* rx mitigation of the generic adapters (dev.netmap.generic_mit_stats) */
+static int
+linux_netmap_generic_mit_stats_get(char *buffer, const struct kernel_param *kp)
+{
+	(void)kp;	/* UNUSED */
+	return netmap_generic_mit_print_stats(buffer, PAGE_SIZE);
+}
+
+static struct kernel_param_ops linux_netmap_generic_mit_stats_ops = {
+	.get = linux_netmap_generic_mit_stats_get,
+};
+module_param_cb(generic_mit_stats, &linux_netmap_generic_mit_stats_ops, NULL, 0444);
+#endif /* WITH_GENERIC */
+
+
 /* ########################## MODULE INIT ######################### */
 
 struct miscdevice netmap_cdevsw = { /* same name as FreeBSD */
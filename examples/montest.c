@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) 2014 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A test of the copy monitors of a VALE port under load.
+ *
+ * The main thread sends packets of len bytes on a VALE port as fast
+ * as it can, like pkt-gen -f tx. A second thread reads a copy
+ * monitor (NR_MONITOR_COPY) of the tx ring of the port, with a
+ * snaplen shorter than the packets, and sleeps between reads so
+ * that the monitor cannot keep up. Two runs are made:
+ *
+ *	drop	the monitor loses packets: each one sent must be
+ *		either received, or counted in ring->mon_drops;
+ *	block	the monitor also has NR_MONITOR_BLOCK: the sender
+ *		is slowed down, and every packet is received.
+ *
+ * A third run repeats the block one on the master end of a pipe of
+ * the port ({1), while the main thread also drains the slave end
+ * (}1). In all the runs the sender fails if its ring stays full for
+ * several seconds.
+ *
+ * In both runs every packet received must be cut to the snaplen
+ * (slot->len), carry the original length (slot->ptr), and be
+ * counted in ring->mon_truncs. The program exits with 1 if any of
+ * the checks fails.
+ */
+
+#include <stdio.h>
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+
+static volatile int do_abort = 0;
+
+struct mt_arg {
+	struct nm_desc *d;	/* the monitor */
+	pthread_t thread;
+	uint64_t count;		/* packets sent */
+	u_int len;		/* packet length */
+	u_int snaplen;
+	u_int delay_us;		/* sleep between reads */
+	volatile int sent_all;	/* the sender is done */
+	uint64_t received;
+	uint64_t bad;		/* wrong len or ptr */
+};
+
+static void
+sigint_h(int sig)
+{
+	(void)sig;	/* UNUSED */
+	do_abort = 1;
+	signal(SIGINT, SIG_DFL);
+}
+
+/* read the monitor slowly, until all the packets are accounted for */
+static void *
+monitor_body(void *data)
+{
+	struct mt_arg *a = data;
+	struct netmap_ring *ring = NETMAP_RXRING(a->d->nifp, 0);
+	u_int idle = 0;
+
+	while (!do_abort) {
+		u_int head = ring->head;
+
+		ioctl(a->d->fd, NIOCRXSYNC, NULL);
+		if (a->received + ring->mon_drops >= a->count && a->sent_all)
+			break;
+		if (nm_ring_empty(ring)) {
+			/* give up if nothing comes after the sender is done */
+			if (a->sent_all && ++idle > 1000)
+				break;
+			usleep(a->delay_us);
+			continue;
+		}
+		idle = 0;
+		for (; head != ring->tail; head = nm_ring_next(ring, head)) {
+			struct netmap_slot *slot = &ring->slot[head];
+
+			if (slot->len != a->snaplen || slot->ptr != a->len)
+				a->bad++;
+			a->received++;
+		}
+		ring->head = ring->cur = head;
+		usleep(a->delay_us);
+	}
+	return NULL;
+}
+
+/* release all the slots of the slave end of a pipe */
+static void
+drain(struct nm_desc *s)
+{
+	struct netmap_ring *ring = NETMAP_RXRING(s->nifp, 0);
+
+	ioctl(s->fd, NIOCRXSYNC, NULL);
+	ring->head = ring->cur = ring->tail;
+}
+
+/* send count packets of len bytes, and wait until they are gone.
+ * If s is not NULL d is a pipe, and s its other end.
+ */
+static int
+send_pkts(struct nm_desc *d, struct nm_desc *s, uint64_t count, u_int len)
+{
+	struct netmap_ring *ring = NETMAP_TXRING(d->nifp, 0);
+	uint64_t sent = 0;
+	u_int idle = 0;
+
+	while (sent < count || nm_tx_pending(ring)) {
+		u_int head = ring->head, n = nm_ring_space(ring);
+
+		if (do_abort)
+			return -1;
+		if (s != NULL)
+			drain(s);
+		if (n > count - sent)
+			n = count - sent;
+		for (sent += n; n > 0; n--) {
+			struct netmap_slot *slot = &ring->slot[head];
+
+			memset(NETMAP_BUF(ring, slot->buf_idx), 0x5a, len);
+			slot->len = len;
+			head = nm_ring_next(ring, head);
+		}
+		ring->head = ring->cur = head;
+		ioctl(d->fd, NIOCTXSYNC, NULL);
+		if (nm_ring_space(ring) != 0) {
+			idle = 0;
+		} else if (++idle > 100000) {
+			D("sender stalled after %llu packets",
+				(unsigned long long)sent);
+			return -1;
+		} else {
+			usleep(10);
+		}
+	}
+	return 0;
+}
+
+/* one run, returns the number of failed checks. If slave is not
+ * NULL, port is the master end of a pipe and slave the other one.
+ */
+static int
+run(const char *port, const char *slave, struct mt_arg *a,
+	uint32_t mflags)
+{
+	struct nmreq req;
+	struct nm_desc *d, *s = NULL;
+	struct netmap_ring *ring;
+	int fail = 0;
+
+	d = nm_open(port, NULL, 0, NULL);
+	if (d == NULL) {
+		D("cannot open %s", port);
+		return 1;
+	}
+	if (slave != NULL) {
+		s = nm_open(slave, NULL, 0, NULL);
+		if (s == NULL) {
+			D("cannot open %s", slave);
+			nm_close(d);
+			return 1;
+		}
+	}
+	memset(&req, 0, sizeof(req));
+	req.nr_flags = NR_MONITOR_TX | NR_MONITOR_COPY | mflags;
+	req.nr_arg1 = a->snaplen;
+	a->d = nm_open(port, &req, 0, NULL);
+	if (a->d == NULL) {
+		D("cannot open the monitor of %s", port);
+		if (s != NULL)
+			nm_close(s);
+		nm_close(d);
+		return 1;
+	}
+	ring = NETMAP_RXRING(a->d->nifp, 0);
+	a->sent_all = 0;
+	a->received = a->bad = 0;
+
+	pthread_create(&a->thread, NULL, monitor_body, a);
+	if (send_pkts(d, s, a->count, a->len))
+		fail++;
+	a->sent_all = 1;
+	pthread_join(a->thread, NULL);
+
+	printf("%s%s: sent %llu received %llu mon_drops %llu mon_truncs %llu\n",
+		(mflags & NR_MONITOR_BLOCK) ? "block" : "drop",
+		s != NULL ? " (pipe)" : "",
+		(unsigned long long)a->count,
+		(unsigned long long)a->received,
+		(unsigned long long)ring->mon_drops,
+		(unsigned long long)ring->mon_truncs);
+	if (a->received + ring->mon_drops != a->count) {
+		D("%llu packets not accounted for", (unsigned long long)
+			(a->count - a->received - ring->mon_drops));
+		fail++;
+	}
+	if (ring->mon_truncs != a->received) {
+		D("mon_truncs does not match the packets received");
+		fail++;
+	}
+	if (a->bad) {
+		D("%llu packets with wrong len or ptr",
+			(unsigned long long)a->bad);
+		fail++;
+	}
+	if ((mflags & NR_MONITOR_BLOCK) && ring->mon_drops) {
+		D("blocking monitor dropped packets");
+		fail++;
+	}
+	nm_close(a->d);
+	if (s != NULL)
+		nm_close(s);
+	nm_close(d);
+	return fail;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: montest [-i port] [-n packets] [-l len] [-s snaplen]"
+	    " [-d delay]\n"
+	    "\t-i port	VALE port to send on (default vale0:mt)\n"
+	    "\t-d delay	sleep of the monitor between reads, in us\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mt_arg a;
+	char *port = "vale0:mt";
+	char master[64], slave[64];
+	int ch, fail;
+
+	memset(&a, 0, sizeof(a));
+	a.count = 1000000;
+	a.len = 256;
+	a.snaplen = 64;
+	a.delay_us = 100;
+
+	while ((ch = getopt(argc, argv, "i:n:l:s:d:")) != -1) {
+		switch (ch) {
+		case 'i':
+			port = optarg;
+			break;
+		case 'n':
+			a.count = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			a.len = atoi(optarg);
+			break;
+		case 's':
+			a.snaplen = atoi(optarg);
+			break;
+		case 'd':
+			a.delay_us = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	/* every packet must be truncated */
+	if (a.len < 60 || a.len > 2048 || a.snaplen == 0 ||
+	    a.snaplen >= a.len)
+		usage();
+	signal(SIGINT, sigint_h);
+
+	snprintf(master, sizeof(master), "%s{1", port);
+	snprintf(slave, sizeof(slave), "%s}1", port);
+
+	fail = run(port, NULL, &a, 0);
+	fail += run(port, NULL, &a, NR_MONITOR_BLOCK);
+	fail += run(master, slave, &a, NR_MONITOR_BLOCK);
+	printf("%s\n", fail ? "FAILED" : "OK");
+	return fail ? 1 : 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2014 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A ping-pong benchmark over the two ends of a netmap pipe.
+ *
+ * One thread sends a packet on the master end and waits for it to
+ * come back, the other thread echoes it from the slave end.
+ * The two threads should run on different cores (-a), so that
+ * the result shows the cost of moving the ring state between the
+ * caches of the producer and the consumer. Build the program with
+ * -DNETMAP_WITH_RING_V2 (pingpong-v2) to compare the two ring
+ * layouts, see struct netmap_ring in <net/netmap.h>.
+ */
+
+#define _GNU_SOURCE	/* for CPU_SET() */
+#include <stdio.h>
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef linux
+#define cpuset_t        cpu_set_t
+#endif  /* linux */
+
+#ifdef __FreeBSD__
+#include <pthread_np.h> /* pthread w/ affinity */
+#include <sys/cpuset.h> /* cpu_set */
+#endif  /* __FreeBSD__ */
+
+#ifdef __APPLE__
+#define cpuset_t        uint64_t        // XXX
+static inline void CPU_ZERO(cpuset_t *p)
+{
+        *p = 0;
+}
+
+static inline void CPU_SET(uint32_t i, cpuset_t *p)
+{
+        *p |= 1<< (i & 0x3f);
+}
+
+#define pthread_setaffinity_np(a, b, c) ((void)a, 0)
+#endif  /* __APPLE__ */
+
+static volatile int do_abort = 0;
+
+struct pp_arg {
+	struct nm_desc *d;
+	pthread_t thread;
+	int affinity;
+	uint64_t count;		/* round trips to do */
+	u_int batch;		/* packets per round trip */
+	u_int len;		/* packet length */
+	uint64_t done;		/* round trips done */
+};
+
+static void
+sigint_h(int sig)
+{
+	(void)sig;	/* UNUSED */
+	do_abort = 1;
+	signal(SIGINT, SIG_DFL);
+}
+
+/* set the thread affinity. */
+static int
+setaffinity(pthread_t me, int i)
+{
+	cpuset_t cpumask;
+
+	if (i == -1)
+		return 0;
+
+	CPU_ZERO(&cpumask);
+	CPU_SET(i, &cpumask);
+
+	if (pthread_setaffinity_np(me, sizeof(cpuset_t), &cpumask) != 0) {
+		D("Unable to set affinity: %s", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/* busy wait for at least one packet on the rx ring */
+static int
+wait_rx(struct nm_desc *d, struct netmap_ring *rxring)
+{
+	while (nm_ring_empty(rxring)) {
+		if (do_abort)
+			return -1;
+		ioctl(d->fd, NIOCRXSYNC, NULL);
+	}
+	return 0;
+}
+
+/* send up to 'n' packets of 'len' bytes, return the number sent */
+static u_int
+send_pkts(struct netmap_ring *txring, u_int n, u_int len, const void *src)
+{
+	u_int i, head = txring->head, space = nm_ring_space(txring);
+
+	if (n > space)
+		n = space;
+	for (i = 0; i < n; i++) {
+		struct netmap_slot *slot = &txring->slot[head];
+
+		if (src)
+			nm_pkt_copy(src, NETMAP_BUF(txring, slot->buf_idx), len);
+		slot->len = len;
+		head = nm_ring_next(txring, head);
+	}
+	txring->head = txring->cur = head;
+	return n;
+}
+
+static void *
+ping_body(void *data)
+{
+	struct pp_arg *a = data;
+	struct netmap_ring *txring = NETMAP_TXRING(a->d->nifp, 0);
+	struct netmap_ring *rxring = NETMAP_RXRING(a->d->nifp, 0);
+	char pkt[2048];
+
+	setaffinity(pthread_self(), a->affinity);
+	memset(pkt, 0x5a, sizeof(pkt));
+	for (a->done = 0; a->done < a->count; a->done++) {
+		u_int got = 0;
+
+		send_pkts(txring, a->batch, a->len, pkt);
+		ioctl(a->d->fd, NIOCTXSYNC, NULL);
+		while (got < a->batch) {
+			if (wait_rx(a->d, rxring))
+				return NULL;
+			got += nm_ring_space(rxring);
+			rxring->head = rxring->cur = rxring->tail;
+		}
+	}
+	return NULL;
+}
+
+static void *
+pong_body(void *data)
+{
+	struct pp_arg *a = data;
+	struct netmap_ring *txring = NETMAP_TXRING(a->d->nifp, 0);
+	struct netmap_ring *rxring = NETMAP_RXRING(a->d->nifp, 0);
+
+	setaffinity(pthread_self(), a->affinity);
+	while (!do_abort) {
+		u_int n, head;
+
+		if (wait_rx(a->d, rxring))
+			break;
+		/* echo the packets, the payload is not checked */
+		n = send_pkts(txring, nm_ring_space(rxring), a->len, NULL);
+		for (head = rxring->head; n > 0; n--)
+			head = nm_ring_next(rxring, head);
+		rxring->head = rxring->cur = head;
+		ioctl(a->d->fd, NIOCTXSYNC, NULL);
+	}
+	return NULL;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: pingpong [-i port] [-n rounds] [-b batch] [-l len]"
+	    " [-a cpu] [-A cpu]\n"
+	    "\t-i port	VALE port or NIC whose pipe 0 is used"
+	    " (default vale0:pp)\n"
+	    "\t-a, -A	cores for the ping and pong threads\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct pp_arg ping, pong;
+	char *port = "vale0:pp", name[64];
+	struct timespec t0, t1;
+	double ns;
+	int ch;
+
+	memset(&ping, 0, sizeof(ping));
+	memset(&pong, 0, sizeof(pong));
+	ping.affinity = pong.affinity = -1;
+	ping.count = 1000000;
+	ping.batch = 1;
+	ping.len = 60;
+
+	while ((ch = getopt(argc, argv, "i:n:b:l:a:A:")) != -1) {
+		switch (ch) {
+		case 'i':
+			port = optarg;
+			break;
+		case 'n':
+			ping.count = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			ping.batch = atoi(optarg);
+			break;
+		case 'l':
+			ping.len = atoi(optarg);
+			break;
+		case 'a':
+			ping.affinity = atoi(optarg);
+			break;
+		case 'A':
+			pong.affinity = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (ping.batch < 1 || ping.len < 60 || ping.len > 2048)
+		usage();
+	pong.len = ping.len;
+
+	snprintf(name, sizeof(name), "%s{0", port);
+	ping.d = nm_open(name, NULL, 0, NULL);
+	snprintf(name, sizeof(name), "%s}0", port);
+	pong.d = nm_open(name, NULL, 0, NULL);
+	if (ping.d == NULL || pong.d == NULL) {
+		D("cannot open the ends of %s{0", port);
+		return 1;
+	}
+	if (ping.batch >= ping.d->some_ring->num_slots)
+		ping.batch = ping.d->some_ring->num_slots - 1;
+	signal(SIGINT, sigint_h);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_create(&pong.thread, NULL, pong_body, &pong);
+	pthread_create(&ping.thread, NULL, ping_body, &ping);
+	pthread_join(ping.thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	do_abort = 1;
+	pthread_join(pong.thread, NULL);
+
+	ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	printf("ring layout v%d, %llu round trips of %u packets, "
+		"%.1f ns per round trip\n",
+		NETMAP_RING_LAYOUT ? 2 : 1,
+		(unsigned long long)ping.done, ping.batch,
+		ping.done ? ns / ping.done : 0.0);
+	nm_close(ping.d);
+	nm_close(pong.d);
+	return 0;
+}
@@ -661,7 +661,7 @@ do_nmr_dump()
 		printf(", MONITOR_RX");
 	}
 	printf("]\n");
-	printf("spare2[0]: %x\n", curr_nmr.spare2[0]);
+	printf("nr_busy_poll: %u\n", curr_nmr.nr_busy_poll);
 }
 
 void
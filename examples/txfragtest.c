@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2014 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A test of the tx completions of multi-slot packets.
+ *
+ * The program sends packets of several slots each (NS_MOREFRAG) on
+ * the first tx ring of a port, filling the ring (the last packet
+ * may be incomplete), and then blocks in poll() until there is room
+ * again. On a port in emulated mode (dev.netmap.admode=2, e.g. one
+ * end of a veth pair) the slots are only given back when the driver
+ * frees the mbufs, and poll() sleeps until a completion event: if
+ * no event is armed on a packet in flight, poll() times out with
+ * the ring full and the test fails.
+ * At the end it waits for all the packets to complete. The program
+ * exits with 1 if any of the checks fails.
+ */
+
+#include <stdio.h>
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>
+#include <sys/poll.h>
+#include <sys/ioctl.h>
+
+static volatile int do_abort = 0;
+
+static void
+sigint_h(int sig)
+{
+	(void)sig;	/* UNUSED */
+	do_abort = 1;
+	signal(SIGINT, SIG_DFL);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: txfragtest [-i port] [-n packets] [-f frags] [-l len]"
+	    " [-t timeout]\n"
+	    "\t-i port	port in emulated mode (default netmap:veth0)\n"
+	    "\t-f frags	slots per packet\n"
+	    "\t-l len	bytes per slot\n"
+	    "\t-t timeout	of poll(), in ms\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	char *port = "netmap:veth0";
+	uint64_t count = 1000000, sent = 0, fulls = 0;
+	u_int frags = 4, len = 512, f = 0;
+	int ch, i, timeout = 2000, fail = 0;
+	struct nm_desc *d;
+	struct netmap_ring *ring;
+	struct pollfd pfd;
+
+	while ((ch = getopt(argc, argv, "i:n:f:l:t:")) != -1) {
+		switch (ch) {
+		case 'i':
+			port = optarg;
+			break;
+		case 'n':
+			count = strtoull(optarg, NULL, 0);
+			break;
+		case 'f':
+			frags = atoi(optarg);
+			break;
+		case 'l':
+			len = atoi(optarg);
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (frags < 2 || len < 60 || len > 2048 || timeout <= 0)
+		usage();
+	signal(SIGINT, sigint_h);
+
+	d = nm_open(port, NULL, 0, NULL);
+	if (d == NULL) {
+		D("cannot open %s", port);
+		return 1;
+	}
+	ring = NETMAP_TXRING(d->nifp, d->first_tx_ring);
+	if (frags >= ring->num_slots) {
+		D("%u slots per packet do not fit in %u", frags,
+			ring->num_slots);
+		nm_close(d);
+		return 1;
+	}
+	pfd.fd = d->fd;
+	pfd.events = POLLOUT;
+
+	while (sent < count && !do_abort) {
+		u_int head = ring->head, n = nm_ring_space(ring);
+		int ret;
+
+		/* fill the ring, f is the slot in the packet */
+		for (; n > 0 && sent < count; n--) {
+			struct netmap_slot *slot = &ring->slot[head];
+
+			memset(NETMAP_BUF(ring, slot->buf_idx), 0x5a, len);
+			slot->len = len;
+			if (++f < frags) {
+				slot->flags = NS_MOREFRAG;
+			} else {
+				slot->flags = 0;
+				f = 0;
+				sent++;
+			}
+			head = nm_ring_next(ring, head);
+		}
+		ring->head = ring->cur = head;
+		if (sent == count)
+			break;
+		/* the ring is full, sleep until a completion */
+		fulls++;
+		ret = poll(&pfd, 1, timeout);
+		if (ret < 0) {
+			D("poll error %d", errno);
+			fail++;
+			break;
+		}
+		if (ret == 0 && nm_ring_space(ring) == 0) {
+			D("tx stalled after %llu packets",
+				(unsigned long long)sent);
+			fail++;
+			break;
+		}
+	}
+	/* wait for the last packets, without events */
+	for (i = 0; !fail && nm_tx_pending(ring) && i < timeout; i++) {
+		ioctl(d->fd, NIOCTXSYNC, NULL);
+		usleep(1000);
+	}
+	if (!fail && nm_tx_pending(ring)) {
+		D("%u slots never completed",
+			ring->num_slots - 1 - nm_ring_space(ring));
+		fail++;
+	}
+	printf("sent %llu packets of %u slots, ring full %llu times\n",
+		(unsigned long long)sent, frags, (unsigned long long)fulls);
+	nm_close(d);
+	printf("%s\n", fail || do_abort ? "FAILED" : "OK");
+	return fail || do_abort ? 1 : 0;
+}
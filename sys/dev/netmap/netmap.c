@@ -441,6 +441,8 @@ ports attached to the switch)
 #include <sys/socketvar.h>	/* struct socket */
 #include <sys/malloc.h>
 #include <sys/poll.h>
+#include <sys/proc.h>	/* maybe_yield() */
+#include <sys/smp.h>	/* mp_maxid */
 #include <sys/rwlock.h>
 #include <sys/socket.h> /* sockaddrs */
 #include <sys/selinfo.h>
@@ -526,6 +528,10 @@ int netmap_adaptive_io = 0;
 SYSCTL_INT(_dev_netmap, OID_AUTO, adaptive_io, CTLFLAG_RW,
     &netmap_adaptive_io, 0 , "Adaptive I/O on paravirt");
 
+int netmap_busy_poll = 0;	/* default busy-poll budget, us */
+SYSCTL_INT(_dev_netmap, OID_AUTO, busy_poll, CTLFLAG_RW,
+    &netmap_busy_poll, 0 , "Busy-poll budget of poll() in microseconds");
+
 int netmap_flags = 0;	/* debug flags */
 int netmap_fwd = 0;	/* force transparent mode */
 int netmap_mmap_unreg = 0; /* allow mmap of unregistered fds */
@@ -541,16 +547,28 @@ enum { NETMAP_ADMODE_BEST = 0,	/* use native, fallback to generic */
 static int netmap_admode = NETMAP_ADMODE_BEST;
 
 int netmap_generic_mit = 100*1000;   /* Generic mitigation interval in nanoseconds. */
+int netmap_generic_mit_min = 0;	/* lower bound of the adaptive interval */
 int netmap_generic_ringsize = 1024;   /* Generic ringsize. */
 int netmap_generic_rings = 1;   /* number of queues in generic. */
+int netmap_generic_txzc = 0;	/* zero-copy generic tx from this len */
+int netmap_host_rings = 1;	/* host ring pairs of hw ports */
+int netmap_host_notify_batch = 32; /* see netmap_transmit() */
 
 SYSCTL_INT(_dev_netmap, OID_AUTO, flags, CTLFLAG_RW, &netmap_flags, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, fwd, CTLFLAG_RW, &netmap_fwd, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, mmap_unreg, CTLFLAG_RW, &netmap_mmap_unreg, 0, "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, admode, CTLFLAG_RW, &netmap_admode, 0 , "");
-SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit, CTLFLAG_RW, &netmap_generic_mit, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit, CTLFLAG_RW, &netmap_generic_mit, 0 ,
+	"max generic rx mitigation delay (ns) of new rings, 0 to disable");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit_min, CTLFLAG_RW, &netmap_generic_mit_min, 0 ,
+	"min generic rx mitigation delay (ns) of new rings");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_ringsize, CTLFLAG_RW, &netmap_generic_ringsize, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_rings, CTLFLAG_RW, &netmap_generic_rings, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_txzc, CTLFLAG_RW, &netmap_generic_txzc, 0 ,
+	"min length of the zero-copy generic tx (linux), 0 to disable");
+SYSCTL_INT(_dev_netmap, OID_AUTO, host_rings, CTLFLAG_RW, &netmap_host_rings, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, host_notify_batch, CTLFLAG_RW,
+	&netmap_host_notify_batch, 0 , "");
 
 NMG_LOCK_T	netmap_global_lock;
 
@@ -717,9 +735,14 @@ nm_dump_buf(char *p, int len, int lim, char *dst)
 }
 
 
+static int netmap_hw_krings_create(struct netmap_adapter *);
+
 /*
  * Fetch configuration from the device, to cope with dynamic
  * reconfigurations after loading the module.
+ * The number of host rings of hw ports (native and generic)
+ * is taken from dev.netmap.host_rings while the krings do
+ * not exist.
  */
 /* call with NMG_LOCK held */
 int
@@ -727,6 +750,17 @@ netmap_update_config(struct netmap_adapter *na)
 {
 	u_int txr, txd, rxr, rxd;
 
+	if (na->tx_rings == NULL &&
+	    na->nm_krings_create == netmap_hw_krings_create) {
+		int nh = netmap_host_rings;
+
+		if (nh < 1)
+			nh = 1;
+		else if (nh > NM_MAX_HOST_RINGS)
+			nh = NM_MAX_HOST_RINGS;
+		na->num_host_rings = nh;
+	}
+
 	txr = txd = rxr = rxd = 0;
 	if (na->nm_config == NULL ||
 	    na->nm_config(na, &txr, &txd, &rxr, &rxd))
@@ -766,7 +800,7 @@ static int
 netmap_txsync_to_host_compat(struct netmap_kring *kring, int flags)
 {
 	(void)flags; /* unused */
-	netmap_txsync_to_host(kring->na);
+	netmap_txsync_to_host(kring);
 	return 0;
 }
 
@@ -775,7 +809,7 @@ static int
 netmap_rxsync_from_host_compat(struct netmap_kring *kring, int flags)
 {
 	(void)flags; /* unused */
-	netmap_rxsync_from_host(kring->na, NULL, NULL);
+	netmap_rxsync_from_host(kring, NULL, NULL);
 	return 0;
 }
 
@@ -789,19 +823,20 @@ netmap_rxsync_from_host_compat(struct netmap_kring *kring, int flags)
  *                    |          |  } na->num_tx_ring
  *                    |          | /
  *                    +----------+
- *                    |          |    host tx kring
+ *                    |          |    host tx krings
  * na->rx_rings ----> +----------+
  *                    |          | \
  *                    |          |  } na->num_rx_rings
  *                    |          | /
  *                    +----------+
- *                    |          |    host rx kring
+ *                    |          |    host rx krings
  *                    +----------+
  * na->tailroom ----->|          | \
  *                    |          |  } tailroom bytes
  *                    |          | /
  *                    +----------+
  *
+ * There are netmap_num_host_rings(na) host krings on each side.
  * Note: for compatibility, host krings are created even when not needed.
  * The tailroom space is currently used by vale ports for allocating leases.
  */
@@ -814,8 +849,8 @@ netmap_krings_create(struct netmap_adapter *na, u_int tailroom)
 	u_int ntx, nrx;
 
 	/* account for the (possibly fake) host rings */
-	ntx = na->num_tx_rings + 1;
-	nrx = na->num_rx_rings + 1;
+	ntx = na->num_tx_rings + netmap_num_host_rings(na);
+	nrx = na->num_rx_rings + netmap_num_host_rings(na);
 
 	len = (ntx + nrx) * sizeof(struct netmap_kring) + tailroom;
 
@@ -839,7 +874,7 @@ netmap_krings_create(struct netmap_adapter *na, u_int tailroom)
 		kring->nkr_num_slots = ndesc;
 		if (i < na->num_tx_rings) {
 			kring->nm_sync = na->nm_txsync;
-		} else if (i == na->num_tx_rings) {
+		} else {
 			kring->nm_sync = netmap_txsync_to_host_compat;
 		}
 		/*
@@ -863,7 +898,7 @@ netmap_krings_create(struct netmap_adapter *na, u_int tailroom)
 		kring->nkr_num_slots = ndesc;
 		if (i < na->num_rx_rings) {
 			kring->nm_sync = na->nm_rxsync;
-		} else if (i == na->num_rx_rings) {
+		} else {
 			kring->nm_sync = netmap_rxsync_from_host_compat;
 		}
 		kring->rhead = kring->rcur = kring->nr_hwcur = 0;
@@ -907,12 +942,35 @@ netmap_krings_delete(struct netmap_adapter *na)
 	for ( ; kring != na->tailroom; kring++) {
 		mtx_destroy(&kring->q_lock);
 		netmap_knlist_destroy(&kring->si);
+#ifdef WITH_MONITOR
+		/* left by monitors still bound to us */
+		if (kring->monitors)
+			free(kring->monitors, M_DEVBUF);
+#endif /* WITH_MONITOR */
 	}
 	free(na->tx_rings, M_DEVBUF);
 	na->tx_rings = na->rx_rings = na->tailroom = NULL;
 }
 
 
+/* free the per-cpu queues of a host rx kring, and their mbufs */
+static void
+netmap_host_stage_delete(struct netmap_kring *kring)
+{
+	struct nm_host_stage *hs;
+	u_int cpu;
+
+	if (kring->nkr_stage == NULL)
+		return;
+	for (cpu = 0; cpu < NM_NCPUS; cpu++) {
+		hs = &kring->nkr_stage[cpu];
+		for (; hs->hs_head != hs->hs_tail; hs->hs_head++)
+			m_freem(hs->hs_q[hs->hs_head & (NM_HOST_STAGE_SLOTS - 1)]);
+	}
+	free(kring->nkr_stage, M_DEVBUF);
+	kring->nkr_stage = NULL;
+}
+
 /*
  * Destructor for NIC ports. They also have an mbuf queue
  * on the rings connected to the host so we need to purge
@@ -922,11 +980,20 @@ netmap_krings_delete(struct netmap_adapter *na)
 static void
 netmap_hw_krings_delete(struct netmap_adapter *na)
 {
-	struct mbq *q = &na->rx_rings[na->num_rx_rings].rx_queue;
+	u_int i;
 
-	ND("destroy sw mbq with len %d", mbq_len(q));
-	mbq_purge(q);
-	mbq_safe_destroy(q);
+	for (i = na->num_rx_rings; i < netmap_real_rx_rings(na); i++) {
+		struct netmap_kring *kring = &na->rx_rings[i];
+		struct mbq *q = &kring->rx_queue;
+
+		ND("destroy sw mbq %d with len %d", i, mbq_len(q));
+		mbq_purge(q);
+		mbq_safe_destroy(q);
+		netmap_host_stage_delete(kring);
+	}
+#ifdef linux
+	netmap_linux_gro_fini(na);
+#endif /* linux */
 	netmap_krings_delete(na);
 }
 
@@ -939,12 +1006,28 @@ netmap_hw_krings_delete(struct netmap_adapter *na)
  */
 /* call with NMG_LOCK held */
 static void netmap_unset_ringid(struct netmap_priv_d *);
+static void netmap_evfd_detach_all(struct netmap_priv_d *);
 static void
 netmap_do_unregif(struct netmap_priv_d *priv)
 {
 	struct netmap_adapter *na = priv->np_na;
 
 	NMG_LOCK_ASSERT();
+	if (NM_ATOMIC_TEST_AND_CLEAR(&priv->np_busy_sleeping))
+		refcount_release(&na->na_busy_sleepers);
+#ifdef WITH_KTHREAD
+	/* the kthreads must not touch the rings after this point */
+	if (priv->np_kthreads)
+		netmap_kthread_disable(priv);
+#endif /* WITH_KTHREAD */
+	netmap_evfd_detach_all(priv);
+#ifdef WITH_PIPES
+	/* give the rx rings back before they go away */
+	if (priv->np_lb)
+		netmap_pipe_lb_disable(priv);
+	if (priv->np_bcast)
+		netmap_pipe_bcast_detach(priv);
+#endif /* WITH_PIPES */
 	na->active_fds--;
 	if (na->active_fds <= 0) {	/* last instance */
 
@@ -1077,10 +1160,15 @@ netmap_dtor(void *data)
 /*
  * pass a chain of buffers to the host stack as coming from 'dst'
  * We do not need to lock because the queue is private.
+ * If the OS has a batched input path (NM_SEND_UP_BATCH) the whole
+ * chain is handed over at once.
  */
 static void
 netmap_send_up(struct ifnet *dst, struct mbq *q)
 {
+#ifdef NM_SEND_UP_BATCH
+	NM_SEND_UP_BATCH(dst, q);
+#else
 	struct mbuf *m;
 
 	/* send packets up, outside the lock */
@@ -1089,6 +1177,7 @@ netmap_send_up(struct ifnet *dst, struct mbq *q)
 			D("sending up pkt %p size %d", m, MBUF_LEN(m));
 		NM_SEND_UP(dst, m);
 	}
+#endif /* !NM_SEND_UP_BATCH */
 	mbq_destroy(q);
 }
 
@@ -1113,13 +1202,14 @@ netmap_grab_packets(struct netmap_kring *kring, struct mbq *q, int force)
 
 		if ((slot->flags & NS_FORWARD) == 0 && !force)
 			continue;
-		if (slot->len < 14 || slot->len > NETMAP_BUF_SIZE(na)) {
+		if (slot->len < 14 ||
+		    slot->len + nm_get_offset(kring, slot) > NETMAP_BUF_SIZE(na)) {
 			RD(5, "bad pkt at %d len %d", n, slot->len);
 			continue;
 		}
 		slot->flags &= ~NS_FORWARD; // XXX needed ?
 		/* XXX TODO: adapt to the case of a multisegment packet */
-		m = m_devget(NMB(na, slot), slot->len, 0, na->ifp, NULL);
+		m = m_devget(NMB_O(kring, slot), slot->len, 0, na->ifp, NULL);
 
 		if (m == NULL)
 			break;
@@ -1134,9 +1224,9 @@ netmap_grab_packets(struct netmap_kring *kring, struct mbq *q, int force)
  * Called under kring->rx_queue.lock on the sw rx ring,
  */
 static u_int
-netmap_sw_to_nic(struct netmap_adapter *na)
+netmap_sw_to_nic(struct netmap_kring *kring)
 {
-	struct netmap_kring *kring = &na->rx_rings[na->num_rx_rings];
+	struct netmap_adapter *na = kring->na;
 	struct netmap_slot *rxslot = kring->ring->slot;
 	u_int i, rxcur = kring->nr_hwcur;
 	u_int const head = kring->rhead;
@@ -1185,11 +1275,13 @@ netmap_sw_to_nic(struct netmap_adapter *na)
  * system call in user process context, and the only contention
  * can be among multiple user threads erroneously calling
  * this routine concurrently.
+ * Each host tx ring is independent, so threads serving different
+ * host rings pass packets up in parallel, each on its own CPU.
  */
 void
-netmap_txsync_to_host(struct netmap_adapter *na)
+netmap_txsync_to_host(struct netmap_kring *kring)
 {
-	struct netmap_kring *kring = &na->tx_rings[na->num_tx_rings];
+	struct netmap_adapter *na = kring->na;
 	struct netmap_ring *ring = kring->ring;
 	u_int const lim = kring->nkr_num_slots - 1;
 	u_int const head = kring->rhead;
@@ -1214,9 +1306,63 @@ netmap_txsync_to_host(struct netmap_adapter *na)
 }
 
 
+/*
+ * Move the mbufs staged by netmap_transmit() into the free slots
+ * of the host rx kring, from nm_i up to (not including) stop_i.
+ * Call with the rx_queue lock held, which makes us the only consumer.
+ * Returns the first slot not filled.
+ */
+static u_int
+netmap_host_stage_drain(struct netmap_kring *kring, u_int nm_i, u_int stop_i)
+{
+	struct netmap_adapter *na = kring->na;
+	struct netmap_ring *ring = kring->ring;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int cpu;
+
+	for (cpu = 0; cpu < NM_NCPUS && nm_i != stop_i; cpu++) {
+		struct nm_host_stage *hs = &kring->nkr_stage[cpu];
+		u_int head = hs->hs_head, tail = hs->hs_tail;
+
+		while (head != tail && nm_i != stop_i) {
+			mb();	/* read the mbuf after the tail */
+			do {
+				struct mbuf *m = hs->hs_q[head &
+					(NM_HOST_STAGE_SLOTS - 1)];
+				struct netmap_slot *slot = &ring->slot[nm_i];
+				u_int room = NETMAP_BUF_SIZE(na) -
+					nm_get_offset(kring, slot);
+				int len = MBUF_LEN(m);
+
+				if (unlikely(len > room)) {
+					RD(5, "truncating %d bytes to %u",
+						len, room);
+					len = room;
+				}
+				m_copydata(m, 0, len, NMB_O(kring, slot));
+				slot->len = len;
+				slot->flags = kring->nkr_slot_flags;
+				nm_i = nm_next(nm_i, lim);
+				head++;
+				m_freem(m);
+			} while (head != tail && nm_i != stop_i);
+			/* publish the new head, then look again, so that
+			 * netmap_transmit() either sees the queue not empty
+			 * (and will not notify) or we see its new mbufs.
+			 */
+			hs->hs_head = head;
+			mb();
+			tail = hs->hs_tail;
+		}
+	}
+	return nm_i;
+}
+
+
 /*
  * rxsync backend for packets coming from the host stack.
- * They have been put in kring->rx_queue by netmap_transmit().
+ * They have been put in the per-cpu queues of the kring
+ * (kring->nkr_stage) by netmap_transmit().
  * We protect access to the kring using kring->rx_queue.lock
  *
  * This routine also does the selrecord if called from the poll handler
@@ -1228,11 +1374,9 @@ netmap_txsync_to_host(struct netmap_adapter *na)
  * transparent mode, or a negative value if error
  */
 int
-netmap_rxsync_from_host(struct netmap_adapter *na, struct thread *td, void *pwait)
+netmap_rxsync_from_host(struct netmap_kring *kring, struct thread *td, void *pwait)
 {
-	struct netmap_kring *kring = &na->rx_rings[na->num_rx_rings];
-	struct netmap_ring *ring = kring->ring;
-	u_int nm_i, n;
+	u_int nm_i;
 	u_int const lim = kring->nkr_num_slots - 1;
 	u_int const head = kring->rhead;
 	int ret = 0;
@@ -1243,30 +1387,12 @@ netmap_rxsync_from_host(struct netmap_adapter *na, struct thread *td, void *pwai
 
 	mbq_lock(q);
 
-	/* First part: import newly received packets */
-	n = mbq_len(q);
-	if (n) { /* grab packets from the queue */
-		struct mbuf *m;
-		uint32_t stop_i;
-
-		nm_i = kring->nr_hwtail;
-		stop_i = nm_prev(nm_i, lim);
-		while ( nm_i != stop_i && (m = mbq_dequeue(q)) != NULL ) {
-			int len = MBUF_LEN(m);
-			struct netmap_slot *slot = &ring->slot[nm_i];
-
-			m_copydata(m, 0, len, NMB(na, slot));
-			ND("nm %d len %d", nm_i, len);
-			if (netmap_verbose)
-                                D("%s", nm_dump_buf(NMB(na, slot),len, 128, NULL));
-
-			slot->len = len;
-			slot->flags = kring->nkr_slot_flags;
-			nm_i = nm_next(nm_i, lim);
-			m_freem(m);
-		}
-		kring->nr_hwtail = nm_i;
-	}
+	/* First part: import newly received packets, in the
+	 * slots between hwtail and hwcur
+	 */
+	if (kring->nkr_stage != NULL)
+		kring->nr_hwtail = netmap_host_stage_drain(kring,
+			kring->nr_hwtail, nm_prev(kring->nr_hwcur, lim));
 
 	/*
 	 * Second part: skip past packets that userspace has released.
@@ -1274,7 +1400,7 @@ netmap_rxsync_from_host(struct netmap_adapter *na, struct thread *td, void *pwai
 	nm_i = kring->nr_hwcur;
 	if (nm_i != head) { /* something was released */
 		if (netmap_fwd || kring->ring->flags & NR_FORWARD)
-			ret = netmap_sw_to_nic(na);
+			ret = netmap_sw_to_nic(kring);
 		kring->nr_hwcur = head;
 	}
 
@@ -1344,7 +1470,7 @@ netmap_get_hw_na(struct ifnet *ifp, struct netmap_adapter **na)
 			/* ugly, but we cannot allow an adapter switch
 			 * if some pipe is referring to this one
 			 */
-			|| prev_na->na_next_pipe > 0
+			|| prev_na->na_num_pipes > 0
 #endif
 		) {
 			*na = prev_na;
@@ -1551,10 +1677,10 @@ nm_txsync_prologue(struct netmap_kring *kring)
 				goto error;
 		}
 	}
-	if (ring->tail != kring->rtail) {
+	if (nm_ring_tail(kring) != kring->rtail) {
 		RD(5, "tail overwritten was %d need %d",
-			ring->tail, kring->rtail);
-		ring->tail = kring->rtail;
+			nm_ring_tail(kring), kring->rtail);
+		nm_ring_set_tail(kring, kring->rtail);
 	}
 	kring->rhead = head;
 	kring->rcur = cur;
@@ -1565,7 +1691,7 @@ error:
 		kring->name,
 		kring->nr_hwcur,
 		kring->rcur, kring->nr_hwtail,
-		cur, ring->tail);
+		cur, nm_ring_tail(kring));
 	return n;
 }
 
@@ -1628,11 +1754,11 @@ nm_rxsync_prologue(struct netmap_kring *kring)
 				goto error;
 		}
 	}
-	if (ring->tail != kring->rtail) {
+	if (nm_ring_tail(kring) != kring->rtail) {
 		RD(5, "%s tail overwritten was %d need %d",
 			kring->name,
-			ring->tail, kring->rtail);
-		ring->tail = kring->rtail;
+			nm_ring_tail(kring), kring->rtail);
+		nm_ring_set_tail(kring, kring->rtail);
 	}
 	return head;
 
@@ -1640,7 +1766,7 @@ error:
 	RD(5, "kring error: hwcur %d rcur %d hwtail %d head %d cur %d tail %d",
 		kring->nr_hwcur,
 		kring->rcur, kring->nr_hwtail,
-		kring->rhead, kring->rcur, ring->tail);
+		kring->rhead, kring->rcur, nm_ring_tail(kring));
 	return n;
 }
 
@@ -1669,13 +1795,13 @@ netmap_ring_reinit(struct netmap_kring *kring)
 	// XXX probably wrong to trust userspace
 	kring->rhead = ring->head;
 	kring->rcur  = ring->cur;
-	kring->rtail = ring->tail;
+	kring->rtail = nm_ring_tail(kring);
 
 	if (ring->cur > lim)
 		errors++;
 	if (ring->head > lim)
 		errors++;
-	if (ring->tail > lim)
+	if (kring->rtail > lim)
 		errors++;
 	for (i = 0; i <= lim; i++) {
 		u_int idx = ring->slot[i].buf_idx;
@@ -1694,10 +1820,11 @@ netmap_ring_reinit(struct netmap_kring *kring)
 		RD(10, "%s reinit, cur %d -> %d tail %d -> %d",
 			kring->name,
 			ring->cur, kring->nr_hwcur,
-			ring->tail, kring->nr_hwtail);
+			kring->rtail, kring->nr_hwtail);
 		ring->head = kring->rhead = kring->nr_hwcur;
 		ring->cur  = kring->rcur  = kring->nr_hwcur;
-		ring->tail = kring->rtail = kring->nr_hwtail;
+		kring->rtail = kring->nr_hwtail;
+		nm_ring_set_tail(kring, kring->rtail);
 	}
 	return (errors ? 1 : 0);
 }
@@ -1728,9 +1855,24 @@ netmap_interp_ringid(struct netmap_priv_d *priv, uint16_t ringid, uint32_t flags
 		D("deprecated API, old ringid 0x%x -> ringid %x reg %d", ringid, i, reg);
 	}
 	switch (reg) {
+	case NR_REG_PIPE_SLAVE:
+		if (na->na_flags & NAF_PIPE_BCAST) {
+			/* a consumer of a broadcast pipe gets a free
+			 * rx ring of its own, and no tx ring
+			 */
+			j = netmap_pipe_bcast_ring(na);
+			if (j >= na->num_rx_rings) {
+				D("%s: too many consumers", na->name);
+				return EBUSY;
+			}
+			priv->np_txqfirst = priv->np_txqlast = 0;
+			priv->np_rxqfirst = j;
+			priv->np_rxqlast = j + 1;
+			break;
+		}
+		/* FALLTHROUGH */
 	case NR_REG_ALL_NIC:
 	case NR_REG_PIPE_MASTER:
-	case NR_REG_PIPE_SLAVE:
 		priv->np_txqfirst = 0;
 		priv->np_txqlast = na->num_tx_rings;
 		priv->np_rxqfirst = 0;
@@ -1746,13 +1888,27 @@ netmap_interp_ringid(struct netmap_priv_d *priv, uint16_t ringid, uint32_t flags
 		}
 		priv->np_txqfirst = (reg == NR_REG_SW ?
 			na->num_tx_rings : 0);
-		priv->np_txqlast = na->num_tx_rings + 1;
+		priv->np_txqlast = netmap_real_tx_rings(na);
 		priv->np_rxqfirst = (reg == NR_REG_SW ?
 			na->num_rx_rings : 0);
-		priv->np_rxqlast = na->num_rx_rings + 1;
+		priv->np_rxqlast = netmap_real_rx_rings(na);
 		ND("%s %d %d", reg == NR_REG_SW ? "SW" : "NIC+SW",
 			priv->np_rxqfirst, priv->np_rxqlast);
 		break;
+	case NR_REG_ONE_SW:
+		if (!(na->na_flags & NAF_HOST_RINGS)) {
+			D("host rings not supported");
+			return EINVAL;
+		}
+		if (i >= netmap_num_host_rings(na)) {
+			D("invalid host ring id %d", i);
+			return EINVAL;
+		}
+		priv->np_txqfirst = na->num_tx_rings + i;
+		priv->np_txqlast = priv->np_txqfirst + 1;
+		priv->np_rxqfirst = na->num_rx_rings + i;
+		priv->np_rxqlast = priv->np_rxqfirst + 1;
+		break;
 	case NR_REG_ONE_NIC:
 		if (i >= na->num_tx_rings && i >= na->num_rx_rings) {
 			D("invalid ring id %d", i);
@@ -1995,6 +2151,231 @@ err:
 }
 
 
+static int netmap_hw_register(struct netmap_adapter *, int);
+
+/*
+ * Configure the ring layout (NETMAP_RING_LAYOUT_V2), the
+ * per-slot offsets (NR_OFFSETS, nr_headroom) and timestamps
+ * (NR_SLOT_TS) of a port.
+ * The settings can only be changed while the rings do not
+ * exist, otherwise they must match the current ones.
+ * Native NICs do not support offsets, as the drivers program
+ * the NIC with the start of the buffers.
+ * Call with NMG_LOCK held.
+ */
+static int
+netmap_set_ring_config(struct netmap_adapter *na, struct nmreq *nmr,
+	int ring_v2)
+{
+	int on = (nmr->nr_flags & NR_OFFSETS) != 0;
+	u_int headroom = on ? nmr->nr_headroom : 0;
+	u_int flags = (on ? NAF_OFFSETS : 0) | (ring_v2 ? NAF_RING_V2 : 0) |
+		((nmr->nr_flags & NR_SLOT_TS) ? NAF_SLOT_TS : 0);
+
+	NMG_LOCK_ASSERT();
+	if (on && na->nm_register == netmap_hw_register)
+		return EOPNOTSUPP;
+	if (na->tx_rings == NULL) {
+		na->na_flags = (na->na_flags & ~NAF_RING_CONFIG) | flags;
+		na->na_headroom = headroom;
+		return 0;
+	}
+	if (flags != (na->na_flags & NAF_RING_CONFIG) ||
+	    headroom != na->na_headroom)
+		return EINVAL;
+	return 0;
+}
+
+/*
+ * txsync or rxsync of one kring on behalf of userspace, as in
+ * NIOCTXSYNC/NIOCRXSYNC. Returns EBUSY if the kring is busy.
+ */
+static int
+netmap_sync_kring(struct netmap_kring *kring, int tx)
+{
+	if (nm_kr_tryget(kring))
+		return EBUSY;
+	if (tx) {
+		if (netmap_verbose & NM_VERB_TXSYNC)
+			D("pre txsync ring %d cur %d hwcur %d",
+			    kring->ring_id, kring->ring->cur,
+			    kring->nr_hwcur);
+		if (nm_txsync_prologue(kring) >= kring->nkr_num_slots) {
+			netmap_ring_reinit(kring);
+		} else {
+			kring->nm_sync(kring, NAF_FORCE_RECLAIM);
+		}
+		if (netmap_verbose & NM_VERB_TXSYNC)
+			D("post txsync ring %d cur %d hwcur %d",
+			    kring->ring_id, kring->ring->cur,
+			    kring->nr_hwcur);
+	} else {
+		kring->nm_sync(kring, NAF_FORCE_READ);
+		microtime(nm_ring_ts(kring));
+	}
+	nm_kr_put(kring);
+	return 0;
+}
+
+/*
+ * Process one entry of NIOCSYNCV on the descriptor priv.
+ * Returns the errno for the entry.
+ */
+static int
+netmap_syncv_one(struct netmap_priv_d *priv, struct nm_sync_req *req)
+{
+	struct netmap_adapter *na;
+	struct netmap_kring *krings;
+	u_int i, qfirst, qlast;
+	int tx, error = 0;
+
+	if (priv->np_nifp == NULL)
+		return ENXIO;
+	mb(); /* make sure following reads are not from cache */
+	na = priv->np_na;
+	if (na == NULL || !nm_netmap_on(na))
+		return ENXIO;
+
+	for (tx = 1; tx >= 0; tx--) {
+		if (!(req->nsr_flags & (tx ? NETMAP_SYNC_TX : NETMAP_SYNC_RX)))
+			continue;
+		if (tx) {
+			krings = na->tx_rings;
+			qfirst = priv->np_txqfirst;
+			qlast = priv->np_txqlast;
+		} else {
+			krings = na->rx_rings;
+			qfirst = priv->np_rxqfirst;
+			qlast = priv->np_rxqlast;
+		}
+		if (req->nsr_ring != NETMAP_SYNC_ALL) {
+			if (req->nsr_ring < qfirst || req->nsr_ring >= qlast)
+				return EINVAL;
+			qfirst = req->nsr_ring;
+			qlast = qfirst + 1;
+		}
+		if (qfirst >= qlast)
+			continue;
+#ifdef WITH_KTHREAD
+		if (priv->np_kthreads) {
+			netmap_kthread_wakeup(priv);
+		} else
+#endif /* WITH_KTHREAD */
+		for (i = qfirst; i < qlast; i++) {
+			if (netmap_sync_kring(krings + i, tx))
+				error = EBUSY;
+		}
+		if (tx)
+			req->nsr_txtail = krings[qfirst].rtail;
+		else
+			req->nsr_rxtail = krings[qfirst].rtail;
+	}
+	return error;
+}
+
+/*
+ * NIOCSYNCV: the entries are copied in and out in small chunks,
+ * and entries referring to other descriptors hold a reference
+ * to the file while they are processed.
+ */
+#define NM_SYNCV_CHUNK	16
+static int
+netmap_syncv(struct netmap_priv_d *priv, struct nm_syncv *sv,
+	struct thread *td)
+{
+	struct nm_sync_req reqs[NM_SYNCV_CHUNK];
+	char *uaddr = (char *)(uintptr_t)sv->nsv_reqs;
+	u_int i, n;
+
+	for (sv->nsv_done = 0; sv->nsv_done < sv->nsv_num;
+			sv->nsv_done += n, uaddr += n * sizeof(reqs[0])) {
+		n = sv->nsv_num - sv->nsv_done;
+		if (n > NM_SYNCV_CHUNK)
+			n = NM_SYNCV_CHUNK;
+		if (copyin(uaddr, reqs, n * sizeof(reqs[0])))
+			return EFAULT;
+		for (i = 0; i < n; i++) {
+			struct nm_sync_req *req = &reqs[i];
+			struct netmap_priv_d *p = priv;
+			void *ref = NULL;
+
+			if (req->nsr_fd != -1) {
+				req->nsr_error = netmap_fd_get_priv(td,
+					req->nsr_fd, &p, &ref);
+				if (req->nsr_error)
+					continue;
+			}
+			req->nsr_error = netmap_syncv_one(p, req);
+			if (ref)
+				netmap_fd_put_priv(td, ref);
+		}
+		if (copyout(reqs, uaddr, n * sizeof(reqs[0])))
+			return EFAULT;
+	}
+	return 0;
+}
+
+/*
+ * NIOCSETEVFD: attach an eventfd to a ring bound to priv,
+ * or detach it. Call with NMG_LOCK held.
+ */
+static int
+netmap_set_evfd(struct netmap_priv_d *priv, struct nm_evfd_req *req)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct netmap_kring *kring;
+	int error;
+
+	NMG_LOCK_ASSERT();
+	if (priv->np_nifp == NULL || na == NULL)
+		return ENXIO;
+	if (req->nef_flags == NETMAP_EVFD_TX) {
+		if (req->nef_ring < priv->np_txqfirst ||
+		    req->nef_ring >= priv->np_txqlast)
+			return EINVAL;
+		kring = &na->tx_rings[req->nef_ring];
+	} else if (req->nef_flags == NETMAP_EVFD_RX) {
+		if (req->nef_ring < priv->np_rxqfirst ||
+		    req->nef_ring >= priv->np_rxqlast)
+			return EINVAL;
+		kring = &na->rx_rings[req->nef_ring];
+	} else {
+		return EINVAL;
+	}
+	if (kring->nkr_evfd_priv != NULL && kring->nkr_evfd_priv != priv)
+		return EBUSY;
+	if (kring->nkr_evfd_priv != NULL) {
+		nm_evfd_detach(kring);
+		kring->nkr_evfd_priv = NULL;
+	}
+	if (req->nef_fd < 0)
+		return 0;
+	error = nm_evfd_attach(kring, req->nef_fd);
+	if (error == 0)
+		kring->nkr_evfd_priv = priv;
+	return error;
+}
+
+/* detach the eventfds attached through priv. Call with NMG_LOCK held. */
+static void
+netmap_evfd_detach_all(struct netmap_priv_d *priv)
+{
+	struct netmap_adapter *na = priv->np_na;
+	u_int i;
+
+	for (i = priv->np_txqfirst; i < priv->np_txqlast; i++) {
+		if (na->tx_rings[i].nkr_evfd_priv == priv) {
+			nm_evfd_detach(&na->tx_rings[i]);
+			na->tx_rings[i].nkr_evfd_priv = NULL;
+		}
+	}
+	for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++) {
+		if (na->rx_rings[i].nkr_evfd_priv == priv) {
+			nm_evfd_detach(&na->rx_rings[i]);
+			na->rx_rings[i].nkr_evfd_priv = NULL;
+		}
+	}
+}
 
 /*
  * ioctl(2) support for the "netmap" device.
@@ -2005,6 +2386,12 @@ err:
  * - NIOCREGIF
  * - NIOCTXSYNC
  * - NIOCRXSYNC
+ * - NIOCXBUFS
+ * - NIOCMEMINFO
+ * - NIOCSYNCV
+ * - NIOCSETEVFD
+ * - NIOCSETMONF
+ * - NIOCSETMIT
  *
  * Return 0 on success, errno otherwise.
  */
@@ -2019,6 +2406,7 @@ netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data,
 	u_int i, qfirst, qlast;
 	struct netmap_if *nifp;
 	struct netmap_kring *krings;
+	int ring_v2 = 0;
 
 	(void)dev;	/* UNUSED */
 	(void)fflag;	/* UNUSED */
@@ -2026,6 +2414,9 @@ netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data,
 	if (cmd == NIOCGINFO || cmd == NIOCREGIF) {
 		/* truncate name */
 		nmr->nr_name[sizeof(nmr->nr_name) - 1] = '\0';
+		/* the ring layout is requested together with the API */
+		ring_v2 = (nmr->nr_version & NETMAP_RING_LAYOUT_V2) != 0;
+		nmr->nr_version &= ~NETMAP_RING_LAYOUT_V2;
 		if (nmr->nr_version != NETMAP_API) {
 			D("API mismatch for %s got %d need %d",
 				nmr->nr_name,
@@ -2119,6 +2510,11 @@ netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data,
 				error = EBUSY;
 				break;
 			}
+			error = netmap_set_ring_config(na, nmr, ring_v2);
+			if (error) {
+				netmap_adapter_put(na);
+				break;
+			}
 			error = netmap_do_regif(priv, na, nmr->nr_ringid, nmr->nr_flags);
 			if (error) {    /* reg. failed, release priv and ref */
 				netmap_adapter_put(na);
@@ -2126,12 +2522,15 @@ netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data,
 			}
 			nifp = priv->np_nifp;
 			priv->np_td = td; // XXX kqueue, debugging only
+			priv->np_busy_poll = nmr->nr_busy_poll;
 
 			/* return the offset of the netmap_if object */
 			nmr->nr_rx_rings = na->num_rx_rings;
 			nmr->nr_tx_rings = na->num_tx_rings;
 			nmr->nr_rx_slots = na->num_rx_desc;
 			nmr->nr_tx_slots = na->num_tx_desc;
+			if (na->na_flags & NAF_RING_V2)
+				nmr->nr_version |= NETMAP_RING_LAYOUT_V2;
 			error = netmap_mem_get_info(na->nm_mem, &nmr->nr_memsize, &memflags,
 				&nmr->nr_arg2);
 			if (error) {
@@ -2153,6 +2552,34 @@ netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data,
 					&nifp->ni_bufs_head, nmr->nr_arg3);
 				D("got %d extra buffers", nmr->nr_arg3);
 			}
+			if (nmr->nr_flags & NR_PIPE_LB) {
+				/* nr_arg1 is the number of pipes */
+				error = netmap_pipe_lb_enable(priv, nmr->nr_arg1,
+					(nmr->nr_flags & NR_PIPE_LB_RR) != 0);
+				if (error) {
+					netmap_do_unregif(priv);
+					netmap_adapter_put(na);
+					break;
+				}
+			}
+			if (na->na_flags & NAF_PIPE_BCAST) {
+				/* nr_arg1 is the rx ring of the consumer */
+				error = netmap_pipe_bcast_attach(priv);
+				if (error) {
+					netmap_do_unregif(priv);
+					netmap_adapter_put(na);
+					break;
+				}
+				nmr->nr_arg1 = priv->np_rxqfirst;
+			}
+			if (nmr->nr_flags & NR_KTHREAD) {
+				error = netmap_kthread_enable(priv);
+				if (error) {
+					netmap_do_unregif(priv);
+					netmap_adapter_put(na);
+					break;
+				}
+			}
 			nmr->nr_offset = netmap_mem_if_offset(na->nm_mem, nifp);
 		} while (0);
 		NMG_UNLOCK();
@@ -2181,6 +2608,14 @@ netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data,
 			break;
 		}
 
+#ifdef WITH_KTHREAD
+		if (priv->np_kthreads) {
+			/* the kthreads do the work, just wake them up */
+			netmap_kthread_wakeup(priv);
+			break;
+		}
+#endif /* WITH_KTHREAD */
+
 		if (cmd == NIOCTXSYNC) {
 			krings = na->tx_rings;
 			qfirst = priv->np_txqfirst;
@@ -2192,34 +2627,66 @@ netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data,
 		}
 
 		for (i = qfirst; i < qlast; i++) {
-			struct netmap_kring *kring = krings + i;
-			if (nm_kr_tryget(kring)) {
-				error = EBUSY;
+			error = netmap_sync_kring(krings + i, cmd == NIOCTXSYNC);
+			if (error)
 				goto out;
-			}
-			if (cmd == NIOCTXSYNC) {
-				if (netmap_verbose & NM_VERB_TXSYNC)
-					D("pre txsync ring %d cur %d hwcur %d",
-					    i, kring->ring->cur,
-					    kring->nr_hwcur);
-				if (nm_txsync_prologue(kring) >= kring->nkr_num_slots) {
-					netmap_ring_reinit(kring);
-				} else {
-					kring->nm_sync(kring, NAF_FORCE_RECLAIM);
-				}
-				if (netmap_verbose & NM_VERB_TXSYNC)
-					D("post txsync ring %d cur %d hwcur %d",
-					    i, kring->ring->cur,
-					    kring->nr_hwcur);
-			} else {
-				kring->nm_sync(kring, NAF_FORCE_READ);
-				microtime(&na->rx_rings[i].ring->ts);
-			}
-			nm_kr_put(kring);
 		}
 
 		break;
 
+	case NIOCSYNCV:
+		error = netmap_syncv(priv, (struct nm_syncv *)data, td);
+		break;
+
+	case NIOCSETEVFD:
+		NMG_LOCK();
+		error = netmap_set_evfd(priv, (struct nm_evfd_req *)data);
+		NMG_UNLOCK();
+		break;
+
+	case NIOCSETMONF:
+		NMG_LOCK();
+		error = netmap_monitor_set_filter(priv,
+			(struct nm_monf_req *)data);
+		NMG_UNLOCK();
+		break;
+
+	case NIOCSETMIT:
+#ifdef WITH_GENERIC
+		NMG_LOCK();
+		error = generic_netmap_set_mit(priv, (struct nm_mit_req *)data);
+		NMG_UNLOCK();
+#else
+		error = EOPNOTSUPP;
+#endif /* WITH_GENERIC */
+		break;
+
+	case NIOCXBUFS:
+		/* protect access to priv from concurrent NIOCREGIF */
+		NMG_LOCK();
+		nifp = priv->np_nifp;
+		na = priv->np_na;
+		if (nifp == NULL || na == NULL) {
+			error = ENXIO;
+		} else if (nmr->nr_cmd == NETMAP_BUFS_ALLOC) {
+			nmr->nr_arg3 = netmap_extra_alloc(na,
+				&nifp->ni_bufs_head, nmr->nr_arg3);
+		} else if (nmr->nr_cmd == NETMAP_BUFS_FREE) {
+			nmr->nr_arg3 = netmap_extra_free(na,
+				&nifp->ni_bufs_head, nmr->nr_arg3);
+		} else {
+			D("invalid NIOCXBUFS command %d", nmr->nr_cmd);
+			error = EINVAL;
+		}
+		NMG_UNLOCK();
+		break;
+
+	case NIOCMEMINFO:
+		NMG_LOCK();
+		error = netmap_mem_get_stats((struct nm_mem_info *)data);
+		NMG_UNLOCK();
+		break;
+
 #ifdef WITH_VALE
 	case NIOCCONFIG:
 		error = netmap_bdg_config(nmr);
@@ -2267,6 +2734,100 @@ out:
 }
 
 
+/*
+ * Busy-poll statistics, updated without locks (so they are
+ * approximate) and reported in dev.netmap.poll_stats.
+ * Histogram bucket 0 counts times below 1us, bucket i times in
+ * [2^(i-1), 2^i) us, the last bucket everything above.
+ */
+#define NM_POLL_HIST	16
+static struct {
+	uint64_t hits;		/* work found while busy-polling */
+	uint64_t exhausted;	/* budget exhausted, went to sleep */
+	uint64_t spin[NM_POLL_HIST];	/* busy-poll time of the hits */
+	uint64_t wakeup[NM_POLL_HIST];	/* notification to poll() */
+} netmap_poll_stats;
+
+static void
+netmap_poll_hist_add(uint64_t *hist, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	u_int i = 0;
+
+	while (us && i < NM_POLL_HIST - 1) {
+		us >>= 1;
+		i++;
+	}
+	hist[i]++;
+}
+
+/*
+ * Print the busy-poll statistics in buf, for the poll_stats
+ * sysctl (FreeBSD) or module parameter (linux).
+ * Returns the number of bytes written, excluding the final NUL.
+ */
+int
+netmap_poll_print_stats(char *buf, int len)
+{
+	int n, i;
+
+	n = snprintf(buf, len, "busy_poll hits %llu exhausted %llu\n",
+		(unsigned long long)netmap_poll_stats.hits,
+		(unsigned long long)netmap_poll_stats.exhausted);
+	for (i = 0; i < NM_POLL_HIST && n < len; i++) {
+		n += snprintf(buf + n, len - n, "  %s%6uus spin %llu wakeup %llu\n",
+			i == NM_POLL_HIST - 1 ? ">=" : "< ",
+			i == NM_POLL_HIST - 1 ? 1U << (i - 1) : 1U << i,
+			(unsigned long long)netmap_poll_stats.spin[i],
+			(unsigned long long)netmap_poll_stats.wakeup[i]);
+	}
+	return n < len ? n : len - 1;
+}
+
+#ifdef __FreeBSD__
+static int
+netmap_poll_stats_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	char *buf;
+	int len = 2048, error;
+
+	buf = malloc(len, M_DEVBUF, M_WAITOK | M_ZERO);
+	netmap_poll_print_stats(buf, len);
+	error = sysctl_handle_string(oidp, buf, len, req);
+	free(buf, M_DEVBUF);
+	return error;
+}
+SYSCTL_PROC(_dev_netmap, OID_AUTO, poll_stats,
+    CTLTYPE_STRING | CTLFLAG_RD, 0, 0, netmap_poll_stats_sysctl, "A",
+    "Busy-poll statistics of poll()");
+#endif /* __FreeBSD__ */
+
+/*
+ * Called when poll() runs again on a descriptor that went to sleep
+ * after busy-polling: account the time from the last notification
+ * on its rings. Several threads may poll the same descriptor, only
+ * the one that clears np_busy_sleeping does the accounting.
+ */
+static void
+netmap_poll_wakeup_stats(struct netmap_priv_d *priv, uint64_t now)
+{
+	struct netmap_adapter *na = priv->np_na;
+	uint64_t last = 0;
+	u_int i;
+
+	if (!NM_ATOMIC_TEST_AND_CLEAR(&priv->np_busy_sleeping))
+		return;
+	refcount_release(&na->na_busy_sleepers);
+	for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++)
+		if (na->rx_rings[i].nkr_notify_ns > last)
+			last = na->rx_rings[i].nkr_notify_ns;
+	for (i = priv->np_txqfirst; i < priv->np_txqlast; i++)
+		if (na->tx_rings[i].nkr_notify_ns > last)
+			last = na->tx_rings[i].nkr_notify_ns;
+	if (last > priv->np_sleep_ns && now > last)
+		netmap_poll_hist_add(netmap_poll_stats.wakeup, now - last);
+}
+
 /*
  * select(2) and poll(2) handlers for the "netmap" device.
  *
@@ -2299,6 +2860,15 @@ netmap_poll(struct cdev *dev, int events, struct thread *td)
 	 */
 	int retry_tx = 1, retry_rx = 1;
 
+	/*
+	 * Busy-poll: while busy is set, the sync rounds are repeated
+	 * without selrecord() until something is found or busy_ns
+	 * expires; then we do a normal round and go to sleep.
+	 */
+	int busy = 0, exhausted = 0;
+	uint64_t busy_start = 0, busy_ns = 0;
+	u_int events_tx, events_rx;
+
 	(void)pwait;
 	mbq_init(&q);
 
@@ -2328,11 +2898,27 @@ netmap_poll(struct cdev *dev, int events, struct thread *td)
 	if (!nm_netmap_on(na))
 		return POLLERR;
 
+#ifdef WITH_KTHREAD
+	if (priv->np_kthreads)
+		netmap_kthread_wakeup(priv);
+#endif /* WITH_KTHREAD */
+
 	if (netmap_verbose & 0x8000)
 		D("device %s events 0x%x", na->name, events);
 	want_tx = events & (POLLOUT | POLLWRNORM);
 	want_rx = events & (POLLIN | POLLRDNORM);
+	events_tx = want_tx;
+	events_rx = want_rx;
 
+	if (!is_kevent) {
+		busy_ns = 1000ULL * (priv->np_busy_poll ?
+			priv->np_busy_poll : netmap_busy_poll);
+		if (busy_ns || priv->np_busy_sleeping)
+			busy_start = nm_time_ns();
+		if (priv->np_busy_sleeping)
+			netmap_poll_wakeup_stats(priv, busy_start);
+		busy = busy_ns != 0;
+	}
 
 	/*
 	 * check_all_{tx|rx} are set if the card has more than one queue AND
@@ -2355,6 +2941,7 @@ netmap_poll(struct cdev *dev, int events, struct thread *td)
 	 * slots available. If this fails, then lock and call the sync
 	 * routines.
 	 */
+busy_again:
 	for (i = priv->np_rxqfirst; want_rx && i < priv->np_rxqlast; i++) {
 		kring = &na->rx_rings[i];
 		/* XXX compare ring->cur and kring->tail */
@@ -2427,7 +3014,7 @@ flush_tx:
 				na->nm_notify(na, i, NR_TX, 0);
 			}
 		}
-		if (want_tx && retry_tx && !is_kevent) {
+		if (want_tx && retry_tx && !is_kevent && !busy) {
 			OS_selrecord(td, check_all_tx ?
 			    &na->tx_si : &na->tx_rings[priv->np_txqfirst].si);
 			retry_tx = 0;
@@ -2471,7 +3058,7 @@ do_retry_rx:
 				revents |= POLLERR;
 			if (netmap_no_timestamp == 0 ||
 					kring->ring->flags & NR_TIMESTAMP) {
-				microtime(&kring->ring->ts);
+				microtime(nm_ring_ts(kring));
 			}
 			/* after an rxsync we can use kring->rcur, rtail */
 			found = kring->rcur != kring->rtail;
@@ -2485,21 +3072,23 @@ do_retry_rx:
 
 		/* transparent mode XXX only during first pass ? */
 		if (na->na_flags & NAF_HOST_RINGS) {
-			kring = &na->rx_rings[na->num_rx_rings];
-			if (check_all_rx
-			    && (netmap_fwd || kring->ring->flags & NR_FORWARD)) {
+			for (i = na->num_rx_rings; check_all_rx &&
+			    i < netmap_real_rx_rings(na); i++) {
+				kring = &na->rx_rings[i];
+				if (!(netmap_fwd || kring->ring->flags & NR_FORWARD))
+					continue;
 				/* XXX fix to use kring fields */
 				if (nm_ring_empty(kring->ring))
-					send_down = netmap_rxsync_from_host(na, td, dev);
+					send_down += netmap_rxsync_from_host(kring, td, dev);
 				if (!nm_ring_empty(kring->ring))
 					revents |= want_rx;
 			}
 		}
 
-		if (retry_rx && !is_kevent)
+		if (retry_rx && !is_kevent && !busy)
 			OS_selrecord(td, check_all_rx ?
 			    &na->rx_si : &na->rx_rings[priv->np_rxqfirst].si);
-		if (send_down > 0 || retry_rx) {
+		if (send_down > 0 || (retry_rx && !busy)) {
 			retry_rx = 0;
 			if (send_down)
 				goto flush_tx; /* and retry_rx */
@@ -2520,6 +3109,34 @@ do_retry_rx:
  	 * rings to a single file descriptor.
 	 */
 
+	if (busy && revents == 0 && q.head == NULL) {
+		uint64_t now = nm_time_ns();
+
+		if (now - busy_start >= busy_ns) {
+			/* last round, with selrecord() */
+			netmap_poll_stats.exhausted++;
+			busy = 0;
+			exhausted = 1;
+		}
+		want_tx = events_tx;
+		want_rx = events_rx;
+		retry_tx = retry_rx = 1;
+		maybe_yield();
+		goto busy_again;
+	}
+	if (busy && revents) {
+		netmap_poll_stats.hits++;
+		netmap_poll_hist_add(netmap_poll_stats.spin,
+			nm_time_ns() - busy_start);
+	}
+	if (exhausted && revents == 0) {
+		/* raise the count first, see na_busy_sleepers */
+		refcount_acquire(&na->na_busy_sleepers);
+		priv->np_sleep_ns = nm_time_ns();
+		if (NM_ATOMIC_TEST_AND_SET(&priv->np_busy_sleeping))
+			refcount_release(&na->na_busy_sleepers);
+	}
+
 	if (q.head && na->ifp != NULL)
 		netmap_send_up(na->ifp, &q);
 
@@ -2529,8 +3146,6 @@ do_retry_rx:
 
 /*-------------------- driver support routines -------------------*/
 
-static int netmap_hw_krings_create(struct netmap_adapter *);
-
 /* default notify callback */
 static int
 netmap_notify(struct netmap_adapter *na, u_int n_ring,
@@ -2540,6 +3155,11 @@ netmap_notify(struct netmap_adapter *na, u_int n_ring,
 
 	if (tx == NR_TX) {
 		kring = na->tx_rings + n_ring;
+		if (na->na_busy_sleepers)
+			kring->nkr_notify_ns = nm_time_ns();
+		netmap_kthread_notify(kring);
+		if (kring->nkr_evfd)
+			nm_evfd_signal(kring);
 		OS_selwakeup(&kring->si, PI_NET);
 		/* optimization: avoid a wake up on the global
 		 * queue if nobody has registered for more
@@ -2549,6 +3169,11 @@ netmap_notify(struct netmap_adapter *na, u_int n_ring,
 			OS_selwakeup(&na->tx_si, PI_NET);
 	} else {
 		kring = na->rx_rings + n_ring;
+		if (na->na_busy_sleepers)
+			kring->nkr_notify_ns = nm_time_ns();
+		netmap_kthread_notify(kring);
+		if (kring->nkr_evfd)
+			nm_evfd_signal(kring);
 		OS_selwakeup(&kring->si, PI_NET);
 		/* optimization: same as above */
 		if (na->rx_si_users > 0)
@@ -2762,10 +3387,31 @@ int
 netmap_hw_krings_create(struct netmap_adapter *na)
 {
 	int ret = netmap_krings_create(na, 0);
+	u_int i;
+
 	if (ret == 0) {
-		/* initialize the mbq for the sw rx ring */
-		mbq_safe_init(&na->rx_rings[na->num_rx_rings].rx_queue);
-		ND("initialized sw rx queue %d", na->num_rx_rings);
+		/* initialize the mbq and the per-cpu queues
+		 * for the sw rx rings
+		 */
+		for (i = na->num_rx_rings; i < netmap_real_rx_rings(na); i++)
+			mbq_safe_init(&na->rx_rings[i].rx_queue);
+		for (i = na->num_rx_rings; i < netmap_real_rx_rings(na); i++) {
+			struct netmap_kring *kring = &na->rx_rings[i];
+
+			kring->nkr_stage = malloc(NM_NCPUS *
+				sizeof(struct nm_host_stage), M_DEVBUF,
+				M_NOWAIT | M_ZERO);
+			if (kring->nkr_stage == NULL) {
+				D("Cannot allocate the host queues");
+				na->nm_krings_delete(na);
+				return ENOMEM;
+			}
+		}
+		ND("initialized sw rx queues from %d", na->num_rx_rings);
+#ifdef linux
+		/* GRO for the packets sent up by the host tx rings */
+		netmap_linux_gro_init(na);
+#endif /* linux */
 	}
 	return ret;
 }
@@ -2801,10 +3447,16 @@ netmap_detach(struct ifnet *ifp)
 
 /*
  * Intercept packets from the network stack and pass them
- * to netmap as incoming packets on the 'software' ring.
+ * to netmap as incoming packets on the 'software' rings.
+ * With more than one host ring the packet is steered by
+ * its flow hash (MBUF_HASH), so each flow stays on one ring.
  *
- * We only store packets in a bounded mbq and then copy them
- * in the relevant rxsync routine.
+ * We only store packets in the per-cpu queue of the kring, without
+ * locks, and then copy them in the relevant rxsync routine.
+ * The packet is dropped if the queue is full. The listeners are
+ * notified when the queue was empty as seen by the consumer, and
+ * then once every netmap_host_notify_batch packets, instead of
+ * once per packet.
  *
  * We rely on the OS to make sure that the ifp and na do not go
  * away (typically the caller checks for IFF_DRV_RUNNING or the like).
@@ -2818,8 +3470,10 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 	struct netmap_kring *kring;
 	u_int len = MBUF_LEN(m);
 	u_int error = ENOBUFS;
-	struct mbq *q;
-	int space;
+	struct nm_host_stage *hs;
+	u_int tail, ring_nr = na->num_rx_rings;
+	int cpu, batch, notify = 0;
+	unsigned long flags;
 
 	// XXX [Linux] we do not need this lock
 	// if we follow the down/configure/up protocol -gl
@@ -2831,8 +3485,9 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 		goto done;
 	}
 
-	kring = &na->rx_rings[na->num_rx_rings];
-	q = &kring->rx_queue;
+	if (na->num_host_rings > 1)
+		ring_nr += MBUF_HASH(m) % na->num_host_rings;
+	kring = &na->rx_rings[ring_nr];
 
 	// XXX reconsider long packets if we handle fragments
 	if (len > NETMAP_BUF_SIZE(na)) { /* too long for us */
@@ -2841,35 +3496,33 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 		goto done;
 	}
 
-	/* protect against rxsync_from_host(), netmap_sw_to_nic()
-	 * and maybe other instances of netmap_transmit (the latter
-	 * not possible on Linux).
-	 * Also avoid overflowing the queue.
+	/* we are the only producer on the queue of this cpu,
+	 * as long as we do not migrate or get interrupted.
 	 */
-	mbq_lock(q);
-
-        space = kring->nr_hwtail - kring->nr_hwcur;
-        if (space < 0)
-                space += kring->nkr_num_slots;
-	if (space + mbq_len(q) >= kring->nkr_num_slots - 1) { // XXX
-		RD(10, "%s full hwcur %d hwtail %d qlen %d len %d m %p",
-			na->name, kring->nr_hwcur, kring->nr_hwtail, mbq_len(q),
-			len, m);
+	cpu = nm_cpu_get(flags);
+	hs = &kring->nkr_stage[cpu];
+	tail = hs->hs_tail;
+	if (tail - hs->hs_head >= NM_HOST_STAGE_SLOTS) {
+		RD(10, "%s cpu %d queue full len %d m %p",
+			na->name, cpu, len, m);
 	} else {
-		mbq_enqueue(q, m);
-		ND(10, "%s %d bufs in queue len %d m %p",
-			na->name, mbq_len(q), len, m);
-		/* notify outside the lock */
+		hs->hs_q[tail & (NM_HOST_STAGE_SLOTS - 1)] = m;
+		mb();	/* the mbuf before the tail */
+		hs->hs_tail = tail + 1;
+		mb();	/* the tail before reading the head */
+		batch = netmap_host_notify_batch;
+		notify = hs->hs_head == tail || batch <= 1 ||
+			(tail + 1) % batch == 0;
 		m = NULL;
 		error = 0;
 	}
-	mbq_unlock(q);
+	nm_cpu_put(flags);
 
 done:
 	if (m)
 		m_freem(m);
-	/* unconditionally wake up listeners */
-	na->nm_notify(na, na->num_rx_rings, NR_RX, 0);
+	if (notify)
+		na->nm_notify(na, ring_nr, NR_RX, 0);
 	/* this is normally netmap_notify(), but for nics
 	 * connected to a bridge it is netmap_bwrap_intr_notify(),
 	 * that possibly forwards the frames through the switch
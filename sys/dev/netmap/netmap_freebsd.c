@@ -25,6 +25,8 @@
 
 /* $FreeBSD$ */
 
+#include "opt_bpf.h"	/* BPF_JITTER */
+
 #include <sys/types.h>
 #include <sys/module.h>
 #include <sys/errno.h>
@@ -32,6 +34,12 @@
 #include <sys/poll.h>  /* POLLIN, POLLOUT */
 #include <sys/kernel.h> /* types used in module initialization */
 #include <sys/conf.h>	/* DEV_MODULE */
+#include <sys/capsicum.h>	/* cap_rights_init() */
+#include <sys/file.h>	/* fget() */
+#include <sys/kthread.h>	/* kthread_add() */
+#include <sys/proc.h>
+#include <sys/sched.h>	/* sched_bind() */
+#include <sys/vnode.h>	/* struct vnode */
 #include <sys/endian.h>
 
 #include <sys/rwlock.h>
@@ -53,6 +61,10 @@
 #include <net/if_types.h> /* IFT_ETHER */
 #include <net/ethernet.h> /* ether_ifdetach */
 #include <net/if_dl.h> /* LLADDR */
+#include <net/bpf.h>	/* bpf_filter(), bpf_validate() */
+#ifdef BPF_JITTER
+#include <net/bpf_jitter.h>
+#endif
 #include <machine/bus.h>        /* bus_dmamap_* */
 #include <netinet/in.h>		/* in6_cksum_pseudo() */
 #include <machine/in_cksum.h>  /* in_pseudo(), in_cksum_hdr() */
@@ -212,10 +224,23 @@ netmap_catch_tx(struct netmap_generic_adapter *gna, int enable)
  */
 int
 generic_xmit_frame(struct ifnet *ifp, struct mbuf *m,
-	void *addr, u_int len, u_int ring_nr)
+	void *addr, u_int len, u_int ring_nr, int flags)
 {
 	int ret;
 
+	if (flags & NM_XMIT_APPEND) {
+		/* more fragments (NS_MOREFRAG), chained after the
+		 * cluster when it is full. len 0 only sends m.
+		 */
+		if (len > 0 && m_append(m, len, addr) == 0) {
+			/* drop the partial chain */
+			m_freem(m->m_next);
+			m->m_next = NULL;
+			return ENOBUFS;
+		}
+		goto send;
+	}
+
 	/*
 	 * The mbuf should be a cluster from our special pool,
 	 * so we do not need to do an m_copyback but just copy
@@ -227,6 +252,8 @@ generic_xmit_frame(struct ifnet *ifp, struct mbuf *m,
 			GET_MBUF_REFCNT(m), m);
 		panic("in generic_xmit_frame");
 	}
+	/* the chain of the previous packet went with it */
+	m->m_next = NULL;
 	// XXX the ext_size check is unnecessary if we link the netmap buf
 	if (m->m_ext.ext_size < len) {
 		RD(5, "size %d < len %d", m->m_ext.ext_size, len);
@@ -238,6 +265,10 @@ generic_xmit_frame(struct ifnet *ifp, struct mbuf *m,
 		bcopy(addr, m->m_data, len);
 	}
 	m->m_len = m->m_pkthdr.len = len;
+send:
+	/* there is no xmit_more hint, NM_XMIT_MORE is ignored */
+	if (flags & NM_XMIT_FRAG)
+		return 0;
 	// inc refcount. All ours, we could skip the atomic
 	atomic_fetchadd_int(PNT_MBUF_REFCNT(m), 1);
 	m->m_flags |= M_FLOWID;
@@ -248,6 +279,16 @@ generic_xmit_frame(struct ifnet *ifp, struct mbuf *m,
 }
 
 
+/* if_transmit() does its own locking, nothing to do per batch */
+void
+generic_xmit_batch(struct ifnet *ifp, u_int ring_nr, int start)
+{
+	(void)ifp;
+	(void)ring_nr;
+	(void)start;
+}
+
+
 #if __FreeBSD_version >= 1100005
 struct netmap_adapter *
 netmap_getna(if_t ifp)
@@ -315,6 +356,180 @@ netmap_mitigation_cleanup(struct nm_generic_mit *mit)
 	ND("called");
 }
 
+#ifdef WITH_KTHREAD
+/*
+ * sync kthreads. The thread body runs fn() until nm_kthread_stop()
+ * sets the stop flag, then reports its exit through t->exited.
+ */
+struct nm_kthread {
+	struct thread *td;
+	struct mtx mtx;
+	int wakeup;
+	volatile int stop;
+	volatile int exited;
+	int cpu;
+	void (*fn)(void *);
+	void *arg;
+};
+
+static void
+nm_kthread_main(void *data)
+{
+	struct nm_kthread *t = data;
+
+	if (t->cpu >= 0) {
+		thread_lock(curthread);
+		sched_bind(curthread, t->cpu);
+		thread_unlock(curthread);
+	}
+	t->fn(t->arg);
+	mtx_lock(&t->mtx);
+	t->exited = 1;
+	wakeup(&t->exited);
+	mtx_unlock(&t->mtx);
+	kthread_exit();
+}
+
+struct nm_kthread *
+nm_kthread_create(void (*fn)(void *), void *arg, int cpu, const char *name)
+{
+	struct nm_kthread *t;
+	int error;
+
+	t = malloc(sizeof(*t), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (t == NULL)
+		return NULL;
+	mtx_init(&t->mtx, "nm_kthread", NULL, MTX_DEF);
+	t->fn = fn;
+	t->arg = arg;
+	t->cpu = (cpu >= 0 && cpu <= mp_maxid && !CPU_ABSENT(cpu)) ? cpu : -1;
+	error = kthread_add(nm_kthread_main, t, NULL, &t->td, 0, 0,
+	    "nm_%s", name);
+	if (error) {
+		D("cannot create kthread for %s: %d", name, error);
+		mtx_destroy(&t->mtx);
+		free(t, M_DEVBUF);
+		return NULL;
+	}
+	return t;
+}
+
+void
+nm_kthread_stop(struct nm_kthread *t)
+{
+	mtx_lock(&t->mtx);
+	t->stop = 1;
+	wakeup(t);
+	while (!t->exited)
+		msleep(&t->exited, &t->mtx, 0, "nmkstop", 0);
+	mtx_unlock(&t->mtx);
+	mtx_destroy(&t->mtx);
+	free(t, M_DEVBUF);
+}
+
+int
+nm_kthread_should_stop(struct nm_kthread *t)
+{
+	return t->stop;
+}
+
+void
+nm_kthread_sleep(struct nm_kthread *t, u_int timeout_us)
+{
+	mtx_lock(&t->mtx);
+	if (!t->wakeup && !t->stop)
+		msleep(t, &t->mtx, 0, "nmksync",
+		    max(1, (int)((uint64_t)timeout_us * hz / 1000000)));
+	t->wakeup = 0;
+	mtx_unlock(&t->mtx);
+}
+
+void
+nm_kthread_wakeup(struct nm_kthread *t)
+{
+	mtx_lock(&t->mtx);
+	t->wakeup = 1;
+	wakeup(t);
+	mtx_unlock(&t->mtx);
+}
+#endif /* WITH_KTHREAD */
+
+/*
+ * No eventfds in the kernel, kqueue on the netmap descriptor
+ * is the native alternative.
+ */
+int
+nm_evfd_attach(struct netmap_kring *kring, int fd)
+{
+	(void)kring;
+	(void)fd;
+	return EOPNOTSUPP;
+}
+
+void
+nm_evfd_detach(struct netmap_kring *kring)
+{
+	(void)kring;
+}
+
+void
+nm_evfd_signal(struct netmap_kring *kring)
+{
+	(void)kring;
+}
+
+#ifdef WITH_MONITOR
+/*
+ * Monitor filters use the BPF interpreter of the kernel, or its
+ * JIT if the kernel has one.
+ */
+struct nm_bpf {
+	struct bpf_insn *insns;
+#ifdef BPF_JITTER
+	bpf_jit_filter *jit;
+#endif
+};
+
+struct nm_bpf *
+nm_bpf_create(const void *insns, u_int len)
+{
+	struct nm_bpf *f;
+
+	if (!bpf_validate(insns, len))
+		return NULL;
+	f = malloc(sizeof(*f) + len * sizeof(struct bpf_insn), M_DEVBUF,
+		M_NOWAIT | M_ZERO);
+	if (f == NULL)
+		return NULL;
+	f->insns = (struct bpf_insn *)(f + 1);
+	memcpy(f->insns, insns, len * sizeof(struct bpf_insn));
+#ifdef BPF_JITTER
+	f->jit = bpf_jitter(f->insns, len);	/* NULL means interpret */
+#endif
+	return f;
+}
+
+u_int
+nm_bpf_run(struct nm_bpf *f, const void *pkt, u_int len)
+{
+#ifdef BPF_JITTER
+	if (f->jit)
+		return (*f->jit->func)(__DECONST(u_char *, pkt), len, len);
+#endif
+	return bpf_filter(f->insns, pkt, len, len);
+}
+
+void
+nm_bpf_destroy(struct nm_bpf *f)
+{
+#ifdef BPF_JITTER
+	if (f->jit)
+		bpf_destroy_jit_filter(f->jit);
+#endif
+	free(f, M_DEVBUF);
+}
+#endif /* WITH_MONITOR */
+
 static int
 nm_vi_dummy(struct ifnet *ifp, u_long cmd, caddr_t addr)
 {
@@ -798,8 +1013,50 @@ struct cdevsw netmap_cdevsw = {
 	.d_kqfilter = netmap_kqfilter,
 	.d_close = netmap_close,
 };
+
 /*--- end of kqueue support ----*/
 
+/*
+ * The cdevpriv of a file is only reachable through curthread->td_fpop,
+ * so we point it to the file of the other descriptor for the lookup.
+ */
+int
+netmap_fd_get_priv(struct thread *td, int fd,
+	struct netmap_priv_d **priv, void **ref)
+{
+	struct file *fp, *saved;
+	struct vnode *vp;
+	cap_rights_t rights;
+	int error;
+
+	error = fget(td, fd, cap_rights_init(&rights, CAP_IOCTL), &fp);
+	if (error)
+		return error;
+	vp = fp->f_vnode;
+	if (fp->f_type != DTYPE_VNODE || vp == NULL || vp->v_type != VCHR ||
+	    vp->v_rdev == NULL || vp->v_rdev->si_devsw != &netmap_cdevsw) {
+		fdrop(fp, td);
+		return EBADF;
+	}
+	saved = td->td_fpop;
+	td->td_fpop = fp;
+	error = devfs_get_cdevpriv((void **)priv);
+	td->td_fpop = saved;
+	if (error) {
+		fdrop(fp, td);
+		return EBADF;
+	}
+	*ref = fp;
+	return 0;
+}
+
+
+void
+netmap_fd_put_priv(struct thread *td, void *ref)
+{
+	fdrop((struct file *)ref, td);
+}
+
 /*
  * Kernel entry point.
  *
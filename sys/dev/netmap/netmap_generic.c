@@ -39,15 +39,15 @@
  *	so we use it as an interrupt notification to wake up
  *	processes blocked on a poll().
  *
- *	For each receive ring we allocate one "struct mbq"
- *	(an mbuf tailq plus a spinlock). We intercept packets
- *	(through if_input)
- *	on the receive path and put them in the mbq from which
- *	netmap receive routines can grab them.
+ *	For each receive ring we allocate per-cpu lockless queues
+ *	of mbufs (struct nm_generic_stage), as large as the ring.
+ *	We intercept packets (through if_input)
+ *	on the receive path and put them in the queue of the current
+ *	cpu, from which netmap receive routines can grab them.
  *
  * TX:
  *	in the generic_txsync() routine, netmap buffers are copied
- *	(or linked, in a future) to the preallocated mbufs
+ *	(or linked, see generic_txzc) to the preallocated mbufs
  *	and pushed to the transmit queue. Some of these mbufs
  *	(those with NS_REPORT, or otherwise every half ring)
  *	have the refcount=1, others have refcount=2.
@@ -72,6 +72,7 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap_generic.c 274353 2014-11-10 20:19
 #include <sys/rwlock.h>
 #include <sys/socket.h> /* sockaddrs */
 #include <sys/selinfo.h>
+#include <sys/sysctl.h>
 #include <net/if.h>
 #include <net/if_var.h>
 #include <machine/bus.h>        /* bus_dmamap_* in netmap_kern.h */
@@ -85,6 +86,7 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap_generic.c 274353 2014-11-10 20:19
 #define rtnl_unlock()	ND("rtnl_unlock called")
 #define MBUF_TXQ(m)	((m)->m_pkthdr.flowid)
 #define MBUF_RXQ(m)	((m)->m_pkthdr.flowid)
+#define MBUF_CLONED(m)	0
 #define smp_mb()
 
 /*
@@ -240,6 +242,161 @@ netmap_generic_irq(struct ifnet *ifp, u_int q, u_int *work_done)
 }
 
 
+/* free the per-cpu rx queues of a generic kring, and their mbufs */
+static void
+generic_rx_stage_delete(struct netmap_kring *kring)
+{
+	struct nm_generic_stage *gs;
+	u_int cpu;
+
+	if (kring->nkr_gstage == NULL)
+		return;
+	for (cpu = 0; cpu < NM_NCPUS; cpu++) {
+		gs = &kring->nkr_gstage[cpu];
+		if (gs->gs_q == NULL)
+			continue;
+		for (; gs->gs_head != gs->gs_tail; gs->gs_head++)
+			m_freem(gs->gs_q[gs->gs_head & gs->gs_mask]);
+		free(gs->gs_q, M_DEVBUF);
+	}
+	free(kring->nkr_gstage, M_DEVBUF);
+	kring->nkr_gstage = NULL;
+}
+
+/* allocate the per-cpu rx queues of a generic kring, each one
+ * as large as the netmap ring
+ */
+static int
+generic_rx_stage_create(struct netmap_kring *kring)
+{
+	struct nm_generic_stage *gs;
+	u_int cpu, n;
+
+	for (n = 1; n < kring->nkr_num_slots; n <<= 1)
+		;
+	kring->nkr_gstage = malloc(NM_NCPUS * sizeof(*gs), M_DEVBUF,
+		M_NOWAIT | M_ZERO);
+	if (kring->nkr_gstage == NULL)
+		return ENOMEM;
+	for (cpu = 0; cpu < NM_NCPUS; cpu++) {
+		gs = &kring->nkr_gstage[cpu];
+		gs->gs_mask = n - 1;
+		gs->gs_q = malloc(n * sizeof(struct mbuf *), M_DEVBUF,
+			M_NOWAIT);
+		if (gs->gs_q == NULL) {
+			generic_rx_stage_delete(kring);
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
+
+/* ===================== adaptive rx mitigation ===================== */
+
+/*
+ * The rx ring is notified on the first packet after an idle period,
+ * then at most once every mit_delay ns (see generic_rx_handler() and
+ * the netmap_mitigation_*() functions). As with the adaptive
+ * interrupt moderation of the NICs, the delay follows the traffic:
+ * - generic_rx_handler() counts the packets of the ring on each cpu,
+ *   and at each notification generic_mit_update() turns them into
+ *   the average gap between two packets, measured over at least
+ *   NM_MIT_PERIOD. Only one caller at a time does the update, the
+ *   others skip it;
+ * - generic_netmap_rxsync() measures how many packets the consumer
+ *   takes at each sync (the batch);
+ * - if fewer than NM_MIT_MINBATCH packets arrive in mit_max, the
+ *   traffic is light and the delay is mit_min, for low latency;
+ * - otherwise the delay is the time needed to receive a quarter of
+ *   the ring, halved while the consumer takes more than half of the
+ *   ring at each sync (it is falling behind and the queues may
+ *   overflow), within [mit_min, mit_max].
+ * The bounds come from dev.netmap.generic_mit_min and
+ * dev.netmap.generic_mit when the port is registered and can be
+ * changed per ring with NIOCSETMIT.
+ */
+#define NM_MIT_PERIOD		1000000	/* ns */
+#define NM_MIT_MINBATCH		8
+#define NM_MIT_BATCH_SHIFT	3	/* weight of the last batch: 1/8 */
+#define NM_MIT_SPINS		10000	/* NIOCSETMIT waits for an update */
+
+/* registered generic adapters, for the generic_mit_stats */
+static struct netmap_generic_adapter *nm_generic_active;
+
+/* the packets received on the ring so far, from all the cpus */
+static u_int
+generic_mit_pkts(struct nm_generic_mit *mit)
+{
+	struct netmap_kring *kring =
+		&mit->mit_na->rx_rings[mit->mit_ring_idx];
+	u_int cpu, pkts = 0;
+
+	if (kring->nkr_gstage == NULL)
+		return 0;
+	for (cpu = 0; cpu < NM_NCPUS; cpu++)
+		pkts += kring->nkr_gstage[cpu].gs_pkts;
+	return pkts;
+}
+
+/* call before the rx handler can run */
+static void
+generic_mit_reset(struct nm_generic_mit *mit)
+{
+	mit->mit_max = netmap_generic_mit > 0 ? netmap_generic_mit : 0;
+	mit->mit_min = netmap_generic_mit_min > 0 ? netmap_generic_mit_min : 0;
+	if (mit->mit_min > mit->mit_max)
+		mit->mit_min = mit->mit_max;
+	mit->mit_delay = mit->mit_min;
+	mit->mit_pkts = generic_mit_pkts(mit);
+	mit->mit_start = nm_time_ns();
+	mit->mit_gap = mit->mit_max;	/* start as light traffic */
+	mit->mit_batch = 0;
+}
+
+void
+generic_mit_update(struct nm_generic_mit *mit)
+{
+	struct netmap_kring *kring =
+		&mit->mit_na->rx_rings[mit->mit_ring_idx];
+	u_int slots = kring->nkr_num_slots;
+	uint64_t now = nm_time_ns(), delay;
+	u_int elapsed, pkts;
+
+	if (now - mit->mit_start < NM_MIT_PERIOD)
+		return;
+	/* somebody else is updating, the next notification will */
+	if (NM_ATOMIC_TEST_AND_SET(&mit->mit_busy))
+		return;
+	now = nm_time_ns();
+	if (now - mit->mit_start < NM_MIT_PERIOD)
+		goto out;	/* just updated */
+	pkts = generic_mit_pkts(mit);
+	/* no 64 bit divisions, one second is enough for the gap */
+	elapsed = now - mit->mit_start > 1000000000 ?
+		1000000000 : (u_int)(now - mit->mit_start);
+	mit->mit_gap = ((uint64_t)mit->mit_gap * 3 +
+		elapsed / (pkts != mit->mit_pkts ? pkts - mit->mit_pkts : 1)) >> 2;
+	mit->mit_pkts = pkts;
+	mit->mit_start = now;
+
+	if ((uint64_t)mit->mit_gap * NM_MIT_MINBATCH > mit->mit_max) {
+		delay = mit->mit_min;
+	} else {
+		delay = (uint64_t)mit->mit_gap * (slots / 4);
+		if ((mit->mit_batch >> NM_MIT_BATCH_SHIFT) > slots / 2)
+			delay >>= 1;
+		if (delay > mit->mit_max)
+			delay = mit->mit_max;
+		if (delay < mit->mit_min)
+			delay = mit->mit_min;
+	}
+	mit->mit_delay = (u_int)delay;
+out:
+	NM_ATOMIC_CLEAR(&mit->mit_busy);
+}
+
+
 /* Enable/disable netmap mode for a generic network interface. */
 static int
 generic_netmap_register(struct netmap_adapter *na, int enable)
@@ -268,14 +425,9 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 			error = ENOMEM;
 			goto out;
 		}
-		for (r=0; r<na->num_rx_rings; r++)
-			netmap_mitigation_init(&gna->mit[r], r, na);
-
-		/* Initialize the rx queue, as generic_rx_handler() can
-		 * be called as soon as netmap_catch_rx() returns.
-		 */
 		for (r=0; r<na->num_rx_rings; r++) {
-			mbq_safe_init(&na->rx_rings[r].rx_queue);
+			netmap_mitigation_init(&gna->mit[r], r, na);
+			generic_mit_reset(&gna->mit[r]);
 		}
 
 		/*
@@ -284,13 +436,18 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 		for (r=0; r<na->num_tx_rings; r++)
 			na->tx_rings[r].tx_pool = NULL;
 		for (r=0; r<na->num_tx_rings; r++) {
-			na->tx_rings[r].tx_pool = malloc(na->num_tx_desc * sizeof(struct mbuf *),
+			/* tx_head goes after the pool */
+			na->tx_rings[r].tx_pool = malloc(na->num_tx_desc *
+					(sizeof(struct mbuf *) + sizeof(u_int)),
 					M_DEVBUF, M_NOWAIT | M_ZERO);
 			if (!na->tx_rings[r].tx_pool) {
 				D("tx_pool allocation failed");
 				error = ENOMEM;
 				goto free_tx_pools;
 			}
+			na->tx_rings[r].tx_head = (u_int *)
+				(na->tx_rings[r].tx_pool + na->num_tx_desc);
+			na->tx_rings[r].tx_event = NULL;
 			for (i=0; i<na->num_tx_desc; i++)
 				na->tx_rings[r].tx_pool[i] = NULL;
 			for (i=0; i<na->num_tx_desc; i++) {
@@ -303,6 +460,18 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 				na->tx_rings[r].tx_pool[i] = m;
 			}
 		}
+		/* Initialize the rx queues, as generic_rx_handler() can
+		 * be called as soon as netmap_catch_rx() returns.
+		 */
+		for (r=0; r<na->num_rx_rings; r++) {
+			error = generic_rx_stage_create(&na->rx_rings[r]);
+			if (error) {
+				D("rx queue allocation failed");
+				goto free_tx_pools;
+			}
+			na->rx_rings[r].ring->rx_drops = 0;
+		}
+
 		rtnl_lock();
 		/* Prepare to intercept incoming traffic. */
 		error = netmap_catch_rx(na, 1);
@@ -329,11 +498,22 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 		rate_ctx.refcount++;
 #endif /* RATE */
 
+		gna->mit_next = nm_generic_active;
+		nm_generic_active = gna;
 	} else if (na->tx_rings[0].tx_pool) {
 		/* Disable netmap mode. We enter here only if the previous
 		   generic_netmap_register(na, 1) was successfull.
 		   If it was not, na->tx_rings[0].tx_pool was set to NULL by the
 		   error handling code below. */
+		struct netmap_generic_adapter **pp;
+
+		for (pp = &nm_generic_active; *pp != NULL; pp = &(*pp)->mit_next) {
+			if (*pp == gna) {
+				*pp = gna->mit_next;
+				break;
+			}
+		}
+
 		rtnl_lock();
 
 		na->na_flags &= ~NAF_NETMAP_ON;
@@ -347,14 +527,13 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 		rtnl_unlock();
 
 		/* Free the mbufs going to the netmap rings */
-		for (r=0; r<na->num_rx_rings; r++) {
-			mbq_safe_purge(&na->rx_rings[r].rx_queue);
-			mbq_safe_destroy(&na->rx_rings[r].rx_queue);
-		}
+		for (r=0; r<na->num_rx_rings; r++)
+			generic_rx_stage_delete(&na->rx_rings[r]);
 
 		for (r=0; r<na->num_rx_rings; r++)
 			netmap_mitigation_cleanup(&gna->mit[r]);
 		free(gna->mit, M_DEVBUF);
+		gna->mit = NULL;
 
 		for (r=0; r<na->num_tx_rings; r++) {
 			for (i=0; i<na->num_tx_desc; i++) {
@@ -394,14 +573,120 @@ free_tx_pools:
 	}
 	for (r=0; r<na->num_rx_rings; r++) {
 		netmap_mitigation_cleanup(&gna->mit[r]);
-		mbq_safe_destroy(&na->rx_rings[r].rx_queue);
+		generic_rx_stage_delete(&na->rx_rings[r]);
 	}
 	free(gna->mit, M_DEVBUF);
+	gna->mit = NULL;
 out:
 
 	return error;
 }
 
+/*
+ * NIOCSETMIT: read or set the mitigation bounds of an rx ring
+ * bound to priv. Call with NMG_LOCK held.
+ */
+int
+generic_netmap_set_mit(struct netmap_priv_d *priv, struct nm_mit_req *req)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct netmap_generic_adapter *gna = (struct netmap_generic_adapter *)na;
+	struct nm_generic_mit *mit;
+	u_int r = req->nmi_ring;
+
+	NMG_LOCK_ASSERT();
+	if (priv->np_nifp == NULL || na == NULL)
+		return ENXIO;
+	if (na->nm_register != generic_netmap_register || gna->mit == NULL)
+		return EOPNOTSUPP;
+	if (r < priv->np_rxqfirst || r >= priv->np_rxqlast ||
+	    r >= na->num_rx_rings)
+		return EINVAL;
+	mit = &gna->mit[r];
+	if (req->nmi_flags & NETMAP_MIT_SET) {
+		u_int delay, i;
+
+		if (req->nmi_min_ns > req->nmi_max_ns)
+			return EINVAL;
+		/* a running generic_mit_update() is short, spin for a
+		 * while but do not sleep, we hold NMG_LOCK
+		 */
+		for (i = 0; NM_ATOMIC_TEST_AND_SET(&mit->mit_busy); i++) {
+			if (i == NM_MIT_SPINS)
+				return EBUSY;
+		}
+		mit->mit_min = req->nmi_min_ns;
+		mit->mit_max = req->nmi_max_ns;
+		/* the next generic_mit_update() does the rest */
+		delay = mit->mit_delay;
+		if (delay > mit->mit_max)
+			delay = mit->mit_max;
+		if (delay < mit->mit_min)
+			delay = mit->mit_min;
+		mit->mit_delay = delay;
+		NM_ATOMIC_CLEAR(&mit->mit_busy);
+	}
+	req->nmi_min_ns = mit->mit_min;
+	req->nmi_max_ns = mit->mit_max;
+	req->nmi_delay_ns = mit->mit_delay;
+	req->nmi_rate = mit->mit_gap ? 1000000000 / mit->mit_gap : 0;
+	req->nmi_batch = mit->mit_batch >> NM_MIT_BATCH_SHIFT;
+	return 0;
+}
+
+/*
+ * Print the mitigation state of the rx rings of the registered
+ * generic adapters, for the generic_mit_stats sysctl (FreeBSD) or
+ * module parameter (linux).
+ * Returns the number of bytes written, excluding the final NUL.
+ */
+int
+netmap_generic_mit_print_stats(char *buf, int len)
+{
+	struct netmap_generic_adapter *gna;
+	u_int r;
+	int n = 0;
+
+	buf[0] = '\0';
+	NMG_LOCK();
+	for (gna = nm_generic_active; gna != NULL && n < len;
+	    gna = gna->mit_next) {
+		struct netmap_adapter *na = &gna->up.up;
+
+		for (r = 0; r < na->num_rx_rings && n < len; r++) {
+			struct nm_generic_mit *mit = &gna->mit[r];
+
+			n += snprintf(buf + n, len - n,
+				"%s rx %u delay %u min %u max %u rate %u "
+				"batch %u\n", na->name, r, mit->mit_delay,
+				mit->mit_min, mit->mit_max,
+				mit->mit_gap ? 1000000000 / mit->mit_gap : 0,
+				mit->mit_batch >> NM_MIT_BATCH_SHIFT);
+		}
+	}
+	NMG_UNLOCK();
+	return n < len ? n : len - 1;
+}
+
+#ifdef __FreeBSD__
+static int
+netmap_generic_mit_stats_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	char *buf;
+	int len = 4096, error;
+
+	buf = malloc(len, M_DEVBUF, M_WAITOK | M_ZERO);
+	netmap_generic_mit_print_stats(buf, len);
+	error = sysctl_handle_string(oidp, buf, len, req);
+	free(buf, M_DEVBUF);
+	return error;
+}
+SYSCTL_DECL(_dev_netmap);
+SYSCTL_PROC(_dev_netmap, OID_AUTO, generic_mit_stats,
+    CTLTYPE_STRING | CTLFLAG_RD, 0, 0, netmap_generic_mit_stats_sysctl, "A",
+    "Rx mitigation delays of the generic adapters");
+#endif /* __FreeBSD__ */
+
 /*
  * Callback invoked when the device driver frees an mbuf used
  * by netmap to transmit a packet. This usually happens when
@@ -410,6 +695,15 @@ out:
 static void
 generic_mbuf_destructor(struct mbuf *m)
 {
+	struct netmap_adapter *na = NA(MBUF_IFP(m));
+	u_int r = MBUF_TXQ(m);
+
+	/* the event is consumed, see generic_netmap_tx_clean() */
+	if (nm_netmap_on(na) && r < na->num_tx_rings &&
+	    na->tx_rings[r].tx_event == m) {
+		na->tx_rings[r].tx_event = NULL;
+		smp_mb();
+	}
 	netmap_generic_irq(MBUF_IFP(m), MBUF_TXQ(m), NULL);
 #ifdef __FreeBSD__
 	if (netmap_verbose)
@@ -425,6 +719,9 @@ extern int netmap_adaptive_io;
  *
  * The oldest tx buffer not yet completed is at nr_hwtail + 1,
  * nr_hwcur is the first unsent buffer.
+ * Completion is per packet: the slots of a packet (NS_MOREFRAG)
+ * are done when the mbuf of its first slot is, as it carries the
+ * data (or, with generic_txzc, the buffers) of all of them.
  */
 static u_int
 generic_netmap_tx_clean(struct netmap_kring *kring)
@@ -438,16 +735,24 @@ generic_netmap_tx_clean(struct netmap_kring *kring)
 	while (nm_i != hwcur) { /* buffers not completed */
 		struct mbuf *m = tx_pool[nm_i];
 
-		if (unlikely(m == NULL)) {
-			/* this is done, try to replenish the entry */
+		if (kring->tx_head[nm_i] != nm_i) {
+			/* not the first slot, its packet is done */
+		} else if (unlikely(m == NULL)) {
+			/* the event mbuf, done once its destructor has run */
+			if (kring->tx_event != NULL)
+				break;
+			/* try to replenish the entry */
 			tx_pool[nm_i] = m = netmap_get_mbuf(NETMAP_BUF_SIZE(kring->na));
 			if (unlikely(m == NULL)) {
 				D("mbuf allocation failed, XXX error");
 				// XXX how do we proceed ? break ?
 				return -ENOMEM;
 			}
-		} else if (GET_MBUF_REFCNT(m) != 1) {
-			break; /* This mbuf is still busy: its refcnt is 2. */
+		} else if (GET_MBUF_REFCNT(m) != 1 || MBUF_CLONED(m)) {
+			/* This mbuf is still busy: its refcnt is 2,
+			 * or a clone still uses its data.
+			 */
+			break;
 		}
 		n++;
 		nm_i = nm_next(nm_i, lim);
@@ -507,7 +812,10 @@ generic_tx_event_middle(struct netmap_kring *kring, u_int hwcur)
 
 /*
  * We have pending packets in the driver between nr_hwtail+1 and hwcur.
- * Schedule a notification approximately in the middle of the two.
+ * Schedule a notification approximately in the middle of the two,
+ * on the first slot of a packet: the mbufs of the other slots of a
+ * packet are not in the driver. If that packet is already done, use
+ * the oldest one, where generic_netmap_tx_clean() stops.
  * There is a race but this is only called within txsync which does
  * a double check.
  */
@@ -520,31 +828,77 @@ generic_set_tx_event(struct netmap_kring *kring, u_int hwcur)
 	if (nm_next(kring->nr_hwtail, kring->nkr_num_slots -1) == hwcur) {
 		return; /* all buffers are free */
 	}
-	e = generic_tx_event_middle(kring, hwcur);
-
+	if (kring->tx_event != NULL) {
+		return; /* one event at a time, still in the driver */
+	}
+	e = kring->tx_head[generic_tx_event_middle(kring, hwcur)];
 	m = kring->tx_pool[e];
+	if (m != NULL && GET_MBUF_REFCNT(m) == 1 && !MBUF_CLONED(m)) {
+		e = nm_next(kring->nr_hwtail, kring->nkr_num_slots - 1);
+		m = kring->tx_pool[e];
+	}
+
 	ND(5, "Request Event at %d mbuf %p refcnt %d", e, m, m ? GET_MBUF_REFCNT(m) : -2 );
 	if (m == NULL) {
-		/* This can happen if there is already an event on the netmap
-		   slot 'e': There is nothing to do. */
+		/* an entry not replenished yet, there is nothing to do */
 		return;
 	}
 	kring->tx_pool[e] = NULL;
+	/* the destructor may run as soon as m is freed */
+	kring->tx_event = m;
 	SET_MBUF_DESTRUCTOR(m, generic_mbuf_destructor);
 
-	// XXX wmb() ?
+	smp_mb();	/* tx_event before the refcount */
 	/* Decrement the refcount an free it if we have the last one. */
 	m_freem(m);
 	smp_mb();
 }
 
 
+/*
+ * Build the packet in the slots [nm_i .. last] (more than one with
+ * NS_MOREFRAG) in the mbuf m, with generic_xmit_frame(), without
+ * sending it yet. Returns EMSGSIZE if the packet cannot be sent
+ * whole and must be dropped.
+ */
+static int
+generic_xmit_slots(struct netmap_kring *kring, struct mbuf *m,
+	u_int nm_i, u_int last)
+{
+	struct netmap_adapter *na = kring->na;
+	struct netmap_ring *ring = kring->ring;
+	u_int const lim = kring->nkr_num_slots - 1;
+	int flags = 0;
+
+	for (;;) {
+		struct netmap_slot *slot = &ring->slot[nm_i];
+		u_int len = slot->len;
+		u_int off = nm_get_offset(kring, slot);
+		void *addr = NMB(na, slot);
+		int tx_ret;
+
+		NM_CHECK_ADDR_LEN(na, addr, len);
+		if (unlikely(len > NETMAP_BUF_SIZE(na) - off))
+			len = NETMAP_BUF_SIZE(na) - off;
+		addr = (char *)addr + off;
+
+		tx_ret = generic_xmit_frame(na->ifp, m, addr, len,
+				kring->ring_id, flags | NM_XMIT_FRAG);
+		if (tx_ret || nm_i == last)
+			return tx_ret;
+		flags |= NM_XMIT_APPEND;
+		nm_i = nm_next(nm_i, lim);
+	}
+}
+
 /*
  * generic_netmap_txsync() transforms netmap buffers into mbufs
  * and passes them to the standard device driver
  * (ndo_start_xmit() or ifp->if_transmit() ).
- * On linux this is not done directly, but using dev_queue_xmit(),
- * since it implements the TX flow control (and takes some locks).
+ * On linux the driver is called directly if the kernel supports
+ * the xmit_more hint, with the tx queue locked once for the whole
+ * batch (see generic_xmit_batch()); otherwise dev_queue_xmit() is
+ * used, which implements the TX flow control (and takes some locks).
  */
 static int
 generic_netmap_txsync(struct netmap_kring *kring, int flags)
@@ -568,63 +922,110 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 	 */
 	nm_i = kring->nr_hwcur;
 	if (nm_i != head) {	/* we have new packets to send */
-		while (nm_i != head) {
-			struct netmap_slot *slot = &ring->slot[nm_i];
-			u_int len = slot->len;
-			void *addr = NMB(na, slot);
+		/* A packet is built one round before it is sent, so
+		 * that the driver gets the xmit_more hint only when the
+		 * next packet is ready: if building that one failed, the
+		 * doorbell of the previous packet would never be rung.
+		 * A busy driver stops the queue, and rings the doorbell
+		 * when it does, so only the failures to build matter.
+		 * The packet in 'pend' starts at nm_i; the slots up to
+		 * b (the first slot not built yet) are pend and the
+		 * packets dropped after it.
+		 */
+		struct mbuf *pend = NULL;
+		u_int b = nm_i;
 
+		generic_xmit_batch(ifp, ring_nr, 1);
+		for (;;) {
 			/* device-specific */
-			struct mbuf *m;
+			struct mbuf *m = NULL;
+			u_int last = b;
 			int tx_ret;
 
-			NM_CHECK_ADDR_LEN(na, addr, len);
-
-			/* Tale a mbuf from the tx pool and copy in the user packet. */
-			m = kring->tx_pool[nm_i];
-			if (unlikely(!m)) {
-				RD(5, "This should never happen");
-				kring->tx_pool[nm_i] = m = netmap_get_mbuf(NETMAP_BUF_SIZE(na));
-				if (unlikely(m == NULL)) {
-					D("mbuf allocation failed");
-					break;
+			/* the packet ends at the first slot without
+			 * NS_MOREFRAG, wait until it is complete
+			 */
+			while (b != head && ring->slot[last].flags & NS_MOREFRAG &&
+			    nm_next(last, lim) != head)
+				last = nm_next(last, lim);
+			if (b != head && !(ring->slot[last].flags & NS_MOREFRAG)) {
+				/* Tale a mbuf from the tx pool and copy in the user packet. */
+				m = kring->tx_pool[b];
+				if (unlikely(!m)) {
+					RD(5, "This should never happen");
+					kring->tx_pool[b] = m = netmap_get_mbuf(NETMAP_BUF_SIZE(na));
+					if (unlikely(m == NULL))
+						D("mbuf allocation failed");
 				}
 			}
-			/* XXX we should ask notifications when NS_REPORT is set,
-			 * or roughly every half frame. We can optimize this
-			 * by lazily requesting notifications only when a
-			 * transmission fails. Probably the best way is to
-			 * break on failures and set notifications when
-			 * ring->cur == ring->tail || nm_i != cur
-			 */
-			tx_ret = generic_xmit_frame(ifp, m, addr, len, ring_nr);
-			if (unlikely(tx_ret)) {
-				ND(5, "start_xmit failed: err %d [nm_i %u, head %u, hwtail %u]",
-						tx_ret, nm_i, head, kring->nr_hwtail);
-				/*
-				 * No room for this mbuf in the device driver.
-				 * Request a notification FOR A PREVIOUS MBUF,
-				 * then call generic_netmap_tx_clean(kring) to do the
-				 * double check and see if we can free more buffers.
-				 * If there is space continue, else break;
-				 * NOTE: the double check is necessary if the problem
-				 * occurs in the txsync call after selrecord().
-				 * Also, we need some way to tell the caller that not
-				 * all buffers were queued onto the device (this was
-				 * not a problem with native netmap driver where space
-				 * is preallocated). The bridge has a similar problem
-				 * and we solve it there by dropping the excess packets.
-				 */
-				generic_set_tx_event(kring, nm_i);
-				if (generic_netmap_tx_clean(kring)) { /* space now available */
+			if (m != NULL) {
+				u_int j;
+
+				for (j = b; j != last; j = nm_next(j, lim))
+					kring->tx_head[j] = b;
+				kring->tx_head[last] = b;
+				tx_ret = generic_xmit_slots(kring, m, b, last);
+				if (unlikely(tx_ret == EMSGSIZE)) {
+					RD(5, "%s: packet too long, dropped",
+						kring->name);
+					b = nm_next(last, lim);
+					if (pend == NULL) {
+						for (; nm_i != b; nm_i = nm_next(nm_i, lim))
+							ring->slot[nm_i].flags &= ~(NS_REPORT | NS_BUF_CHANGED);
+					}
 					continue;
-				} else {
-					break;
 				}
+				if (unlikely(tx_ret))
+					m = NULL; /* no memory, stop here */
 			}
-			slot->flags &= ~(NS_REPORT | NS_BUF_CHANGED);
-			nm_i = nm_next(nm_i, lim);
-			IFRATE(rate_ctx.new.txpkt ++);
+			if (pend != NULL) {
+				/* XXX we should ask notifications when NS_REPORT is set,
+				 * or roughly every half frame. We can optimize this
+				 * by lazily requesting notifications only when a
+				 * transmission fails. Probably the best way is to
+				 * break on failures and set notifications when
+				 * ring->cur == ring->tail || nm_i != cur
+				 */
+				tx_ret = generic_xmit_frame(ifp, pend, NULL, 0,
+					ring_nr, NM_XMIT_APPEND |
+					(m != NULL ? NM_XMIT_MORE : 0));
+				pend = NULL;
+				if (unlikely(tx_ret)) {
+					ND(5, "start_xmit failed: err %d [nm_i %u, head %u, hwtail %u]",
+							tx_ret, nm_i, head, kring->nr_hwtail);
+					/*
+					 * No room for this mbuf in the device driver.
+					 * Request a notification FOR A PREVIOUS MBUF,
+					 * then call generic_netmap_tx_clean(kring) to do the
+					 * double check and see if we can free more buffers.
+					 * If there is space continue, else break;
+					 * NOTE: the double check is necessary if the problem
+					 * occurs in the txsync call after selrecord().
+					 * Also, we need some way to tell the caller that not
+					 * all buffers were queued onto the device (this was
+					 * not a problem with native netmap driver where space
+					 * is preallocated). The bridge has a similar problem
+					 * and we solve it there by dropping the excess packets.
+					 * The packets after nm_i are built again.
+					 */
+					generic_set_tx_event(kring, nm_i);
+					b = nm_i;
+					if (generic_netmap_tx_clean(kring)) { /* space now available */
+						continue;
+					} else {
+						break;
+					}
+				}
+				for (; nm_i != b; nm_i = nm_next(nm_i, lim))
+					ring->slot[nm_i].flags &= ~(NS_REPORT | NS_BUF_CHANGED);
+				IFRATE(rate_ctx.new.txpkt ++);
+			}
+			if (m == NULL)
+				break;
+			pend = m;
+			b = nm_next(last, lim);
 		}
+		generic_xmit_batch(ifp, ring_nr, 0);
 
 		/* Update hwcur to the next slot to transmit. */
 		kring->nr_hwcur = nm_i; /* not head, we could break early */
@@ -658,56 +1059,77 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
  * the driver can be stolen to the network stack.
  * Stolen packets are put in a queue where the
  * generic_netmap_rxsync() callback can extract them.
+ * The queue is that of the current cpu, and the rxsync drains the
+ * queues in cpu order: packets of a ring that arrive on different
+ * cpus may be reordered, those arriving on the same cpu are not.
  */
 void
 generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 {
 	struct netmap_adapter *na = NA(ifp);
 	struct netmap_generic_adapter *gna = (struct netmap_generic_adapter *)na;
-	u_int work_done;
+	struct nm_generic_stage *gs;
+	struct nm_generic_mit *mit;
+	u_int work_done, tail;
 	u_int rr = MBUF_RXQ(m); // receive ring number
+	int cpu;
+	unsigned long flags;
 
 	if (rr >= na->num_rx_rings) {
 		rr = rr % na->num_rx_rings; // XXX expensive...
 	}
 
-	/* limit the size of the queue */
-	if (unlikely(mbq_len(&na->rx_rings[rr].rx_queue) > 1024)) {
-		m_freem(m);
+	/* we are the only producer on the queue of this cpu,
+	 * as long as we do not migrate or get interrupted.
+	 */
+	cpu = nm_cpu_get(flags);
+	gs = &na->rx_rings[rr].nkr_gstage[cpu];
+	gs->gs_pkts++;	/* for the mitigation */
+	tail = gs->gs_tail;
+	if (unlikely(tail - gs->gs_head > gs->gs_mask)) {
+		gs->gs_drops++;	/* queue full */
 	} else {
-		mbq_safe_enqueue(&na->rx_rings[rr].rx_queue, m);
+		gs->gs_q[tail & gs->gs_mask] = m;
+		mb();	/* the mbuf before the tail */
+		gs->gs_tail = tail + 1;
+		m = NULL;
 	}
+	nm_cpu_put(flags);
+	if (unlikely(m != NULL))
+		m_freem(m);
 
-	if (netmap_generic_mit < 32768) {
-		/* no rx mitigation, pass notification up */
+	/* same as send combining, filter notification if there is a
+	 * pending timer, otherwise pass it up and start a timer, unless
+	 * the traffic is so light that we notify every packet.
+	 */
+	mit = &gna->mit[rr];
+	if (likely(netmap_mitigation_active(mit))) {
+		/* Record that there is some pending work. */
+		mit->mit_pending = 1;
+	} else {
 		netmap_generic_irq(na->ifp, rr, &work_done);
 		IFRATE(rate_ctx.new.rxirq++);
-	} else {
-		/* same as send combining, filter notification if there is a
-		 * pending timer, otherwise pass it up and start a timer.
-		 */
-		if (likely(netmap_mitigation_active(&gna->mit[rr]))) {
-			/* Record that there is some pending work. */
-			gna->mit[rr].mit_pending = 1;
-		} else {
-			netmap_generic_irq(na->ifp, rr, &work_done);
-			IFRATE(rate_ctx.new.rxirq++);
-			netmap_mitigation_start(&gna->mit[rr]);
-		}
+		generic_mit_update(mit);
+		if (mit->mit_delay)
+			netmap_mitigation_start(mit);
 	}
 }
 
 /*
- * generic_netmap_rxsync() extracts mbufs from the queue filled by
- * generic_netmap_rx_handler() and puts their content in the netmap
- * receive ring.
- * Access must be protected because the rx handler is asynchronous,
+ * generic_netmap_rxsync() extracts mbufs from the per-cpu queues
+ * filled by generic_rx_handler() and puts their content in the netmap
+ * receive ring. The queues have a single producer and a single
+ * consumer (the rxsyncs are serialized), so they need no lock.
+ * The mbufs that do not fit in the ring stay in the queues until the
+ * next rxsync. ring->rx_drops reports the mbufs dropped by
+ * generic_rx_handler() because a queue was full.
  */
 static int
 generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 {
 	struct netmap_ring *ring = kring->ring;
 	struct netmap_adapter *na = kring->na;
+	struct netmap_generic_adapter *gna = (struct netmap_generic_adapter *)na;
 	u_int nm_i;	/* index into the netmap ring */ //j,
 	u_int n;
 	u_int const lim = kring->nkr_num_slots - 1;
@@ -721,41 +1143,56 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 	 * First part: import newly received packets.
 	 */
 	if (netmap_no_pendintr || force_update) {
-		/* extract buffers from the rx queue, stop at most one
+		/* extract buffers from the rx queues, stop at most one
 		 * slot before nr_hwcur (stop_i)
 		 */
 		uint16_t slot_flags = kring->nkr_slot_flags;
 		u_int stop_i = nm_prev(kring->nr_hwcur, lim);
+		uint64_t drops = 0;
+		u_int cpu;
 
 		nm_i = kring->nr_hwtail; /* first empty slot in the receive ring */
-		for (n = 0; nm_i != stop_i; n++) {
-			int len;
-			void *addr = NMB(na, &ring->slot[nm_i]);
-			struct mbuf *m;
-
-			/* we only check the address here on generic rx rings */
-			if (addr == NETMAP_BUF_BASE(na)) { /* Bad buffer */
-				return netmap_ring_reinit(kring);
+		for (n = 0, cpu = 0; cpu < NM_NCPUS; cpu++) {
+			struct nm_generic_stage *gs = &kring->nkr_gstage[cpu];
+			u_int qhead = gs->gs_head, qtail = gs->gs_tail;
+
+			drops += gs->gs_drops;
+			if (qhead == qtail || nm_i == stop_i)
+				continue;
+			mb();	/* read the mbufs after the tail */
+			for (; qhead != qtail && nm_i != stop_i; qhead++, n++) {
+				int len;
+				struct netmap_slot *slot = &ring->slot[nm_i];
+				u_int off = nm_get_offset(kring, slot);
+				void *addr = NMB(na, slot);
+				struct mbuf *m = gs->gs_q[qhead & gs->gs_mask];
+
+				/* we only check the address here on generic rx rings */
+				if (addr == NETMAP_BUF_BASE(na)) { /* Bad buffer */
+					gs->gs_head = qhead;
+					return netmap_ring_reinit(kring);
+				}
+				len = MBUF_LEN(m);
+				if (unlikely(len > (int)(NETMAP_BUF_SIZE(na) - off)))
+					len = NETMAP_BUF_SIZE(na) - off;
+				m_copydata(m, 0, len, (char *)addr + off);
+				ring->slot[nm_i].len = len;
+				ring->slot[nm_i].flags = slot_flags;
+				m_freem(m);
+				nm_i = nm_next(nm_i, lim);
 			}
-			/*
-			 * Call the locked version of the function.
-			 * XXX Ideally we could grab a batch of mbufs at once
-			 * and save some locking overhead.
-			 */
-			m = mbq_safe_dequeue(&kring->rx_queue);
-			if (!m)	/* no more data */
-				break;
-			len = MBUF_LEN(m);
-			m_copydata(m, 0, len, addr);
-			ring->slot[nm_i].len = len;
-			ring->slot[nm_i].flags = slot_flags;
-			m_freem(m);
-			nm_i = nm_next(nm_i, lim);
+			mb();	/* done with the mbufs before the head */
+			gs->gs_head = qhead;
 		}
 		if (n) {
+			struct nm_generic_mit *mit = &gna->mit[kring->ring_id];
+
 			kring->nr_hwtail = nm_i;
+			/* the batch of the consumer, for the mitigation */
+			mit->mit_batch += n - (mit->mit_batch >> NM_MIT_BATCH_SHIFT);
 			IFRATE(rate_ctx.new.rxpkt += n);
 		}
+		ring->rx_drops = drops;
 		kring->nr_kflags &= ~NKR_PENDINTR;
 	}
 
@@ -51,6 +51,9 @@
 #if defined(CONFIG_NETMAP_V1000)
 #define WITH_V1000
 #endif
+#if defined(CONFIG_NETMAP_KTHREAD)
+#define WITH_KTHREAD
+#endif
 
 #else /* not linux */
 
@@ -58,6 +61,7 @@
 #define WITH_PIPES
 #define WITH_MONITOR
 #define WITH_GENERIC
+#define WITH_KTHREAD
 
 #endif
 
@@ -78,6 +82,9 @@
 #define	NM_SELINFO_T	struct nm_selinfo
 #define	MBUF_LEN(m)	((m)->m_pkthdr.len)
 #define	MBUF_IFP(m)	((m)->m_pkthdr.rcvif)
+/* flow hash used to pick the host rx ring, see netmap_transmit() */
+#define	MBUF_HASH(m)	(M_HASHTYPE_GET(m) != M_HASHTYPE_NONE ?	\
+				(m)->m_pkthdr.flowid : (uint32_t)curcpu)
 #define	NM_SEND_UP(ifp, m)	((NA(ifp))->if_input)(ifp, m)
 
 #define NM_ATOMIC_T	volatile int	// XXX ?
@@ -85,6 +92,7 @@
 #include <machine/atomic.h>
 #define NM_ATOMIC_TEST_AND_SET(p)       (!atomic_cmpset_acq_int((p), 0, 1))
 #define NM_ATOMIC_CLEAR(p)              atomic_store_rel_int((p), 0)
+#define NM_ATOMIC_TEST_AND_CLEAR(p)     atomic_cmpset_acq_int((p), 1, 0)
 
 #if __FreeBSD_version >= 1100030
 #define	WNA(_ifp)	(_ifp)->if_netmap
@@ -115,6 +123,33 @@ struct nm_selinfo {
 
 void freebsd_selwakeup(struct nm_selinfo *si, int pri);
 
+/* monotonic time in nanoseconds, for statistics */
+static inline uint64_t
+nm_time_ns(void)
+{
+	struct timespec ts;
+
+	nanouptime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* wall clock time in nanoseconds, for the slot timestamps */
+static inline uint64_t
+nm_realtime_ns(void)
+{
+	struct timespec ts;
+
+	nanotime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* stay on the current cpu, with interrupts disabled, between
+ * nm_cpu_get() and nm_cpu_put(). f is an unsigned long.
+ */
+#define nm_cpu_get(f)	((f) = 0, spinlock_enter(), curcpu)
+#define nm_cpu_put(f)	spinlock_exit()
+#define NM_NCPUS	(mp_maxid + 1)
+
 // XXX linux struct, not used in FreeBSD
 struct net_device_ops {
 };
@@ -131,6 +166,9 @@ struct hrtimer {
 #define	NM_SELINFO_T	wait_queue_head_t
 #define	MBUF_LEN(m)	((m)->len)
 #define	MBUF_IFP(m)	((m)->dev)
+#define	MBUF_HASH(m)	skb_get_hash(m)
+/* the packets from a host tx ring go up in one batch */
+#define	NM_SEND_UP_BATCH(ifp, q)	netmap_linux_send_up(ifp, q)
 #define	NM_SEND_UP(ifp, m)  \
                         do { \
                             m->priority = NM_MAGIC_PRIORITY_RX; \
@@ -146,6 +184,14 @@ struct hrtimer {
 #define NM_MTX_UNLOCK(m)	mutex_unlock(&(m))
 #define NM_MTX_ASSERT(m)	mutex_is_locked(&(m))
 
+#define nm_time_ns()	((uint64_t)ktime_to_ns(ktime_get()))
+#define nm_realtime_ns()	((uint64_t)ktime_to_ns(ktime_get_real()))
+
+/* see the FreeBSD version */
+#define nm_cpu_get(f)	({ local_irq_save(f); smp_processor_id(); })
+#define nm_cpu_put(f)	local_irq_restore(f)
+#define NM_NCPUS	nr_cpu_ids
+
 #ifndef DEV_NETMAP
 #define DEV_NETMAP
 #endif /* DEV_NETMAP */
@@ -256,9 +302,9 @@ extern NMG_LOCK_T	netmap_global_lock;
  * by nm_kr_(try)lock() which in turn uses nr_busy. This is all we need
  * for NIC rings, and for TX rings attached to the host stack.
  *
- * RX rings attached to the host stack use an mbq (rx_queue) on both
- * rxsync_from_host() and netmap_transmit(). The mbq is protected
- * by its internal lock.
+ * RX rings attached to the host stack get their packets from
+ * netmap_transmit() through lockless per-cpu queues (nkr_stage).
+ * rxsync_from_host() drains them under the lock of the rx_queue mbq.
  *
  * RX rings attached to the VALE switch are accessed by both senders
  * and receiver. They are protected through the q_lock on the RX ring.
@@ -280,6 +326,7 @@ struct netmap_kring {
 
 	uint32_t	nr_kflags;	/* private driver flags */
 #define NKR_PENDINTR	0x1		// Pending interrupt.
+#define NKR_SLOT_TS_SELF 0x2		// stamps its slots, see nm_slot_ts()
 	uint32_t	nkr_num_slots;
 
 	/*
@@ -291,6 +338,14 @@ struct netmap_kring {
 
 	uint16_t	nkr_slot_flags;	/* initial value for flags */
 
+	/* per-slot data offsets (NR_OFFSETS), copied into the ring
+	 * by netmap_mem_rings_create(). The offset of a slot is
+	 * (slot->ptr & nkr_offset_mask), and is never larger than
+	 * nkr_max_offset. The mask is 0 if offsets are not in use.
+	 */
+	uint64_t	nkr_offset_mask;
+	uint32_t	nkr_max_offset;
+
 	/* last_reclaim is opaque marker to help reduce the frequency
 	 * of operations such as reclaiming tx buffers. A possible use
 	 * is set it to ticks and do the reclaim only once per tick.
@@ -326,8 +381,22 @@ struct netmap_kring {
 	 * a rxsync.
 	 */
 	struct mbuf **tx_pool;
+	/* first slot of the packet of each tx slot (NS_MOREFRAG):
+	 * the whole packet uses the tx_pool mbuf of that slot
+	 */
+	u_int *tx_head;
+	/* the tx_pool mbuf given away to get a notification,
+	 * NULL once its destructor has run
+	 */
+	struct mbuf * volatile tx_event;
 	// u_int nr_ntc;		/* Emulation of a next-to-clean RX ring pointer. */
 	struct mbq rx_queue;            /* intercepted rx mbufs. */
+	/* generic rx rings: per-cpu queues of the intercepted mbufs */
+	struct nm_generic_stage *nkr_gstage;
+	/* host rx rings of hw ports: per-cpu queues of the mbufs
+	 * from the host stack, see netmap_transmit()
+	 */
+	struct nm_host_stage *nkr_stage;
 
 	uint32_t	ring_id;	/* debugging */
 	char name[64];			/* diagnostic */
@@ -352,12 +421,27 @@ struct netmap_kring {
 	struct netmap_ring *save_ring;	/* pointer to hidden rings
        					 * (see netmap_pipe.c for details)
 					 */
+	/* state of the pipe load balancer on this rx kring (NR_PIPE_LB) */
+	struct nm_pipe_lb_ring *nkr_lb;
+	/* rx kring of a broadcast slave (NR_PIPE_BCAST): the original
+	 * buffers of the slots, non NULL while a consumer is bound,
+	 * the max number of slots held and the slots dropped
+	 */
+	uint32_t *nkr_bc_bufs;
+	u_int nkr_bc_lag;
+	uint64_t nkr_bc_drops;
 #endif /* WITH_PIPES */
 
 #ifdef WITH_MONITOR
-	/* pointer to the adapter that is monitoring this kring (if any)
+	/* the adapters that are monitoring this kring (if any).
+	 * A zero-copy monitor is always alone.
 	 */
-	struct netmap_monitor_adapter *monitor;
+	struct netmap_monitor_adapter **monitors;
+	u_int n_monitors;
+	/* on the rx rings of a monitor, packets to skip before the
+	 * next sample (see nmf_sample)
+	 */
+	u_int nkr_mon_skip;
 	/*
 	 * Monitors work by intercepting the txsync and/or rxsync of the
 	 * monitored krings. This is implemented by replacing
@@ -366,6 +450,68 @@ struct netmap_kring {
 	 */
 	int (*save_sync)(struct netmap_kring *kring, int flags);
 #endif
+
+#ifdef WITH_KTHREAD
+	/* the sync kthread serving this kring (if any) */
+	struct nm_sync_kthread *nkr_kthread;
+#endif /* WITH_KTHREAD */
+
+	/* per-slot timestamps in the netmap_ring (NR_SLOT_TS) */
+	uint64_t	*nkr_ts;
+
+	/* hwtail seen by the last nm_kring_need_event() */
+	uint32_t	nkr_event_tail;
+
+	/* eventfd signalled by netmap_notify() (NIOCSETEVFD),
+	 * opaque to the OS-independent code, and its owner
+	 */
+	void		*nkr_evfd;
+	struct netmap_priv_d *nkr_evfd_priv;
+
+	/* time of the last notification while busy-polling
+	 * descriptors were asleep, see netmap_poll()
+	 */
+	uint64_t	nkr_notify_ns;
+} __attribute__((__aligned__(64)));
+
+
+/*
+ * Per-cpu staging queue of a host rx ring. netmap_transmit()
+ * is the only producer on each cpu: it runs between nm_cpu_get()
+ * and nm_cpu_put() with interrupts disabled, so not even a netpoll
+ * transmit from an interrupt can interleave with it.
+ * netmap_rxsync_from_host() is the consumer, serialized by the
+ * rx_queue lock, so the queue needs no lock.
+ * The indexes are free running. The queues are drained in cpu
+ * order, so the packets of a flow whose sender moves to another
+ * cpu can be reordered.
+ */
+#define NM_HOST_STAGE_SLOTS	256	/* must be a power of 2 */
+
+struct nm_host_stage {
+	volatile u_int	hs_tail;	/* written by the producer */
+	volatile u_int	hs_head __attribute__((__aligned__(64)));
+					/* written by the consumer */
+	struct mbuf	*hs_q[NM_HOST_STAGE_SLOTS];
+} __attribute__((__aligned__(64)));
+
+
+/*
+ * Per-cpu staging queue of a generic rx ring, with the same protocol
+ * as nm_host_stage: generic_rx_handler() is the only producer on each
+ * cpu, generic_netmap_rxsync() the consumer. The queues are as large
+ * as the netmap ring (rounded up to a power of 2, gs_mask + 1),
+ * gs_pkts counts the mbufs received on the cpu, for the mitigation,
+ * and gs_drops those dropped because the queue was full.
+ */
+struct nm_generic_stage {
+	volatile u_int	gs_tail;	/* written by the producer */
+	u_int		gs_mask;
+	volatile u_int	gs_pkts;	/* written by the producer */
+	uint64_t	gs_drops;	/* written by the producer */
+	struct mbuf	**gs_q;
+	volatile u_int	gs_head __attribute__((__aligned__(64)));
+					/* written by the consumer */
 } __attribute__((__aligned__(64)));
 
 
@@ -480,6 +626,20 @@ struct netmap_adapter {
 				 */
 #define NAF_HOST_RINGS  64	/* the adapter supports the host rings */
 #define NAF_FORCE_NATIVE 128	/* the adapter is always NATIVE */
+#define NAF_OFFSETS	256	/* the rings use per-slot offsets,
+				 * see NR_OFFSETS and na_headroom
+				 */
+#define NAF_RING_V2	512	/* the rings use layout v2, see
+				 * NETMAP_RING_LAYOUT_V2
+				 */
+#define NAF_SLOT_TS	1024	/* the rings have per-slot timestamps,
+				 * see NR_SLOT_TS
+				 */
+/* the flags that describe the layout of the rings */
+#define NAF_RING_CONFIG	(NAF_OFFSETS | NAF_RING_V2 | NAF_SLOT_TS)
+#define NAF_PIPE_BCAST	2048	/* slave of a broadcast pipe, one rx ring
+				 * per consumer (see netmap_pipe.c)
+				 */
 #define	NAF_BUSY	(1U<<31) /* the adapter is used internally and
 				  * cannot be registered from userspace
 				  */
@@ -493,9 +653,13 @@ struct netmap_adapter {
 	u_int num_tx_desc; /* number of descriptor in each queue */
 	u_int num_rx_desc;
 
+	/* host ring pairs, see netmap_num_host_rings() */
+	u_int num_host_rings;
+
 	/* tx_rings and rx_rings are private but allocated
 	 * as a contiguous chunk of memory. Each array has
-	 * N+1 entries, for the adapter queues and for the host queue.
+	 * N+H entries, for the adapter queues and for the H
+	 * host queues.
 	 */
 	struct netmap_kring *tx_rings; /* array of TX rings. */
 	struct netmap_kring *rx_rings; /* array of RX rings. */
@@ -614,6 +778,25 @@ struct netmap_adapter {
 	uint32_t na_lut_objtotal;	/* max buffer index */
 	uint32_t na_lut_objsize;	/* buffer size */
 
+	/* initial offset of the slots when NAF_OFFSETS is set */
+	u_int na_headroom;
+
+	/* descriptors asleep in netmap_poll() after busy-polling,
+	 * when non zero netmap_notify() timestamps the krings.
+	 * Updated with refcount_acquire()/refcount_release(), raised
+	 * before np_busy_sleeping is set and dropped after it is
+	 * cleared, so it never underflows.
+	 */
+	volatile u_int na_busy_sleepers;
+
+	/* accounting for the allocator statistics (NIOCMEMINFO).
+	 * Adapters with at least one netmap_if are linked in a
+	 * per-allocator list, protected by the allocator lock.
+	 */
+	struct netmap_adapter *na_mem_next;
+	u_int na_mem_users;		/* netmap_if using this adapter */
+	u_int na_extra_bufs;		/* extra buffers outstanding */
+
 	/* additional information attached to this adapter
 	 * by other netmap subsystems. Currently used by
 	 * bwrap and LINUX/v1000.
@@ -622,9 +805,9 @@ struct netmap_adapter {
 
 #ifdef WITH_PIPES
 	/* array of pipes that have this adapter as a parent */
-	struct netmap_pipe_adapter **na_pipes;
-	int na_next_pipe;	/* next free slot in the array */
-	int na_max_pipes;	/* size of the array */
+	struct netmap_pipe_adapter **na_pipes;	/* indexed by pipe id */
+	u_int na_num_pipes;	/* pipes in the array */
+	u_int na_max_pipes;	/* size of the array, grows on demand */
 #endif /* WITH_PIPES */
 
 	char name[64];
@@ -673,15 +856,35 @@ struct netmap_hw_adapter {	/* physical device */
 	const struct ethtool_ops*   save_ethtool;
 
 	int (*nm_hw_register)(struct netmap_adapter *, int onoff);
+#ifdef NETMAP_LINUX_HAVE_GRO_CELLS
+	struct gro_cells nm_gro;	/* GRO for the packets sent up */
+	int nm_gro_on;
+#endif /* HAVE_GRO_CELLS */
 };
 
 #ifdef WITH_GENERIC
-/* Mitigation support. */
+/*
+ * Mitigation support. The delay between two notifications of an
+ * rx ring adapts to the traffic within [mit_min, mit_max], see
+ * generic_mit_update(). The packets are counted per cpu in the
+ * staging queues (gs_pkts). The state below mit_busy (but
+ * mit_batch, written by the rxsync) is only written by the holder
+ * of mit_busy, so the rx handlers of several cpus, the timer and
+ * NIOCSETMIT do not race on it.
+ */
 struct nm_generic_mit {
 	struct hrtimer mit_timer;
 	int mit_pending;
 	int mit_ring_idx;  /* index of the ring being mitigated */
 	struct netmap_adapter *mit_na;  /* backpointer */
+	NM_ATOMIC_T mit_busy;	/* owner of the state below */
+	volatile u_int mit_delay; /* current delay in ns, 0: no mitigation */
+	u_int mit_min;		/* bounds of mit_delay, in ns */
+	u_int mit_max;
+	u_int mit_pkts;		/* sum of the gs_pkts at mit_start */
+	uint64_t mit_start;	/* start of the rate measurement */
+	u_int mit_gap;		/* smoothed ns between two packets */
+	u_int mit_batch;	/* smoothed packets per rxsync, scaled */
 };
 
 struct netmap_generic_adapter {	/* emulated device */
@@ -699,22 +902,40 @@ struct netmap_generic_adapter {	/* emulated device */
 	void (*save_if_input)(struct ifnet *, struct mbuf *);
 
 	struct nm_generic_mit *mit;
+	/* next registered adapter, for the generic_mit_stats */
+	struct netmap_generic_adapter *mit_next;
 #ifdef linux
         netdev_tx_t (*save_start_xmit)(struct mbuf *, struct ifnet *);
 #endif
 };
 #endif  /* WITH_GENERIC */
 
+/*
+ * Number of host krings on each side. Hw ports get
+ * dev.netmap.host_rings pairs (at most NM_MAX_HOST_RINGS) when
+ * the krings are created; all the other adapters have one,
+ * possibly fake, pair.
+ */
+#define NM_MAX_HOST_RINGS	64
+
+static __inline u_int
+netmap_num_host_rings(struct netmap_adapter *na)
+{
+	return na->num_host_rings ? na->num_host_rings : 1;
+}
+
 static __inline int
 netmap_real_tx_rings(struct netmap_adapter *na)
 {
-	return na->num_tx_rings + !!(na->na_flags & NAF_HOST_RINGS);
+	return na->num_tx_rings + ((na->na_flags & NAF_HOST_RINGS) ?
+		netmap_num_host_rings(na) : 0);
 }
 
 static __inline int
 netmap_real_rx_rings(struct netmap_adapter *na)
 {
-	return na->num_rx_rings + !!(na->na_flags & NAF_HOST_RINGS);
+	return na->num_rx_rings + ((na->na_flags & NAF_HOST_RINGS) ?
+		netmap_num_host_rings(na) : 0);
 }
 
 #ifdef WITH_VALE
@@ -790,8 +1011,6 @@ int netmap_bwrap_attach(const char *name, struct netmap_adapter *);
 
 #ifdef WITH_PIPES
 
-#define NM_MAXPIPES 	64	/* max number of pipes per adapter */
-
 struct netmap_pipe_adapter {
 	struct netmap_adapter up;
 
@@ -802,7 +1021,8 @@ struct netmap_pipe_adapter {
 	struct netmap_pipe_adapter *peer; /* the other end of the pipe */
 	int peer_ref;		/* 1 iff we are holding a ref to the peer */
 
-	u_int parent_slot; /* index in the parent pipe array */
+	u_int bcast;	/* max consumers of a broadcast pipe, 0 if none */
+	uint32_t bc_busy; /* rx rings of the slave bound to a consumer */
 };
 
 #endif /* WITH_PIPES */
@@ -978,6 +1198,40 @@ uint32_t nm_txsync_prologue(struct netmap_kring *);
 uint32_t nm_rxsync_prologue(struct netmap_kring *);
 
 
+/*
+ * Access to the kernel-written fields of the netmap_ring,
+ * whose position depends on the ring layout (v1 or v2).
+ * The layout is taken from the adapter, not from the
+ * shared ring, which userspace can overwrite.
+ */
+static inline int
+nm_ring_v2(struct netmap_kring *kring)
+{
+	return (kring->na->na_flags & NAF_RING_V2) != 0;
+}
+
+static inline uint32_t
+nm_ring_tail(struct netmap_kring *kring)
+{
+	return nm_ring_v2(kring) ? kring->ring->tail_v2 : kring->ring->tail;
+}
+
+static inline void
+nm_ring_set_tail(struct netmap_kring *kring, uint32_t tail)
+{
+	if (nm_ring_v2(kring))
+		kring->ring->tail_v2 = tail;
+	else
+		kring->ring->tail = tail;
+}
+
+static inline struct timeval *
+nm_ring_ts(struct netmap_kring *kring)
+{
+	return nm_ring_v2(kring) ? &kring->ring->ts_v2 : &kring->ring->ts;
+}
+
+
 /*
  * update kring and ring at the end of txsync.
  */
@@ -985,7 +1239,8 @@ static inline void
 nm_txsync_finalize(struct netmap_kring *kring)
 {
 	/* update ring tail to what the kernel knows */
-	kring->ring->tail = kring->rtail = kring->nr_hwtail;
+	kring->rtail = kring->nr_hwtail;
+	nm_ring_set_tail(kring, kring->rtail);
 
 	/* note, head/rhead/hwcur might be behind cur/rcur
 	 * if no carrier
@@ -996,6 +1251,63 @@ nm_txsync_finalize(struct netmap_kring *kring)
 }
 
 
+/*
+ * Per-slot timestamps (NR_SLOT_TS): nm_slot_ts() stamps slot i
+ * of the kring, nm_slot_ts_range() the slots in [i, j).
+ * krings with NKR_SLOT_TS_SELF (set by the adapter or driver in
+ * krings_create) are stamped by the adapter when packets arrive,
+ * reading the clock once per batch; for the others the new slots
+ * are stamped at the end of rxsync.
+ */
+static inline void
+nm_slot_ts(struct netmap_kring *kring, u_int i, uint64_t ns)
+{
+	if (kring->nkr_ts)
+		kring->nkr_ts[i] = ns;
+}
+
+static inline void
+nm_slot_ts_range(struct netmap_kring *kring, u_int i, u_int j, uint64_t ns)
+{
+	u_int const lim = kring->nkr_num_slots - 1;
+
+	for (; i != j; i = nm_next(i, lim))
+		kring->nkr_ts[i] = ns;
+}
+
+/*
+ * Notification coalescing (NR_EVENT_IDX): called by the adapters
+ * that fill an rx kring (pipes, VALE, monitors) after publishing
+ * the new nr_hwtail, returns 1 if the kring must be notified.
+ * Without NR_EVENT_IDX in the ring flags this is always the case,
+ * otherwise only when nr_hwtail has moved past ring->event_idx
+ * since the previous call. The mb() pairs with the update of
+ * event_idx in the consumer, which then checks the ring again.
+ * Concurrent callers can only see a wider range, hence notify
+ * more often, never less.
+ */
+static inline int
+nm_kring_need_event(struct netmap_kring *kring)
+{
+	u_int const n = kring->nkr_num_slots;
+	u_int new = kring->nr_hwtail, old = kring->nkr_event_tail;
+	u_int event;
+
+	kring->nkr_event_tail = new;
+	/* the ring is hidden (NULL) on an unregistered pipe end */
+	if (kring->ring == NULL || !(kring->ring->flags & NR_EVENT_IDX))
+		return 1;
+#ifdef WITH_KTHREAD
+	if (kring->nkr_kthread != NULL)
+		return 1; /* the kthread must not miss new slots */
+#endif /* WITH_KTHREAD */
+	mb();
+	event = kring->ring->event_idx;
+	if (unlikely(event >= n))
+		return 1;
+	return (event + n - old) % n < (new + n - old) % n;
+}
+
 /*
  * update kring and ring at the end of rxsync
  */
@@ -1006,7 +1318,12 @@ nm_rxsync_finalize(struct netmap_kring *kring)
 	//struct netmap_ring *ring = kring->ring;
 	ND("head %d cur %d tail %d -> %d", ring->head, ring->cur, ring->tail,
 		kring->nr_hwtail);
-	kring->ring->tail = kring->rtail = kring->nr_hwtail;
+	if (kring->nkr_ts && kring->rtail != kring->nr_hwtail &&
+	    !(kring->nr_kflags & NKR_SLOT_TS_SELF))
+		nm_slot_ts_range(kring, kring->rtail, kring->nr_hwtail,
+			nm_realtime_ns());
+	kring->rtail = kring->nr_hwtail;
+	nm_ring_set_tail(kring, kring->rtail);
 	/* make a copy of the state for next round */
 	kring->rhead = kring->ring->head;
 	kring->rcur = kring->ring->cur;
@@ -1066,7 +1383,7 @@ int netmap_krings_create(struct netmap_adapter *na, u_int tailroom);
  * been created using netmap_krings_create
  */
 void netmap_krings_delete(struct netmap_adapter *na);
-int netmap_rxsync_from_host(struct netmap_adapter *na, struct thread *td, void *pwait);
+int netmap_rxsync_from_host(struct netmap_kring *kring, struct thread *td, void *pwait);
 
 
 /* set the stopped/enabled status of ring
@@ -1082,7 +1399,7 @@ void netmap_set_all_rings(struct netmap_adapter *, int stopped);
 void netmap_disable_all_rings(struct ifnet *);
 void netmap_enable_all_rings(struct ifnet *);
 
-int netmap_rxsync_from_host(struct netmap_adapter *na, struct thread *td, void *pwait);
+int netmap_rxsync_from_host(struct netmap_kring *kring, struct thread *td, void *pwait);
 
 int
 netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
@@ -1141,12 +1458,21 @@ int netmap_bdg_config(struct nmreq *nmr);
 #endif /* !WITH_VALE */
 
 #ifdef WITH_PIPES
-/* max number of pipes per device */
-#define NM_MAXPIPES	64	/* XXX how many? */
-/* in case of no error, returns the actual number of pipes in nmr->nr_arg1 */
+/* max number of pipes per device, the pipe id is in nr_ringid */
+#define NM_MAXPIPES	(NETMAP_RING_MASK + 1)
+/* in case of no error, returns the size of the pipe array in nmr->nr_arg1 */
 int netmap_pipe_alloc(struct netmap_adapter *, struct nmreq *nmr);
 void netmap_pipe_dealloc(struct netmap_adapter *);
 int netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na, int create);
+/* pipe load balancer (NR_PIPE_LB), see netmap_pipe.c */
+int netmap_pipe_lb_enable(struct netmap_priv_d *priv, u_int npipes, int rr);
+void netmap_pipe_lb_disable(struct netmap_priv_d *priv);
+int netmap_pipe_lb_print_stats(char *buf, int len);
+/* broadcast pipes (NR_PIPE_BCAST), see netmap_pipe.c */
+#define NM_PIPE_BCAST_MAX	32	/* consumers, bits in bc_busy */
+u_int netmap_pipe_bcast_ring(struct netmap_adapter *na);
+int netmap_pipe_bcast_attach(struct netmap_priv_d *priv);
+void netmap_pipe_bcast_detach(struct netmap_priv_d *priv);
 #else /* !WITH_PIPES */
 #define NM_MAXPIPES	0
 #define netmap_pipe_alloc(_1, _2) 	0
@@ -1155,15 +1481,67 @@ int netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na, int create
 	({ int role__ = (nmr)->nr_flags & NR_REG_MASK; \
 	   (role__ == NR_REG_PIPE_MASTER || 	       \
 	    role__ == NR_REG_PIPE_SLAVE) ? EOPNOTSUPP : 0; })
+#define netmap_pipe_lb_enable(priv, _2, _3)	EOPNOTSUPP
+#define netmap_pipe_lb_disable(priv)
+#define netmap_pipe_bcast_ring(na)	0
+#define netmap_pipe_bcast_attach(priv)	0
+#define netmap_pipe_bcast_detach(priv)
 #endif
 
 #ifdef WITH_MONITOR
 int netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create);
+int netmap_monitor_set_filter(struct netmap_priv_d *, struct nm_monf_req *);
+/*
+ * OS-specific: classic BPF programs of the monitors (NIOCSETMONF).
+ * nm_bpf_create() validates the len instructions at insns (in kernel
+ * memory) and returns a private, possibly JIT-compiled copy, or NULL
+ * if the program is invalid. nm_bpf_run() returns the number of bytes
+ * of the packet to keep, 0 to drop it.
+ */
+struct nm_bpf;
+struct nm_bpf *nm_bpf_create(const void *insns, u_int len);
+u_int nm_bpf_run(struct nm_bpf *, const void *pkt, u_int len);
+void nm_bpf_destroy(struct nm_bpf *);
+#define NM_BPF_MAXINSNS	4096
 #else
 #define netmap_get_monitor_na(nmr, _2, _3) \
 	((nmr)->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX) ? EOPNOTSUPP : 0)
+#define netmap_monitor_set_filter(priv, _2)	EOPNOTSUPP
 #endif
 
+#ifdef WITH_KTHREAD
+/*
+ * Sync kthreads (NR_KTHREAD), see netmap_kthread.c.
+ * The nm_kthread_*() functions are the OS-specific part.
+ */
+int netmap_kthread_enable(struct netmap_priv_d *priv);
+void netmap_kthread_disable(struct netmap_priv_d *priv);
+void netmap_kthread_wakeup(struct netmap_priv_d *priv);
+void netmap_kthread_notify(struct netmap_kring *kring);
+
+struct nm_kthread;
+struct nm_kthread *nm_kthread_create(void (*fn)(void *), void *arg,
+	int cpu, const char *name);
+void nm_kthread_stop(struct nm_kthread *);
+int nm_kthread_should_stop(struct nm_kthread *);
+void nm_kthread_sleep(struct nm_kthread *, u_int timeout_us);
+void nm_kthread_wakeup(struct nm_kthread *);
+#else
+#define netmap_kthread_enable(priv)	EOPNOTSUPP
+#define netmap_kthread_disable(priv)
+#define netmap_kthread_wakeup(priv)
+#define netmap_kthread_notify(kring)
+#endif /* WITH_KTHREAD */
+
+/*
+ * OS-specific: attach the eventfd fd to the kring (NIOCSETEVFD),
+ * detach it, signal it. nm_evfd_signal() can run concurrently
+ * with nm_evfd_detach(), which must wait for it.
+ */
+int nm_evfd_attach(struct netmap_kring *kring, int fd);
+void nm_evfd_detach(struct netmap_kring *kring);
+void nm_evfd_signal(struct netmap_kring *kring);
+
 #ifdef CONFIG_NET_NS
 struct net *netmap_bns_get(void);
 void netmap_bns_put(struct net *);
@@ -1184,6 +1562,15 @@ void netmap_dtor(void *data);
 int netmap_dtor_locked(struct netmap_priv_d *priv);
 
 int netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data, int fflag, struct thread *td);
+int netmap_poll_print_stats(char *buf, int len);
+/*
+ * OS-specific: find the netmap_priv_d of another netmap file
+ * descriptor of the calling process (used by NIOCSYNCV).
+ * *ref keeps the file referenced until netmap_fd_put_priv().
+ */
+int netmap_fd_get_priv(struct thread *td, int fd,
+	struct netmap_priv_d **priv, void **ref);
+void netmap_fd_put_priv(struct thread *td, void *ref);
 
 /* netmap_adapter creation/destruction */
 
@@ -1241,8 +1628,10 @@ enum {                                  /* verbose flags */
 
 extern int netmap_txsync_retry;
 extern int netmap_generic_mit;
+extern int netmap_generic_mit_min;
 extern int netmap_generic_ringsize;
 extern int netmap_generic_rings;
+extern int netmap_generic_txzc;
 
 /*
  * NA returns a pointer to the struct netmap adapter from the ifp,
@@ -1472,11 +1861,39 @@ PNMB(struct netmap_adapter *na, struct netmap_slot *slot, uint64_t *pp)
 	return ret;
 }
 
+/*
+ * offset of the packet data in the buffer of a slot, on rings
+ * with per-slot offsets (0 otherwise). Bad offsets are clamped,
+ * so that the buffer always has room for at least 64 bytes.
+ */
+static inline u_int
+nm_get_offset(struct netmap_kring *kring, struct netmap_slot *slot)
+{
+	u_int o = (u_int)(slot->ptr & kring->nkr_offset_mask);
+
+	return unlikely(o > kring->nkr_max_offset) ?
+		kring->nkr_max_offset : o;
+}
+
+static inline void
+nm_set_offset(struct netmap_kring *kring, struct netmap_slot *slot, u_int o)
+{
+	slot->ptr = (slot->ptr & ~kring->nkr_offset_mask) |
+		(o & kring->nkr_offset_mask);
+}
+
+/* NMB plus the slot offset, i.e. the start of the packet data */
+static inline void *
+NMB_O(struct netmap_kring *kring, struct netmap_slot *slot)
+{
+	return (char *)NMB(kring->na, slot) + nm_get_offset(kring, slot);
+}
+
 /* Generic version of NMB, which uses device-specific memory. */
 
 
 
-void netmap_txsync_to_host(struct netmap_adapter *na);
+void netmap_txsync_to_host(struct netmap_kring *kring);
 
 
 /*
@@ -1522,6 +1939,26 @@ struct netmap_priv_d {
 	 */
 	NM_SELINFO_T *np_rxsi, *np_txsi;
 	struct thread	*np_td;		/* kqueue, just debugging */
+
+#ifdef WITH_KTHREAD
+	/* sync kthreads, one per bound ring (NR_KTHREAD) */
+	struct nm_sync_kthread *np_kthreads;
+	u_int		np_num_kthreads;
+#endif /* WITH_KTHREAD */
+
+#ifdef WITH_PIPES
+	/* pipe load balancer of the bound rx rings (NR_PIPE_LB) */
+	struct nm_pipe_lb *np_lb;
+	/* rx kring of a consumer of a broadcast pipe (NR_PIPE_BCAST) */
+	struct netmap_kring *np_bcast;
+#endif /* WITH_PIPES */
+
+	/* busy-poll budget of netmap_poll() in microseconds
+	 * (nr_busy_poll), 0 means use netmap_busy_poll
+	 */
+	u_int		np_busy_poll;
+	NM_ATOMIC_T	np_busy_sleeping; /* asleep after busy-polling */
+	uint64_t	np_sleep_ns;	/* when it went to sleep */
 };
 
 #ifdef WITH_MONITOR
@@ -1530,12 +1967,23 @@ struct netmap_monitor_adapter {
 	struct netmap_adapter up;
 
 	struct netmap_priv_d priv;
-	uint32_t flags;
+	uint32_t flags;		/* NR_MONITOR_TX, _RX, _COPY and _BLOCK */
+	u_int snaplen;		/* bytes copied with NR_MONITOR_COPY */
+	struct nm_bpf *bpf;	/* filter (NIOCSETMONF), or NULL */
+	u_int sample;		/* deliver 1 in sample packets */
 };
 
 #endif /* WITH_MONITOR */
 
 
+#ifdef linux
+/* batched delivery of the host packets, see NM_SEND_UP_BATCH */
+void netmap_linux_gro_init(struct netmap_adapter *);
+void netmap_linux_gro_fini(struct netmap_adapter *);
+void netmap_linux_send_up(struct ifnet *, struct mbq *);
+#endif /* linux */
+
+
 #ifdef WITH_GENERIC
 /*
  * generic netmap emulation for devices that do not have
@@ -1546,7 +1994,16 @@ int generic_netmap_attach(struct ifnet *ifp);
 int netmap_catch_rx(struct netmap_adapter *na, int intercept);
 void generic_rx_handler(struct ifnet *ifp, struct mbuf *m);;
 void netmap_catch_tx(struct netmap_generic_adapter *na, int enable);
-int generic_xmit_frame(struct ifnet *ifp, struct mbuf *m, void *addr, u_int len, u_int ring_nr);
+/* flags of generic_xmit_frame(). With NM_XMIT_APPEND and len 0 it
+ * only sends the packet built in m. It returns EMSGSIZE if the
+ * packet cannot be built whole and must be dropped.
+ */
+#define NM_XMIT_MORE	0x1	/* more packets follow in the batch */
+#define NM_XMIT_FRAG	0x2	/* more fragments follow, do not send yet */
+#define NM_XMIT_APPEND	0x4	/* m holds the previous fragments */
+int generic_xmit_frame(struct ifnet *ifp, struct mbuf *m, void *addr, u_int len, u_int ring_nr, int flags);
+/* brackets the generic_xmit_frame() calls of a txsync */
+void generic_xmit_batch(struct ifnet *ifp, u_int ring_nr, int start);
 int generic_find_num_desc(struct ifnet *ifp, u_int *tx, u_int *rx);
 void generic_find_num_queues(struct ifnet *ifp, u_int *txq, u_int *rxq);
 
@@ -1568,6 +2025,10 @@ void netmap_mitigation_start(struct nm_generic_mit *mit);
 void netmap_mitigation_restart(struct nm_generic_mit *mit);
 int netmap_mitigation_active(struct nm_generic_mit *mit);
 void netmap_mitigation_cleanup(struct nm_generic_mit *mit);
+/* recompute mit_delay, on every notification of the ring */
+void generic_mit_update(struct nm_generic_mit *mit);
+int generic_netmap_set_mit(struct netmap_priv_d *, struct nm_mit_req *);
+int netmap_generic_mit_print_stats(char *buf, int len);
 #endif /* WITH_GENERIC */
 
 
@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2015 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * $FreeBSD$
+ *
+ * Sync kthreads
+ *
+ * A file descriptor registered with NR_KTHREAD gets a kernel thread
+ * for each of the rings it is bound to. The thread watches head and
+ * cur in the netmap_ring and runs the txsync/rxsync of the kring by
+ * itself, publishing the new tail as usual. The application can
+ * then send and receive without any system call.
+ *
+ * The threads spin for netmap_kthread_spin rounds without finding
+ * anything to do, then set NR_KTHREAD_SLEEPING in ring->kflags and
+ * go to sleep. They are woken up by the notifications on the kring
+ * (e.g. new packets on an rx ring), by a NIOCTXSYNC/NIOCRXSYNC or
+ * poll() on the file descriptor, or after netmap_kthread_sleep_us.
+ * Userspace only needs the system call when it sees the flag set
+ * after updating the ring.
+ *
+ * While the threads are running, NIOCTXSYNC and NIOCRXSYNC only wake
+ * them up. The creation, CPU binding and sleep/wakeup of the threads
+ * are OS-specific, see the nm_kthread_*() functions.
+ */
+
+
+#if defined(__FreeBSD__)
+#include <sys/cdefs.h> /* prerequisite */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/param.h>	/* defines used in kernel.h */
+#include <sys/kernel.h>	/* types used in module initialization */
+#include <sys/malloc.h>
+#include <sys/poll.h>
+#include <sys/proc.h>	/* maybe_yield() */
+#include <sys/lock.h>
+#include <sys/rwlock.h>
+#include <sys/rmlock.h>
+#include <sys/selinfo.h>
+#include <sys/sysctl.h>
+#include <sys/socket.h> /* sockaddrs */
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>	/* bus_dmamap_* */
+#include <sys/refcount.h>
+
+
+#elif defined(linux)
+
+#include "bsd_glue.h"
+
+#elif defined(__APPLE__)
+
+#warning OSX support is only partial
+#include "osx_glue.h"
+
+#else
+
+#error	Unsupported platform
+
+#endif /* unsupported */
+
+/*
+ * common headers
+ */
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+#include <dev/netmap/netmap_mem2.h>
+
+#ifdef WITH_KTHREAD
+
+int netmap_kthread_cpu = -1;		/* first cpu, -1 means unbound */
+int netmap_kthread_spin = 10000;	/* idle rounds before sleeping */
+int netmap_kthread_sleep_us = 1000;	/* max sleep time */
+SYSCTL_DECL(_dev_netmap);
+SYSCTL_INT(_dev_netmap, OID_AUTO, kthread_cpu, CTLFLAG_RW,
+	&netmap_kthread_cpu, 0, "first CPU for the sync kthreads");
+SYSCTL_INT(_dev_netmap, OID_AUTO, kthread_spin, CTLFLAG_RW,
+	&netmap_kthread_spin, 0, "idle rounds before a sync kthread sleeps");
+SYSCTL_INT(_dev_netmap, OID_AUTO, kthread_sleep_us, CTLFLAG_RW,
+	&netmap_kthread_sleep_us, 0, "max sleep time of a sync kthread");
+
+struct nm_sync_kthread {
+	struct netmap_kring *kring;
+	struct nm_kthread *thread;
+	int tx;
+};
+
+/*
+ * netmap_kthread_notify() runs from the notify callbacks, possibly
+ * in interrupt context, concurrently with netmap_kthread_disable().
+ * kring->nkr_kthread is published with RCU on linux, and read under
+ * a read-mostly lock on FreeBSD. Disable clears the pointers and
+ * waits for the readers before it stops the threads.
+ */
+#ifdef linux
+#define NM_KT_TRACKER(t)
+#define NM_KT_RLOCK(t)		rcu_read_lock()
+#define NM_KT_RUNLOCK(t)	rcu_read_unlock()
+#define NM_KT_DEREF(p)		rcu_dereference(p)
+#define NM_KT_ASSIGN(p, v)	rcu_assign_pointer(p, v)
+#define NM_KT_SYNC()		synchronize_rcu()
+#else /* !linux */
+static struct rmlock netmap_kthread_rml;
+RM_SYSINIT(netmap_kthread_rml, &netmap_kthread_rml, "nm_kthread");
+#define NM_KT_TRACKER(t)	struct rm_priotracker t
+#define NM_KT_RLOCK(t)		rm_rlock(&netmap_kthread_rml, &(t))
+#define NM_KT_RUNLOCK(t)	rm_runlock(&netmap_kthread_rml, &(t))
+#define NM_KT_DEREF(p)		(p)
+#define NM_KT_ASSIGN(p, v)	do { wmb(); (p) = (v); } while (0)
+#define NM_KT_SYNC()		do {				\
+	rm_wlock(&netmap_kthread_rml);				\
+	rm_wunlock(&netmap_kthread_rml);			\
+} while (0)
+#endif /* !linux */
+
+/*
+ * Run the sync of the kring if userspace has moved head or there
+ * are pending operations. Returns nonzero if the kring changed.
+ */
+static int
+netmap_kthread_sync(struct netmap_kring *kring, int tx)
+{
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int rhead = kring->rhead, rtail = kring->rtail;
+
+	/* nothing to send and nothing to reclaim */
+	if (tx && kring->ring->head == rhead &&
+	    kring->nr_hwtail == nm_prev(kring->nr_hwcur, lim))
+		return 0;
+	if (nm_kr_tryget(kring))
+		return 0;
+	if (tx) {
+		if (nm_txsync_prologue(kring) >= kring->nkr_num_slots)
+			netmap_ring_reinit(kring);
+		else
+			kring->nm_sync(kring, NAF_FORCE_RECLAIM);
+	} else {
+		kring->nm_sync(kring, NAF_FORCE_READ);
+	}
+	nm_kr_put(kring);
+	if (kring->rhead == rhead && kring->rtail == rtail)
+		return 0;
+	if (!tx)
+		microtime(nm_ring_ts(kring));
+	return 1;
+}
+
+static void
+netmap_kthread_body(void *arg)
+{
+	struct nm_sync_kthread *kt = arg;
+	struct netmap_kring *kring = kt->kring;
+	struct netmap_ring *ring = kring->ring;
+	int idle = 0;
+
+	while (!nm_kthread_should_stop(kt->thread)) {
+		if (netmap_kthread_sync(kring, kt->tx)) {
+			ring->kflags &= ~NR_KTHREAD_SLEEPING;
+			/* wake up the users of poll() */
+			OS_selwakeup(&kring->si, PI_NET);
+			idle = 0;
+			continue;
+		}
+		if (idle++ < netmap_kthread_spin) {
+			maybe_yield();
+			continue;
+		}
+		if (!(ring->kflags & NR_KTHREAD_SLEEPING)) {
+			/* announce the sleep and check the ring once
+			 * more, in case userspace updated it before
+			 * seeing the flag
+			 */
+			ring->kflags |= NR_KTHREAD_SLEEPING;
+			mb();
+			continue;
+		}
+		nm_kthread_sleep(kt->thread, netmap_kthread_sleep_us);
+		ring->kflags &= ~NR_KTHREAD_SLEEPING;
+		idle = 0;
+	}
+	ring->kflags &= ~NR_KTHREAD_SLEEPING;
+}
+
+/*
+ * start the kthreads for all the rings bound to priv.
+ * Call with NMG_LOCK held, after netmap_do_regif().
+ */
+int
+netmap_kthread_enable(struct netmap_priv_d *priv)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct nm_sync_kthread *kts;
+	u_int i, n;
+	int cpu = netmap_kthread_cpu, error = 0;
+
+	NMG_LOCK_ASSERT();
+	n = (priv->np_txqlast - priv->np_txqfirst) +
+		(priv->np_rxqlast - priv->np_rxqfirst);
+	if (n == 0)
+		return EINVAL;
+	kts = malloc(n * sizeof(*kts), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (kts == NULL)
+		return ENOMEM;
+	n = 0;
+	for (i = priv->np_txqfirst; i < priv->np_txqlast; i++, n++) {
+		kts[n].kring = &na->tx_rings[i];
+		kts[n].tx = 1;
+	}
+	for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++, n++)
+		kts[n].kring = &na->rx_rings[i];
+
+	priv->np_kthreads = kts;
+	priv->np_num_kthreads = 0;
+	for (i = 0; i < n; i++) {
+		struct netmap_kring *kring = kts[i].kring;
+
+		if (kring->nkr_kthread != NULL) {
+			D("%s already has a sync kthread", kring->name);
+			error = EBUSY;
+			break;
+		}
+		kts[i].thread = nm_kthread_create(netmap_kthread_body,
+			&kts[i], cpu, kring->name);
+		if (kts[i].thread == NULL) {
+			error = ENOMEM;
+			break;
+		}
+		/* visible to the notify callbacks from now on */
+		NM_KT_ASSIGN(kring->nkr_kthread, &kts[i]);
+		priv->np_num_kthreads++;
+		if (cpu >= 0)
+			cpu++;
+	}
+	if (error)
+		netmap_kthread_disable(priv);
+	return error;
+}
+
+/* stop the kthreads of priv. Call with NMG_LOCK held. */
+void
+netmap_kthread_disable(struct netmap_priv_d *priv)
+{
+	struct nm_sync_kthread *kts = priv->np_kthreads;
+	u_int i;
+
+	NMG_LOCK_ASSERT();
+	if (kts == NULL)
+		return;
+	for (i = 0; i < priv->np_num_kthreads; i++)
+		NM_KT_ASSIGN(kts[i].kring->nkr_kthread, NULL);
+	/* wait for the notify callbacks that may still see them */
+	NM_KT_SYNC();
+	for (i = 0; i < priv->np_num_kthreads; i++)
+		nm_kthread_stop(kts[i].thread);
+	free(kts, M_DEVBUF);
+	priv->np_kthreads = NULL;
+	priv->np_num_kthreads = 0;
+}
+
+/* wake up all the kthreads of priv, used by NIOC*SYNC and poll() */
+void
+netmap_kthread_wakeup(struct netmap_priv_d *priv)
+{
+	u_int i;
+
+	for (i = 0; i < priv->np_num_kthreads; i++)
+		nm_kthread_wakeup(priv->np_kthreads[i].thread);
+}
+
+/* wake up the kthread of a kring, from the notify callbacks */
+void
+netmap_kthread_notify(struct netmap_kring *kring)
+{
+	struct nm_sync_kthread *kt;
+	NM_KT_TRACKER(tr);
+
+	NM_KT_RLOCK(tr);
+	kt = NM_KT_DEREF(kring->nkr_kthread);
+	if (kt != NULL)
+		nm_kthread_wakeup(kt->thread);
+	NM_KT_RUNLOCK(tr);
+}
+
+#endif /* WITH_KTHREAD */
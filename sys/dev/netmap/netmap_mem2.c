@@ -82,6 +82,7 @@ struct netmap_obj_pool {
 	u_int numclusters;	/* actual number of clusters */
 
 	u_int objfree;          /* number of free objects. */
+	u_int alloc_fail;	/* failed allocations, for statistics */
 
 	struct lut_entry *lut;  /* virt,phys addresses, objtotal entries */
 	uint32_t *bitmap;       /* one bit per buffer, 1 means free */
@@ -134,6 +135,14 @@ struct netmap_mem_d {
 
 	/* list of all existing allocators, sorted by nm_id */
 	struct netmap_mem_d *prev, *next;
+
+	/* adapters with a netmap_if in this allocator */
+	struct netmap_adapter *nm_ports;
+
+	/* private allocators only: number of adapters with NAF_MEM_OWNER
+	 * using the allocator. It is freed when the last one goes away.
+	 */
+	int nm_owners;
 };
 
 /* accessor functions */
@@ -330,6 +339,36 @@ nm_mem_assign_id(struct netmap_mem_d *nmd)
 	return error;
 }
 
+/*
+ * Find an existing allocator given its id, so that a new
+ * adapter can share it. For private allocators, the caller
+ * becomes one of the owners and must eventually release it
+ * with netmap_mem_private_delete().
+ * Returns NULL if there is no such allocator.
+ * call with NMG_LOCK held
+ */
+struct netmap_mem_d *
+netmap_mem_find(nm_memid_t id)
+{
+	struct netmap_mem_d *nmd = NULL, *scan = &nm_mem;
+
+	NMG_LOCK_ASSERT();
+
+	NMA_LOCK(&nm_mem);
+	do {
+		if (scan->nm_id == id) {
+			nmd = scan;
+			break;
+		}
+		scan = scan->next;
+	} while (scan != &nm_mem);
+	NMA_UNLOCK(&nm_mem);
+
+	if (nmd != NULL && (nmd->flags & NETMAP_MEM_PRIVATE))
+		nmd->nm_owners++;
+	return nmd;
+}
+
 static void
 nm_mem_release_id(struct netmap_mem_d *nmd)
 {
@@ -432,6 +471,159 @@ out:
 	return error;
 }
 
+/* count the rings of an adapter and the buffers attached to them.
+ * call with NMA_LOCK held
+ */
+static void
+netmap_mem_port_usage(struct netmap_adapter *na, u_int *rings, u_int *bufs)
+{
+	struct netmap_kring *kring;
+
+	*rings = *bufs = 0;
+	if (na->tx_rings == NULL)
+		return;
+	for (kring = na->tx_rings; kring != na->tailroom; kring++) {
+		if (kring->ring == NULL)
+			continue;
+		(*rings)++;
+		*bufs += kring->nkr_num_slots;
+	}
+}
+
+/*
+ * Fill *nmi with the statistics of the allocator with the
+ * smallest id >= nmi->nmi_id, and of its port nmi->nmi_port.
+ * Returns ENOENT if there is no such allocator.
+ * call with NMG_LOCK held, so allocators cannot go away.
+ */
+int
+netmap_mem_get_stats(struct nm_mem_info *nmi)
+{
+	struct netmap_mem_d *nmd = &nm_mem, *scan;
+	struct netmap_adapter *na;
+	u_int i;
+
+	NMG_LOCK_ASSERT();
+
+	/* find the allocator. The list is sorted by nm_id */
+	NMA_LOCK(&nm_mem);
+	scan = &nm_mem;
+	nmd = NULL;
+	do {
+		if (scan->nm_id >= nmi->nmi_id &&
+		    (nmd == NULL || scan->nm_id < nmd->nm_id))
+			nmd = scan;
+		scan = scan->next;
+	} while (scan != &nm_mem);
+	NMA_UNLOCK(&nm_mem);
+	if (nmd == NULL)
+		return ENOENT;
+
+	NMA_LOCK(nmd);
+	nmi->nmi_id = nmd->nm_id;
+	nmi->nmi_flags = nmd->flags;
+	nmi->nmi_memsize = nmd->nm_totalsize;
+	nmi->nmi_refcount = nmd->refcount;
+	nmi->nmi_num_ports = 0;
+	nmi->nmi_extra_bufs = 0;
+	for (i = 0; i < NETMAP_POOLS_NR; i++) {
+		struct netmap_obj_pool *p = &nmd->pools[i];
+
+		nmi->nmi_pools[i].npi_total = p->objtotal;
+		nmi->nmi_pools[i].npi_free = p->objfree;
+		nmi->nmi_pools[i].npi_size = p->_objsize;
+		nmi->nmi_pools[i].npi_fail = p->alloc_fail;
+	}
+	bzero(nmi->nmi_port_name, sizeof(nmi->nmi_port_name));
+	nmi->nmi_port_fds = nmi->nmi_port_rings = 0;
+	nmi->nmi_port_bufs = nmi->nmi_port_extra_bufs = 0;
+	for (na = nmd->nm_ports; na; na = na->na_mem_next) {
+		if (nmi->nmi_num_ports == nmi->nmi_port) {
+			strncpy(nmi->nmi_port_name, na->name,
+				sizeof(nmi->nmi_port_name) - 1);
+			nmi->nmi_port_fds = na->na_mem_users;
+			netmap_mem_port_usage(na, &nmi->nmi_port_rings,
+				&nmi->nmi_port_bufs);
+			nmi->nmi_port_extra_bufs = na->na_extra_bufs;
+		}
+		nmi->nmi_num_ports++;
+		nmi->nmi_extra_bufs += na->na_extra_bufs;
+	}
+	NMA_UNLOCK(nmd);
+
+	return 0;
+}
+
+/*
+ * Print the statistics of all allocators in buf, for the
+ * mem_stats sysctl (FreeBSD) or module parameter (linux).
+ * Returns the number of bytes written, excluding the final NUL.
+ */
+int
+netmap_mem_print_stats(char *buf, int len)
+{
+	static const char *pool_names[NETMAP_POOLS_NR] = { "if", "ring", "buf" };
+	struct nm_mem_info nmi;
+	int n = 0, i;
+
+	NMG_LOCK();
+	bzero(&nmi, sizeof(nmi));
+	while (n < len && netmap_mem_get_stats(&nmi) == 0) {
+		u_int port, nports = nmi.nmi_num_ports;
+
+		n += snprintf(buf + n, len - n,
+			"mem %d%s size %u refcount %u ports %u extra_bufs %u\n",
+			nmi.nmi_id,
+			(nmi.nmi_flags & NETMAP_MEM_PRIVATE) ? " private" : "",
+			nmi.nmi_memsize, nmi.nmi_refcount,
+			nports, nmi.nmi_extra_bufs);
+		for (i = 0; i < NETMAP_POOLS_NR && n < len; i++) {
+			struct nm_pool_info *pi = &nmi.nmi_pools[i];
+
+			n += snprintf(buf + n, len - n,
+				"  %-4s total %u free %u size %u fail %u\n",
+				pool_names[i], pi->npi_total, pi->npi_free,
+				pi->npi_size, pi->npi_fail);
+		}
+		for (port = 0; port < nports && n < len; port++) {
+			nmi.nmi_port = port;
+			if (netmap_mem_get_stats(&nmi))
+				break;
+			n += snprintf(buf + n, len - n,
+				"  port %s fds %u rings %u bufs %u extra_bufs %u\n",
+				nmi.nmi_port_name, nmi.nmi_port_fds,
+				nmi.nmi_port_rings, nmi.nmi_port_bufs,
+				nmi.nmi_port_extra_bufs);
+		}
+		if (nmi.nmi_id == (nm_memid_t)-1)
+			break;
+		nmi.nmi_id++;
+		nmi.nmi_port = 0;
+	}
+	NMG_UNLOCK();
+	if (n >= len)
+		n = len - 1; /* truncated */
+	return n;
+}
+
+#ifdef __FreeBSD__
+static int
+netmap_mem_stats_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	char *buf;
+	int len = 16384, error;
+
+	buf = malloc(len, M_DEVBUF, M_WAITOK | M_ZERO);
+	netmap_mem_print_stats(buf, len);
+	error = sysctl_handle_string(oidp, buf, len, req);
+	free(buf, M_DEVBUF);
+	return error;
+}
+SYSCTL_PROC(_dev_netmap, OID_AUTO, mem_stats,
+    CTLTYPE_STRING | CTLFLAG_RD, 0, 0, netmap_mem_stats_sysctl, "A",
+    "Statistics of the netmap allocators");
+#endif /* __FreeBSD__ */
+
 /*
  * we store objects by kernel address, need to find the offset
  * within the pool to export the value to userspace.
@@ -499,11 +691,13 @@ netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_
 	if (len > p->_objsize) {
 		D("%s request size %d too large", p->name, len);
 		// XXX cannot reduce the size
+		p->alloc_fail++;
 		return NULL;
 	}
 
 	if (p->objfree == 0) {
 		D("no more %s objects", p->name);
+		p->alloc_fail++;
 		return NULL;
 	}
 	if (start)
@@ -528,6 +722,8 @@ netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_
 			*index = i * 32 + j;
 	}
 	ND("%s allocator: allocated object @ [%d][%d]: vaddr %p", i, j, vaddr);
+	if (vaddr == NULL)
+		p->alloc_fail++;
 
 	if (start)
 		*start = i;
@@ -605,6 +801,9 @@ netmap_obj_free_va(struct netmap_obj_pool *p, void *vaddr)
 
 /*
  * allocate extra buffers in a linked list.
+ * The new buffers are prepended to the list starting at *head
+ * (0 means an empty list), so the function can be called
+ * again on a list which is already in use.
  * returns the actual number.
  */
 uint32_t
@@ -615,7 +814,6 @@ netmap_extra_alloc(struct netmap_adapter *na, uint32_t *head, uint32_t n)
 
 	NMA_LOCK(nmd);
 
-	*head = 0;	/* default, 'null' index ie empty list */
 	for (i = 0 ; i < n; i++) {
 		uint32_t cur = *head;	/* save current head */
 		uint32_t *p = netmap_buf_malloc(nmd, &pos, head);
@@ -627,32 +825,55 @@ netmap_extra_alloc(struct netmap_adapter *na, uint32_t *head, uint32_t n)
 		RD(5, "allocate buffer %d -> %d", *head, cur);
 		*p = cur; /* link to previous head */
 	}
+	na->na_extra_bufs += i;
 
 	NMA_UNLOCK(nmd);
 
 	return i;
 }
 
-static void
-netmap_extra_free(struct netmap_adapter *na, uint32_t head)
+/*
+ * release at most n buffers from the head of the list at *head,
+ * and leave *head pointing to the remaining ones.
+ * Indexes come from userspace, so we stop at the first invalid one.
+ * Must be called with NMA_LOCK held.
+ * returns the actual number.
+ */
+static uint32_t
+netmap_extra_free_locked(struct netmap_adapter *na, uint32_t *head, uint32_t n)
 {
-        struct lut_entry *lut = na->na_lut;
+	struct lut_entry *lut = na->na_lut;
 	struct netmap_mem_d *nmd = na->nm_mem;
 	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
 	uint32_t i, cur, *buf;
 
-	D("freeing the extra list");
-	for (i = 0; head >=2 && head < p->objtotal; i++) {
-		cur = head;
-		buf = lut[head].vaddr;
-		head = *buf;
+	for (i = 0; i < n && *head >= 2 && *head < p->objtotal; i++) {
+		cur = *head;
+		buf = lut[cur].vaddr;
+		*head = *buf;
 		*buf = 0;
 		if (netmap_obj_free(p, cur))
 			break;
 	}
-	if (head != 0)
-		D("breaking with head %d", head);
-	D("freed %d buffers", i);
+	if (i < n && *head != 0)
+		D("breaking with head %d", *head);
+	na->na_extra_bufs -= i;
+	return i;
+}
+
+/*
+ * runtime version of the above, takes the allocator lock.
+ */
+uint32_t
+netmap_extra_free(struct netmap_adapter *na, uint32_t *head, uint32_t n)
+{
+	struct netmap_mem_d *nmd = na->nm_mem;
+
+	NMA_LOCK(nmd);
+	n = netmap_extra_free_locked(na, head, n);
+	NMA_UNLOCK(nmd);
+
+	return n;
 }
 
 
@@ -1056,6 +1277,12 @@ netmap_mem_private_delete(struct netmap_mem_d *nmd)
 {
 	if (nmd == NULL)
 		return;
+	if (--nmd->nm_owners > 0) {
+		/* still used by other adapters */
+		if (netmap_verbose)
+			D("%p still has %d owners", nmd, nmd->nm_owners);
+		return;
+	}
 	if (netmap_verbose)
 		D("deleting %p", nmd);
 	if (nmd->refcount > 0)
@@ -1118,6 +1345,7 @@ netmap_mem_private_new(const char *name, u_int txr, u_int txd,
 	}
 
 	*d = nm_blueprint;
+	d->nm_owners = 1;
 
 	err = nm_mem_assign_id(d);
 	if (err)
@@ -1140,7 +1368,9 @@ netmap_mem_private_new(const char *name, u_int txr, u_int txd,
 	if (p[NETMAP_IF_POOL].num < v)
 		p[NETMAP_IF_POOL].num = v;
 	maxd = (txd > rxd) ? txd : rxd;
-	v = sizeof(struct netmap_ring) + sizeof(struct netmap_slot) * maxd;
+	/* leave room for the slot timestamps, see NAF_SLOT_TS */
+	v = sizeof(struct netmap_ring) +
+		(sizeof(struct netmap_slot) + sizeof(uint64_t)) * maxd;
 	if (p[NETMAP_RING_POOL].size < v)
 		p[NETMAP_RING_POOL].size = v;
 	/* each pipe endpoint needs two tx rings (1 normal + 1 host, fake)
@@ -1294,6 +1524,7 @@ netmap_free_rings(struct netmap_adapter *na)
 		netmap_free_bufs(na->nm_mem, ring->slot, kring->nkr_num_slots);
 		netmap_ring_free(na->nm_mem, ring);
 		kring->ring = NULL;
+		kring->nkr_ts = NULL;
 	}
 	for (/* cont'd from above */; kring != na->tailroom; kring++) {
 		ring = kring->ring;
@@ -1302,9 +1533,73 @@ netmap_free_rings(struct netmap_adapter *na)
 		netmap_free_bufs(na->nm_mem, ring->slot, kring->nkr_num_slots);
 		netmap_ring_free(na->nm_mem, ring);
 		kring->ring = NULL;
+		kring->nkr_ts = NULL;
 	}
 }
 
+/* call with NMA_LOCK held
+ *
+ * Configure the per-slot offsets of a newly created ring,
+ * see NAF_OFFSETS.
+ */
+static void
+netmap_mem_set_offsets(struct netmap_adapter *na, struct netmap_kring *kring)
+{
+	struct netmap_ring *ring = kring->ring;
+	u_int i, headroom = 0;
+
+	if (na->na_flags & NAF_OFFSETS) {
+		kring->nkr_offset_mask = NETMAP_OFFSET_MASK;
+		kring->nkr_max_offset = netmap_mem_bufsize(na->nm_mem) - 64;
+		headroom = na->na_headroom;
+		if (headroom > kring->nkr_max_offset)
+			headroom = kring->nkr_max_offset;
+		for (i = 0; i < kring->nkr_num_slots; i++)
+			ring->slot[i].ptr = headroom;
+	} else {
+		kring->nkr_offset_mask = 0;
+		kring->nkr_max_offset = 0;
+	}
+	*(uint64_t *)(uintptr_t)&ring->offset_mask = kring->nkr_offset_mask;
+	*(uint32_t *)(uintptr_t)&ring->headroom = headroom;
+}
+
+/*
+ * Size of a ring with ndesc slots. With NAF_SLOT_TS the array
+ * of the slot timestamps follows the slots.
+ */
+static u_int
+netmap_mem_ring_len(struct netmap_adapter *na, u_int ndesc)
+{
+	u_int len = sizeof(struct netmap_ring) +
+		ndesc * sizeof(struct netmap_slot);
+
+	if (na->na_flags & NAF_SLOT_TS)
+		len += ndesc * sizeof(uint64_t);
+	return len;
+}
+
+/* call with NMA_LOCK held
+ *
+ * Configure the slot timestamps of a newly created ring,
+ * see NAF_SLOT_TS.
+ */
+static void
+netmap_mem_set_slot_ts(struct netmap_adapter *na, struct netmap_kring *kring)
+{
+	struct netmap_ring *ring = kring->ring;
+	u_int ts_ofs = 0;
+
+	kring->nkr_ts = NULL;
+	if (na->na_flags & NAF_SLOT_TS) {
+		ts_ofs = sizeof(struct netmap_ring) +
+			kring->nkr_num_slots * sizeof(struct netmap_slot);
+		kring->nkr_ts = (uint64_t *)((char *)ring + ts_ofs);
+		bzero(kring->nkr_ts, kring->nkr_num_slots * sizeof(uint64_t));
+	}
+	*(uint32_t *)(uintptr_t)&ring->ts_ofs = ts_ofs;
+}
+
 /* call with NMA_LOCK held *
  *
  * Allocate netmap rings and buffers for this card
@@ -1329,8 +1624,7 @@ netmap_mem_rings_create(struct netmap_adapter *na)
 			continue; /* already created by somebody else */
 		}
 		ndesc = kring->nkr_num_slots;
-		len = sizeof(struct netmap_ring) +
-			  ndesc * sizeof(struct netmap_slot);
+		len = netmap_mem_ring_len(na, ndesc);
 		ring = netmap_ring_malloc(na->nm_mem, len);
 		if (ring == NULL) {
 			D("Cannot allocate tx_ring");
@@ -1344,10 +1638,10 @@ netmap_mem_rings_create(struct netmap_adapter *na)
 			na->nm_mem->pools[NETMAP_RING_POOL].memtotal) -
 			netmap_ring_offset(na->nm_mem, ring);
 
-		/* copy values from kring */
+		/* copy values from kring, for both ring layouts */
 		ring->head = kring->rhead;
 		ring->cur = kring->rcur;
-		ring->tail = kring->rtail;
+		ring->tail = ring->tail_v2 = kring->rtail;
 		*(uint16_t *)(uintptr_t)&ring->nr_buf_size =
 			netmap_mem_bufsize(na->nm_mem);
 		ND("%s h %d c %d t %d", kring->name,
@@ -1363,6 +1657,8 @@ netmap_mem_rings_create(struct netmap_adapter *na)
 			/* this is a fake tx ring, set all indices to 0 */
 			netmap_mem_set_ring(na->nm_mem, ring->slot, ndesc, 0);
 		}
+		netmap_mem_set_offsets(na, kring);
+		netmap_mem_set_slot_ts(na, kring);
 	}
 
 	/* receive rings */
@@ -1372,8 +1668,7 @@ netmap_mem_rings_create(struct netmap_adapter *na)
 			continue; /* already created by somebody else */
 		}
 		ndesc = kring->nkr_num_slots;
-		len = sizeof(struct netmap_ring) +
-			  ndesc * sizeof(struct netmap_slot);
+		len = netmap_mem_ring_len(na, ndesc);
 		ring = netmap_ring_malloc(na->nm_mem, len);
 		if (ring == NULL) {
 			D("Cannot allocate rx_ring");
@@ -1387,10 +1682,10 @@ netmap_mem_rings_create(struct netmap_adapter *na)
 		        na->nm_mem->pools[NETMAP_RING_POOL].memtotal) -
 			netmap_ring_offset(na->nm_mem, ring);
 
-		/* copy values from kring */
+		/* copy values from kring, for both ring layouts */
 		ring->head = kring->rhead;
 		ring->cur = kring->rcur;
-		ring->tail = kring->rtail;
+		ring->tail = ring->tail_v2 = kring->rtail;
 		*(int *)(uintptr_t)&ring->nr_buf_size =
 			netmap_mem_bufsize(na->nm_mem);
 		ND("%s h %d c %d t %d", kring->name,
@@ -1406,6 +1701,8 @@ netmap_mem_rings_create(struct netmap_adapter *na)
 			/* this is a fake rx ring, set all indices to 1 */
 			netmap_mem_set_ring(na->nm_mem, ring->slot, ndesc, 1);
 		}
+		netmap_mem_set_offsets(na, kring);
+		netmap_mem_set_slot_ts(na, kring);
 	}
 
 	NMA_UNLOCK(na->nm_mem);
@@ -1448,8 +1745,8 @@ netmap_mem_if_new(struct netmap_adapter *na)
 	u_int i, len, ntx, nrx;
 
 	/* account for the (eventually fake) host rings */
-	ntx = na->num_tx_rings + 1;
-	nrx = na->num_rx_rings + 1;
+	ntx = na->num_tx_rings + netmap_num_host_rings(na);
+	nrx = na->num_rx_rings + netmap_num_host_rings(na);
 	/*
 	 * the descriptor is followed inline by an array of offsets
 	 * to the tx and rx rings in the shared memory region.
@@ -1467,7 +1764,15 @@ netmap_mem_if_new(struct netmap_adapter *na)
 	/* initialize base fields -- override const */
 	*(u_int *)(uintptr_t)&nifp->ni_tx_rings = na->num_tx_rings;
 	*(u_int *)(uintptr_t)&nifp->ni_rx_rings = na->num_rx_rings;
+	*(u_int *)(uintptr_t)&nifp->ni_host_rings = netmap_num_host_rings(na);
 	strncpy(nifp->ni_name, na->name, (size_t)IFNAMSIZ);
+	nifp->ni_bufs_head = 0; /* extra buffers list, initially empty */
+
+	/* the first netmap_if links the adapter to the allocator */
+	if (na->na_mem_users++ == 0) {
+		na->na_mem_next = na->nm_mem->nm_ports;
+		na->nm_mem->nm_ports = na;
+	}
 
 	/*
 	 * fill the slots for the rx and tx rings. They contain the offset
@@ -1496,10 +1801,26 @@ netmap_mem_if_delete(struct netmap_adapter *na, struct netmap_if *nifp)
 		/* nothing to do */
 		return;
 	NMA_LOCK(na->nm_mem);
-	if (nifp->ni_bufs_head)
-		netmap_extra_free(na, nifp->ni_bufs_head);
+	if (nifp->ni_bufs_head) {
+		uint32_t n;
+
+		D("freeing the extra list");
+		n = netmap_extra_free_locked(na, &nifp->ni_bufs_head,
+			(uint32_t)-1);
+		D("freed %d buffers", n);
+	}
 	netmap_if_free(na->nm_mem, nifp);
 
+	if (--na->na_mem_users == 0) {
+		struct netmap_adapter **pp = &na->nm_mem->nm_ports;
+
+		while (*pp != NULL && *pp != na)
+			pp = &(*pp)->na_mem_next;
+		if (*pp != NULL)
+			*pp = na->na_mem_next;
+		na->na_mem_next = NULL;
+	}
+
 	NMA_UNLOCK(na->nm_mem);
 }
 
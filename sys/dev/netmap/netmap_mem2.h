@@ -108,7 +108,9 @@
  * netmap_adapter of the corresponding NIC or port. It is the responsibility of
  * the client code to delete the private allocator when the associated
  * netmap_adapter is freed (this is implemented by the NAF_MEM_OWNER flag in
- * netmap.c).  The 'refcount' field counts the number of active users of the
+ * netmap.c). Several adapters may share a private allocator, obtained with
+ * netmap_mem_find(): it is then deleted when the last of them goes away.
+ * The 'refcount' field counts the number of active users of the
  * structure. The global allocator uses this information to prevent/allow
  * reconfiguration. The private allocators release all their memory when there
  * are no active users.  By 'active user' we mean an existing netmap_priv
@@ -130,16 +132,20 @@ int	   netmap_mem_rings_create(struct netmap_adapter *);
 void	   netmap_mem_rings_delete(struct netmap_adapter *);
 void 	   netmap_mem_deref(struct netmap_mem_d *, struct netmap_adapter *);
 int	   netmap_mem_get_info(struct netmap_mem_d *, u_int *size, u_int *memflags, uint16_t *id);
+int	   netmap_mem_get_stats(struct nm_mem_info *);
+int	   netmap_mem_print_stats(char *buf, int len);
 ssize_t    netmap_mem_if_offset(struct netmap_mem_d *, const void *vaddr);
 struct netmap_mem_d* netmap_mem_private_new(const char *name,
 	u_int txr, u_int txd, u_int rxr, u_int rxd, u_int extra_bufs, u_int npipes,
 	int* error);
 void	   netmap_mem_private_delete(struct netmap_mem_d *);
+struct netmap_mem_d *netmap_mem_find(uint16_t id);
 
 #define NETMAP_MEM_PRIVATE	0x2	/* allocator uses private address space */
 #define NETMAP_MEM_IO		0x4	/* the underlying memory is mmapped I/O */
 
 uint32_t netmap_extra_alloc(struct netmap_adapter *, uint32_t *, uint32_t n);
+uint32_t netmap_extra_free(struct netmap_adapter *, uint32_t *, uint32_t n);
 
 
 #endif
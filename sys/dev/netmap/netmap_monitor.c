@@ -52,8 +52,18 @@
  * If the monitor is not able to cope with the stream of frames, excess traffic
  * will be dropped.
  *
- * Each ring can be monitored by at most one monitor. This may change in the
- * future, if we implement monitor chaining.
+ * A zero-copy monitor swaps its buffers with the monitored rings, so it
+ * must be the only monitor of the rings. With NR_MONITOR_COPY the frames
+ * (up to the snaplen) are instead copied into the buffers of the
+ * monitor, with the original length in slot->ptr, and any number of
+ * copy monitors can watch the same ring. The monitors of a kring are
+ * in the kring->monitors array.
+ *
+ * The packets lost because a monitor ring was full, and those cut by
+ * copy monitors, are counted in ring->mon_drops and ring->mon_truncs
+ * of the monitor rx ring. With NR_MONITOR_BLOCK, instead, the tx
+ * rings of the monitored adapter only release the slots that fit in
+ * the monitor, and are notified when the monitor makes room.
  *
  */
 
@@ -105,36 +115,23 @@
 
 #define NM_MONITOR_MAXSLOTS 4096
 
-/* monitor works by replacing the nm_sync callbacks in the monitored rings.
- * The actions to be performed are the same on both tx and rx rings, so we
- * have collected them here
+/* pass the slots [beg, beg + rel_slots) of a monitored kring to one
+ * of its monitors, swapping or copying the buffers. Slots that do not
+ * fit in the monitor ring are dropped, starting from the oldest ones
+ * (the newest ones if the monitor has a filter or samples).
  */
-static int
-netmap_monitor_parent_sync(struct netmap_kring *kring, int flags, u_int* ringptr)
+static void
+netmap_monitor_deliver(struct netmap_monitor_adapter *mna,
+	struct netmap_kring *kring, u_int beg, int rel_slots)
 {
-	struct netmap_monitor_adapter *mna = kring->monitor;
 	struct netmap_kring *mkring = &mna->up.rx_rings[kring->ring_id];
 	struct netmap_ring *ring = kring->ring, *mring = mkring->ring;
-	int error;
-	int rel_slots, free_slots, busy;
-	u_int beg, end, i;
+	int notify;
+	int free_slots, busy;
+	u_int i, snap;
 	u_int lim = kring->nkr_num_slots - 1,
 	      mlim = mkring->nkr_num_slots - 1;
 
-	/* get the relased slots (rel_slots) */
-	beg = *ringptr;
-	error = kring->save_sync(kring, flags);
-	if (error)
-		return error;
-	end = *ringptr;
-	rel_slots = end - beg;
-	if (rel_slots < 0)
-		rel_slots += kring->nkr_num_slots;
-
-	if (!rel_slots) {
-		return 0;
-	}
-
 	/* we need to lock the monitor receive ring, since it
 	 * is the target of bot tx and rx traffic from the monitored
 	 * adapter
@@ -148,22 +145,64 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, int flags, u_int* ringptr
 	free_slots = mlim - busy;
 
 	if (!free_slots) {
+		mring->mon_drops += rel_slots;
 		mtx_unlock(&mkring->q_lock);
-		return 0;
+		return;
 	}
 
 	/* swap min(free_slots, rel_slots) slots */
-	if (free_slots < rel_slots) {
+	if (free_slots < rel_slots && mna->bpf == NULL && mna->sample <= 1) {
+		mring->mon_drops += rel_slots - free_slots;
 		beg += (rel_slots - free_slots);
 		if (beg > lim)
-			beg = 0;
+			beg -= lim + 1;
 		rel_slots = free_slots;
 	}
 
-	for ( ; rel_slots; rel_slots--) {
+	for ( ; rel_slots && free_slots; rel_slots--) {
 		struct netmap_slot *s = &ring->slot[beg];
 		struct netmap_slot *ms = &mring->slot[i];
 		uint32_t tmp;
+		u_int len = s->len, room;
+
+		/* the len of tx slots comes from userspace, never
+		 * look past the end of the buffer
+		 */
+		room = NETMAP_BUF_SIZE(kring->na) - nm_get_offset(kring, s);
+		if (unlikely(len > room))
+			len = room;
+
+		/* filter and sample before touching the buffers */
+		snap = mna->snaplen;
+		if (mna->bpf) {
+			snap = nm_bpf_run(mna->bpf, NMB_O(kring, s), len);
+			if (snap == 0)
+				goto skip;
+		}
+		if (mna->sample > 1) {
+			if (mkring->nkr_mon_skip > 0) {
+				mkring->nkr_mon_skip--;
+				goto skip;
+			}
+			mkring->nkr_mon_skip = mna->sample - 1;
+		}
+
+		if (mna->flags & NR_MONITOR_COPY) {
+			/* keep the original length in ptr */
+			u_int copy_len = len;
+
+			if (copy_len > mna->snaplen)
+				copy_len = mna->snaplen;
+			if (copy_len > snap)
+				copy_len = snap;
+			if (copy_len < s->len)
+				mring->mon_truncs++;
+			memcpy(NMB(&mna->up, ms), NMB_O(kring, s), copy_len);
+			ms->len = copy_len;
+			ms->ptr = s->len;
+			ms->flags = s->flags & NS_MOREFRAG;
+			goto next;
+		}
 
 		tmp = ms->buf_idx;
 		ms->buf_idx = s->buf_idx;
@@ -173,18 +212,106 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, int flags, u_int* ringptr
 		ms->len = s->len;
 		s->len = tmp;
 
-		s->flags |= NS_BUF_CHANGED;
+		if (mkring->nkr_offset_mask) {
+			/* the offset travels with the buffer */
+			uint64_t tptr = ms->ptr;
+			ms->ptr = s->ptr;
+			s->ptr = tptr;
+		}
 
-		beg = nm_next(beg, lim);
+		s->flags |= NS_BUF_CHANGED;
+	next:
 		i = nm_next(i, mlim);
-
+		free_slots--;
+	skip:
+		beg = nm_next(beg, lim);
 	}
+	/* the slots we could not look at */
+	mring->mon_drops += rel_slots;
 	mb();
 	mkring->nr_hwtail = i;
+	notify = nm_kring_need_event(mkring);
 
 	mtx_unlock(&mkring->q_lock);
 	/* notify the new frames to the monitor */
-	mna->up.nm_notify(&mna->up, mkring->ring_id, NR_RX, 0);
+	if (notify)
+		mna->up.nm_notify(&mna->up, mkring->ring_id, NR_RX, 0);
+}
+
+/* the free slots in the smallest of the NR_MONITOR_BLOCK monitors of a
+ * monitored tx kring, or INT_MAX if there are none. The monitors
+ * only make more room concurrently, so the value is conservative.
+ */
+static int
+netmap_monitor_room(struct netmap_kring *kring)
+{
+	int room = INT_MAX;
+	u_int i;
+
+	for (i = 0; i < kring->n_monitors; i++) {
+		struct netmap_monitor_adapter *mna = kring->monitors[i];
+		struct netmap_kring *mkring;
+		int busy;
+
+		if (!(mna->flags & NR_MONITOR_BLOCK))
+			continue;
+		mkring = &mna->up.rx_rings[kring->ring_id];
+		busy = mkring->nr_hwtail - mkring->nr_hwcur;
+		if (busy < 0)
+			busy += mkring->nkr_num_slots;
+		if ((int)mkring->nkr_num_slots - 1 - busy < room)
+			room = mkring->nkr_num_slots - 1 - busy;
+	}
+	return room;
+}
+
+/* monitor works by replacing the nm_sync callbacks in the monitored rings.
+ * The actions to be performed are the same on both tx and rx rings, so we
+ * have collected them here
+ */
+static int
+netmap_monitor_parent_sync(struct netmap_kring *kring, int flags, u_int* ringptr)
+{
+	int error;
+	int rel_slots;
+	u_int beg, end, i;
+
+	/* get the relased slots (rel_slots) */
+	beg = *ringptr;
+	error = kring->save_sync(kring, flags);
+	if (error)
+		return error;
+	end = *ringptr;
+	rel_slots = end - beg;
+	if (rel_slots < 0)
+		rel_slots += kring->nkr_num_slots;
+
+	if (!rel_slots) {
+		return 0;
+	}
+
+	if (ringptr == &kring->nr_hwtail) {
+		/* blocking monitors: only release what they can take
+		 * now, the rest is reported again by the next txsync,
+		 * which always recomputes nr_hwtail from nr_hwcur
+		 */
+		int room = netmap_monitor_room(kring);
+
+		if (room < rel_slots) {
+			rel_slots = room;
+			end = beg + room;
+			if (end > kring->nkr_num_slots - 1)
+				end -= kring->nkr_num_slots;
+			*ringptr = end;
+			/* save_sync already published the full tail */
+			nm_txsync_finalize(kring);
+			if (!rel_slots)
+				return 0;
+		}
+	}
+
+	for (i = 0; i < kring->n_monitors; i++)
+		netmap_monitor_deliver(kring->monitors[i], kring, beg, rel_slots);
 	return 0;
 }
 
@@ -223,10 +350,20 @@ netmap_monitor_txsync(struct netmap_kring *kring, int flags)
 static int
 netmap_monitor_rxsync(struct netmap_kring *kring, int flags)
 {
+	struct netmap_monitor_adapter *mna =
+		(struct netmap_monitor_adapter *)kring->na;
+	struct netmap_priv_d *priv = &mna->priv;
+	u_int i = kring->ring_id;
+	int freed = (kring->nr_hwcur != kring->rcur);
+
         ND("%s %x", kring->name, flags);
 	kring->nr_hwcur = kring->rcur;
 	mb();
 	nm_rxsync_finalize(kring);
+	/* a blocked tx ring may now release more slots */
+	if (freed && (mna->flags & NR_MONITOR_BLOCK) &&
+	    i >= priv->np_txqfirst && i < priv->np_txqlast)
+		priv->np_na->nm_notify(priv->np_na, i, NR_TX, 0);
         return 0;
 }
 
@@ -241,16 +378,75 @@ netmap_monitor_krings_create(struct netmap_adapter *na)
 }
 
 
+/* add a monitor to a kring, intercepting its nm_sync if this is the
+ * first one. Call with the kring stopped.
+ */
+static int
+netmap_monitor_add(struct netmap_kring *kring,
+	struct netmap_monitor_adapter *mna,
+	int (*sync)(struct netmap_kring *, int))
+{
+	struct netmap_monitor_adapter **m;
+	u_int n = kring->n_monitors;
+
+	/* a zero-copy monitor takes the buffers, so it must be alone */
+	if (n > 0 && (!(mna->flags & NR_MONITOR_COPY) ||
+	    !(kring->monitors[0]->flags & NR_MONITOR_COPY))) {
+		D("%s already monitored", kring->name);
+		return EBUSY;
+	}
+	m = malloc((n + 1) * sizeof(*m), M_DEVBUF, M_NOWAIT);
+	if (m == NULL)
+		return ENOMEM;
+	if (n > 0) {
+		memcpy(m, kring->monitors, n * sizeof(*m));
+		free(kring->monitors, M_DEVBUF);
+	}
+	m[n] = mna;
+	kring->monitors = m;
+	kring->n_monitors = n + 1;
+	if (n == 0) {
+		kring->save_sync = kring->nm_sync;
+		kring->nm_sync = sync;
+	}
+	return 0;
+}
+
+/* remove a monitor from a kring, restoring the nm_sync after the
+ * last one. Call with the kring stopped.
+ */
+static void
+netmap_monitor_del(struct netmap_kring *kring,
+	struct netmap_monitor_adapter *mna)
+{
+	u_int i;
+
+	for (i = 0; i < kring->n_monitors; i++)
+		if (kring->monitors[i] == mna)
+			break;
+	if (i == kring->n_monitors)
+		return;
+	kring->monitors[i] = kring->monitors[--kring->n_monitors];
+	if (kring->n_monitors == 0) {
+		kring->nm_sync = kring->save_sync;
+		kring->save_sync = NULL;
+		free(kring->monitors, M_DEVBUF);
+		kring->monitors = NULL;
+	}
+}
+
 /* nm_register callback for monitors.
  *
- * On registration, replace the nm_sync callbacks in the monitored
- * rings with our own, saving the previous ones in the monitored
- * rings themselves, where they are used by netmap_monitor_parent_sync.
+ * On registration, add the monitor to the monitored rings. The first
+ * monitor of a ring replaces its nm_sync callback with our own,
+ * saving the previous one in the monitored ring itself, where it is
+ * used by netmap_monitor_parent_sync.
  *
- * On de-registration, restore the original callbacks. We need to
- * stop traffic while we are doing this, since the monitored adapter may
- * have already started executing a netmap_monitor_parent_sync
- * and may not like the kring->save_sync pointer to become NULL.
+ * On de-registration, remove the monitor, and restore the original
+ * callback after the last one. We need to stop traffic while we are
+ * doing this, since the monitored adapter may have already started
+ * executing a netmap_monitor_parent_sync and may not like the
+ * list of monitors or the kring->save_sync pointer to change.
  */
 static int
 netmap_monitor_reg(struct netmap_adapter *na, int onoff)
@@ -259,8 +455,7 @@ netmap_monitor_reg(struct netmap_adapter *na, int onoff)
 		(struct netmap_monitor_adapter *)na;
 	struct netmap_priv_d *priv = &mna->priv;
 	struct netmap_adapter *pna = priv->np_na;
-	struct netmap_kring *kring;
-	int i;
+	int i, error = 0;
 
 	ND("%p: onoff %d", na, onoff);
 	if (onoff) {
@@ -268,47 +463,55 @@ netmap_monitor_reg(struct netmap_adapter *na, int onoff)
 			/* parent left netmap mode, fatal */
 			return ENXIO;
 		}
+		for (i = 0; i < netmap_real_rx_rings(na); i++) {
+			na->rx_rings[i].ring->mon_drops = 0;
+			na->rx_rings[i].ring->mon_truncs = 0;
+		}
 		if (mna->flags & NR_MONITOR_TX) {
-			for (i = priv->np_txqfirst; i < priv->np_txqlast; i++) {
-				kring = &pna->tx_rings[i];
-				kring->save_sync = kring->nm_sync;
-				kring->nm_sync = netmap_monitor_parent_txsync;
+			for (i = priv->np_txqfirst; !error && i < priv->np_txqlast; i++) {
+				netmap_set_txring(pna, i, 1 /* stopped */);
+				error = netmap_monitor_add(&pna->tx_rings[i], mna,
+					netmap_monitor_parent_txsync);
+				netmap_set_txring(pna, i, 0 /* enabled */);
 			}
 		}
 		if (mna->flags & NR_MONITOR_RX) {
-			for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++) {
-				kring = &pna->rx_rings[i];
-				kring->save_sync = kring->nm_sync;
-				kring->nm_sync = netmap_monitor_parent_rxsync;
+			for (i = priv->np_rxqfirst; !error && i < priv->np_rxqlast; i++) {
+				netmap_set_rxring(pna, i, 1 /* stopped */);
+				error = netmap_monitor_add(&pna->rx_rings[i], mna,
+					netmap_monitor_parent_rxsync);
+				netmap_set_rxring(pna, i, 0 /* enabled */);
 			}
 		}
-		na->na_flags |= NAF_NETMAP_ON;
+		if (!error) {
+			na->na_flags |= NAF_NETMAP_ON;
+			return 0;
+		}
+		/* undo, netmap_monitor_del() skips the rings we
+		 * did not reach
+		 */
 	} else {
 		if (!nm_netmap_on(pna)) {
 			/* parent left netmap mode, nothing to restore */
 			return 0;
 		}
 		na->na_flags &= ~NAF_NETMAP_ON;
-		if (mna->flags & NR_MONITOR_TX) {
-			for (i = priv->np_txqfirst; i < priv->np_txqlast; i++) {
-				netmap_set_txring(pna, i, 1 /* stopped */);
-				kring = &pna->tx_rings[i];
-				kring->nm_sync = kring->save_sync;
-				kring->save_sync = NULL;
-				netmap_set_txring(pna, i, 0 /* enabled */);
-			}
+	}
+	if (mna->flags & NR_MONITOR_TX) {
+		for (i = priv->np_txqfirst; i < priv->np_txqlast; i++) {
+			netmap_set_txring(pna, i, 1 /* stopped */);
+			netmap_monitor_del(&pna->tx_rings[i], mna);
+			netmap_set_txring(pna, i, 0 /* enabled */);
 		}
-		if (mna->flags & NR_MONITOR_RX) {
-			for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++) {
-				netmap_set_rxring(pna, i, 1 /* stopped */);
-				kring = &pna->rx_rings[i];
-				kring->nm_sync = kring->save_sync;
-				kring->save_sync = NULL;
-				netmap_set_rxring(pna, i, 0 /* enabled */);
-			}
+	}
+	if (mna->flags & NR_MONITOR_RX) {
+		for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++) {
+			netmap_set_rxring(pna, i, 1 /* stopped */);
+			netmap_monitor_del(&pna->rx_rings[i], mna);
+			netmap_set_rxring(pna, i, 0 /* enabled */);
 		}
 	}
-	return 0;
+	return error;
 }
 /* nm_krings_delete callback for monitors */
 static void
@@ -324,24 +527,14 @@ netmap_monitor_dtor(struct netmap_adapter *na)
 {
 	struct netmap_monitor_adapter *mna =
 		(struct netmap_monitor_adapter *)na;
-	struct netmap_priv_d *priv = &mna->priv;
-	struct netmap_adapter *pna = priv->np_na;
-	int i;
+	struct netmap_adapter *pna = mna->priv.np_na;
 
 	ND("%p", na);
-	if (nm_netmap_on(pna)) {
-		/* parent still in netmap mode, mark its krings as free */
-		if (mna->flags & NR_MONITOR_TX) {
-			for (i = priv->np_txqfirst; i < priv->np_txqlast; i++) {
-				pna->tx_rings[i].monitor = NULL;
-			}
-		}
-		if (mna->flags & NR_MONITOR_RX) {
-			for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++) {
-				pna->rx_rings[i].monitor = NULL;
-			}
-		}
-	}
+	/* the monitor has left the krings of the parent in
+	 * netmap_monitor_reg()
+	 */
+	if (mna->bpf)
+		nm_bpf_destroy(mna->bpf);
 	netmap_adapter_put(pna);
 }
 
@@ -353,7 +546,7 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	struct nmreq pnmr;
 	struct netmap_adapter *pna; /* parent adapter */
 	struct netmap_monitor_adapter *mna;
-	int i, error;
+	int error;
 
 	if ((nmr->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX)) == 0) {
 		ND("not a monitor");
@@ -374,11 +567,21 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	 * In this way we can potentially monitor everything netmap understands,
 	 * except other monitors.
 	 */
+	if ((nmr->nr_flags & NR_MONITOR_BLOCK) &&
+	    !(nmr->nr_flags & NR_MONITOR_TX)) {
+		D("NR_MONITOR_BLOCK needs NR_MONITOR_TX");
+		free(mna, M_DEVBUF);
+		return EINVAL;
+	}
 	memcpy(&pnmr, nmr, sizeof(pnmr));
-	pnmr.nr_flags &= ~(NR_MONITOR_TX | NR_MONITOR_RX);
+	pnmr.nr_flags &= ~(NR_MONITOR_TX | NR_MONITOR_RX | NR_MONITOR_COPY |
+		NR_MONITOR_BLOCK);
+	if (nmr->nr_flags & NR_MONITOR_COPY)
+		pnmr.nr_arg1 = 0; /* the snaplen is for us */
 	error = netmap_get_na(&pnmr, &pna, create);
 	if (error) {
 		D("parent lookup failed: %d", error);
+		free(mna, M_DEVBUF);
 		return error;
 	}
 	D("found parent: %s", pna->name);
@@ -393,6 +596,23 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 		goto put_out;
 	}
 
+	/* buffers are swapped with the parent rings, so the
+	 * monitor must interpret the slot offsets as the parent does.
+	 * Copy monitors put the data at the start of their buffers.
+	 */
+	if (nmr->nr_flags & NR_MONITOR_COPY) {
+		if (nmr->nr_flags & NR_OFFSETS) {
+			D("%s: no NR_OFFSETS on copy monitors", pna->name);
+			error = EINVAL;
+			goto put_out;
+		}
+	} else if (!(nmr->nr_flags & NR_OFFSETS) !=
+		   !(pna->na_flags & NAF_OFFSETS)) {
+		D("%s: NR_OFFSETS must match the parent", pna->name);
+		error = EINVAL;
+		goto put_out;
+	}
+
 	/* grab all the rings we need in the parent */
 	mna->priv.np_na = pna;
 	error = netmap_interp_ringid(&mna->priv, nmr->nr_ringid, nmr->nr_flags);
@@ -400,33 +620,15 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 		D("ringid error");
 		goto put_out;
 	}
-	if (nmr->nr_flags & NR_MONITOR_TX) {
-		for (i = mna->priv.np_txqfirst; i < mna->priv.np_txqlast; i++) {
-			struct netmap_kring *kring = &pna->tx_rings[i];
-			if (kring->monitor) {
-				error = EBUSY;
-				D("ring busy");
-				goto release_out;
-			}
-			kring->monitor = mna;
-		}
-	}
-	if (nmr->nr_flags & NR_MONITOR_RX) {
-		for (i = mna->priv.np_rxqfirst; i < mna->priv.np_rxqlast; i++) {
-			struct netmap_kring *kring = &pna->rx_rings[i];
-			if (kring->monitor) {
-				error = EBUSY;
-				D("ring busy");
-				goto release_out;
-			}
-			kring->monitor = mna;
-		}
-	}
+	/* the rings are taken in netmap_monitor_reg() */
 
 	snprintf(mna->up.name, sizeof(mna->up.name), "mon:%s", pna->name);
 
-	/* the monitor supports the host rings iff the parent does */
+	/* the monitor supports the host rings iff the parent does,
+	 * and has as many of them
+	 */
 	mna->up.na_flags = (pna->na_flags & NAF_HOST_RINGS);
+	mna->up.num_host_rings = pna->num_host_rings;
 	mna->up.nm_txsync = netmap_monitor_txsync;
 	mna->up.nm_rxsync = netmap_monitor_rxsync;
 	mna->up.nm_register = netmap_monitor_reg;
@@ -458,11 +660,19 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	error = netmap_attach_common(&mna->up);
 	if (error) {
 		D("attach_common error");
-		goto release_out;
+		goto put_out;
 	}
 
 	/* remember the traffic directions we have to monitor */
-	mna->flags = (nmr->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX));
+	mna->flags = (nmr->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX |
+		NR_MONITOR_COPY | NR_MONITOR_BLOCK));
+	if (mna->flags & NR_MONITOR_COPY) {
+		/* nr_arg1 is the snaplen, 0 for the whole buffer */
+		mna->snaplen = nmr->nr_arg1;
+		nm_bound_var(&mna->snaplen, NETMAP_BUF_SIZE(pna),
+			1, NETMAP_BUF_SIZE(pna), NULL);
+		nmr->nr_arg1 = mna->snaplen;
+	}
 
 	*na = &mna->up;
 	netmap_adapter_get(*na);
@@ -478,21 +688,82 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 
 	return 0;
 
-release_out:
-	D("monitor error");
-	for (i = mna->priv.np_txqfirst; i < mna->priv.np_txqlast; i++) {
-		if (pna->tx_rings[i].monitor == mna)
-			pna->tx_rings[i].monitor = NULL;
-	}
-	for (i = mna->priv.np_rxqfirst; i < mna->priv.np_rxqlast; i++) {
-		if (pna->rx_rings[i].monitor == mna)
-			pna->rx_rings[i].monitor = NULL;
-	}
 put_out:
+	D("monitor error");
 	netmap_adapter_put(pna);
 	free(mna, M_DEVBUF);
 	return error;
 }
 
 
+/* stop or restart the monitored rings of an active monitor */
+static void
+netmap_monitor_set_rings(struct netmap_monitor_adapter *mna, int stopped)
+{
+	struct netmap_priv_d *priv = &mna->priv;
+	struct netmap_adapter *pna = priv->np_na;
+	int i;
+
+	if (!nm_netmap_on(&mna->up) || !nm_netmap_on(pna))
+		return;
+	if (mna->flags & NR_MONITOR_TX) {
+		for (i = priv->np_txqfirst; i < priv->np_txqlast; i++)
+			netmap_set_txring(pna, i, stopped);
+	}
+	if (mna->flags & NR_MONITOR_RX) {
+		for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++)
+			netmap_set_rxring(pna, i, stopped);
+	}
+}
+
+/*
+ * NIOCSETMONF: set the BPF program and the sampling rate of the
+ * monitor bound to priv. The filter is replaced with the monitored
+ * rings stopped, so that netmap_monitor_deliver() can use it without
+ * locks. Call with NMG_LOCK held.
+ */
+int
+netmap_monitor_set_filter(struct netmap_priv_d *priv, struct nm_monf_req *req)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct netmap_monitor_adapter *mna;
+	struct nm_bpf *bpf = NULL, *old;
+	void *insns;
+	size_t len;
+	int i;
+
+	NMG_LOCK_ASSERT();
+	if (na == NULL || na->nm_rxsync != netmap_monitor_rxsync)
+		return EINVAL;
+	mna = (struct netmap_monitor_adapter *)na;
+	if (req->nmf_len > NM_BPF_MAXINSNS)
+		return EINVAL;
+	if (req->nmf_len > 0) {
+		/* struct bpf_insn is 8 bytes on all systems */
+		len = req->nmf_len * 8;
+		insns = malloc(len, M_DEVBUF, M_NOWAIT);
+		if (insns == NULL)
+			return ENOMEM;
+		if (copyin((void *)(uintptr_t)req->nmf_insns, insns, len)) {
+			free(insns, M_DEVBUF);
+			return EFAULT;
+		}
+		bpf = nm_bpf_create(insns, req->nmf_len);
+		free(insns, M_DEVBUF);
+		if (bpf == NULL)
+			return EINVAL;
+	}
+
+	netmap_monitor_set_rings(mna, 1 /* stopped */);
+	old = mna->bpf;
+	mna->bpf = bpf;
+	mna->sample = req->nmf_sample;
+	for (i = 0; mna->up.rx_rings && i < netmap_real_rx_rings(&mna->up); i++)
+		mna->up.rx_rings[i].nkr_mon_skip = 0;
+	netmap_monitor_set_rings(mna, 0 /* enabled */);
+	if (old)
+		nm_bpf_destroy(old);
+	return 0;
+}
+
 #endif /* WITH_MONITOR */
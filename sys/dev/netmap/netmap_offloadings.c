@@ -155,7 +155,10 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		vh = (struct nm_vnet_hdr *)ft_p->ft_buf;
 	}
 
-	/* Init source and dest pointers. */
+	/* Init source and dest pointers. Destination slot offsets
+	 * (NR_OFFSETS) are not honoured here: packets are always
+	 * written at the start of the buffer and the offset reset.
+	 */
 	src = ft_p->ft_buf;
 	src_len = ft_p->ft_len;
 	slot = &ring->slot[*j];
@@ -296,6 +299,7 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 				ND("frame %u completed with %d bytes", gso_idx, (int)gso_bytes);
 				slot->len = gso_bytes;
 				slot->flags = 0;
+				slot->ptr &= ~ring->offset_mask;
 				segmented_bytes += gso_bytes - gso_hdr_len;
 
 				dst_slots++;
@@ -359,6 +363,7 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 				memcpy(dst, src, (int)src_len);
 			}
 			slot->len = dst_len;
+			slot->ptr &= ~ring->offset_mask;
 
 			dst_slots++;
 
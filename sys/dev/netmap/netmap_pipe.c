@@ -76,47 +76,73 @@ int netmap_default_pipes = 0; /* default number of pipes for each nic */
 SYSCTL_DECL(_dev_netmap);
 SYSCTL_INT(_dev_netmap, OID_AUTO, default_pipes, CTLFLAG_RW, &netmap_default_pipes, 0 , "");
 
+/*
+ * The pipes of a port are kept in na_pipes, indexed by pipe id, so
+ * that lookups take constant time. The array is allocated with
+ * nr_arg1 entries when the port is registered (or at the first
+ * pipe), and grows when a pipe with a larger id is created, up to
+ * NM_MAXPIPES. The array is only used under NMG_LOCK, on creation
+ * and destruction of the pipes, so it can be replaced while the
+ * other pipes are running.
+ */
+
+/* resize the pipe array of the parent to at least npipes entries */
+static int
+netmap_pipe_grow(struct netmap_adapter *na, u_int npipes)
+{
+	struct netmap_pipe_adapter **pipes;
+	u_int n = na->na_max_pipes;
+
+	if (npipes <= n)
+		return 0;
+	if (npipes > NM_MAXPIPES)
+		return EINVAL;
+	/* double the size, to amortize the copies */
+	if (n < 8)
+		n = 8;
+	while (n < npipes)
+		n *= 2;
+	if (n > NM_MAXPIPES)
+		n = NM_MAXPIPES;
+	pipes = malloc(n * sizeof(*pipes), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (pipes == NULL)
+		return ENOMEM;
+	if (na->na_pipes) {
+		memcpy(pipes, na->na_pipes,
+			na->na_max_pipes * sizeof(*pipes));
+		free(na->na_pipes, M_DEVBUF);
+	}
+	ND("%s: pipe array %d -> %d", na->name, na->na_max_pipes, n);
+	na->na_pipes = pipes;
+	na->na_max_pipes = n;
+	return 0;
+}
+
 /* allocate the pipe array in the parent adapter */
 int
 netmap_pipe_alloc(struct netmap_adapter *na, struct nmreq *nmr)
 {
-	size_t len;
 	int mode = nmr->nr_flags & NR_REG_MASK;
 	u_int npipes;
+	int error;
 
 	if (mode == NR_REG_PIPE_MASTER || mode == NR_REG_PIPE_SLAVE) {
 		/* this is for our parent, not for us */
 		return 0;
 	}
 
-	/* TODO: we can resize the array if the new
-         * request can accomodate the already existing pipes
-         */
-	if (na->na_pipes) {
-		nmr->nr_arg1 = na->na_max_pipes;
-		return 0;
-	}
-
 	npipes = nmr->nr_arg1;
 	if (npipes == 0)
 		npipes = netmap_default_pipes;
 	nm_bound_var(&npipes, 0, 0, NM_MAXPIPES, NULL);
 
-	if (npipes == 0) {
-		/* really zero, nothing to alloc */
-		goto out;
-	}
-
-	len = sizeof(struct netmap_pipe_adapter *) * npipes;
-	na->na_pipes = malloc(len, M_DEVBUF, M_NOWAIT | M_ZERO);
-	if (na->na_pipes == NULL)
-		return ENOMEM;
-
-	na->na_max_pipes = npipes;
-	na->na_next_pipe = 0;
-
-out:
-	nmr->nr_arg1 = npipes;
+	/* an existing array is only grown, more pipes can be
+	 * created later in any case
+	 */
+	error = netmap_pipe_grow(na, npipes);
+	if (error)
+		return error;
+	nmr->nr_arg1 = na->na_max_pipes;
 
 	return 0;
 }
@@ -130,7 +156,7 @@ netmap_pipe_dealloc(struct netmap_adapter *na)
 		free(na->na_pipes, M_DEVBUF);
 		na->na_pipes = NULL;
 		na->na_max_pipes = 0;
-		na->na_next_pipe = 0;
+		na->na_num_pipes = 0;
 	}
 }
 
@@ -138,30 +164,25 @@ netmap_pipe_dealloc(struct netmap_adapter *na)
 static struct netmap_pipe_adapter *
 netmap_pipe_find(struct netmap_adapter *parent, u_int pipe_id)
 {
-	int i;
-	struct netmap_pipe_adapter *na;
-
-	for (i = 0; i < parent->na_next_pipe; i++) {
-		na = parent->na_pipes[i];
-		if (na->id == pipe_id) {
-			return na;
-		}
-	}
-	return NULL;
+	if (pipe_id >= parent->na_max_pipes)
+		return NULL;
+	return parent->na_pipes[pipe_id];
 }
 
 /* add a new pipe endpoint to the parent array */
 static int
 netmap_pipe_add(struct netmap_adapter *parent, struct netmap_pipe_adapter *na)
 {
-	if (parent->na_next_pipe >= parent->na_max_pipes) {
+	int error;
+
+	error = netmap_pipe_grow(parent, na->id + 1);
+	if (error) {
 		D("%s: no space left for pipes", parent->name);
-		return ENOMEM;
+		return error;
 	}
 
-	parent->na_pipes[parent->na_next_pipe] = na;
-	na->parent_slot = parent->na_next_pipe;
-	parent->na_next_pipe++;
+	parent->na_pipes[na->id] = na;
+	parent->na_num_pipes++;
 	return 0;
 }
 
@@ -169,13 +190,8 @@ netmap_pipe_add(struct netmap_adapter *parent, struct netmap_pipe_adapter *na)
 static void
 netmap_pipe_remove(struct netmap_adapter *parent, struct netmap_pipe_adapter *na)
 {
-	u_int n;
-	n = --parent->na_next_pipe;
-	if (n != na->parent_slot) {
-		parent->na_pipes[na->parent_slot] =
-			parent->na_pipes[n];
-	}
-	parent->na_pipes[n] = NULL;
+	parent->na_pipes[na->id] = NULL;
+	parent->na_num_pipes--;
 }
 
 static int
@@ -207,11 +223,19 @@ netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
                 limit = m;
 
 	if (limit == 0) {
-		/* either the rxring is full, or nothing to send */
-		nm_txsync_finalize(txkring); /* actually useless */
+		/* either the rxring is full, or nothing to send.
+		 * Set nr_hwtail anyway: a blocking monitor may have
+		 * held it back (see netmap_monitor_parent_sync())
+		 */
+		txkring->nr_hwtail = nm_prev(k, lim_tx);
+		nm_txsync_finalize(txkring);
 		return 0;
 	}
 
+	if (rxkring->nkr_ts)
+		nm_slot_ts_range(rxkring, j, (j + limit) % rxkring->nkr_num_slots,
+			nm_realtime_ns());
+
         while (limit-- > 0) {
                 struct netmap_slot *rs = &rxkring->save_ring->slot[j];
                 struct netmap_slot *ts = &txkring->ring->slot[k];
@@ -238,7 +262,8 @@ netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
                 txkring->rcur, txkring->rhead, txkring->rtail, j);
 
         mb(); /* make sure rxkring->nr_hwtail is updated before notifying */
-        rxkring->na->nm_notify(rxkring->na, rxkring->ring_id, NR_RX, 0);
+	if (nm_kring_need_event(rxkring))
+		rxkring->na->nm_notify(rxkring->na, rxkring->ring_id, NR_RX, 0);
 
 	return 0;
 }
@@ -264,6 +289,216 @@ netmap_pipe_rxsync(struct netmap_kring *rxkring, int flags)
         return 0;
 }
 
+/*
+ * Broadcast pipes (NR_PIPE_BCAST).
+ *
+ * The slave has one rx ring for each consumer, all fed by the tx ring
+ * of the master, and all with the same size. The buffers are not
+ * moved: slot j of the tx ring is copied into slot j of each rx ring
+ * bound to a consumer, so the consumers see the buffers of the master
+ * (read only, by convention). The original buffers of the rx rings
+ * are kept in nkr_bc_bufs and put back when the consumer goes away.
+ *
+ * The tx ring gives a slot back to the master only when all the
+ * consumers have released it, i.e. nr_hwtail stops before the
+ * oldest nr_hwcur of the rx rings. With netmap_pipe_bcast_drop, a
+ * consumer that holds the whole tx ring is dropped: its slots are
+ * marked as released, and the next sync of the consumer finds
+ * head out of range and reinitializes the ring.
+ *
+ * The q_lock of the tx kring protects the state of the rx krings
+ * against attach and detach; the q_lock of an rx kring serializes
+ * its rxsync with the drops.
+ */
+int netmap_pipe_bcast_drop = 0;	/* drop the slowest consumer */
+SYSCTL_INT(_dev_netmap, OID_AUTO, pipe_bcast_drop, CTLFLAG_RW,
+	&netmap_pipe_bcast_drop, 0, "drop consumers of broadcast pipes that fill the ring");
+
+/* release all the slots held by a slow consumer */
+static void
+netmap_pipe_bcast_kick(struct netmap_kring *rxkring)
+{
+	u_int n = rxkring->nkr_num_slots, held;
+
+	mtx_lock(&rxkring->q_lock);
+	held = (rxkring->nr_hwtail + n - rxkring->nr_hwcur) % n;
+	rxkring->nkr_bc_drops += held;
+	rxkring->nr_hwcur = rxkring->nr_hwtail;
+	mtx_unlock(&rxkring->q_lock);
+	RD(1, "%s: slow consumer, %u slots dropped", rxkring->name, held);
+}
+
+static int
+netmap_pipe_bcast_txsync(struct netmap_kring *txkring, int flags)
+{
+	struct netmap_pipe_adapter *pna =
+		(struct netmap_pipe_adapter *)txkring->na;
+	struct netmap_adapter *sna = &pna->peer->up;
+	struct netmap_ring *ring = txkring->ring;
+	struct netmap_kring *rxkring, *slow;
+	u_int const n = txkring->nkr_num_slots, lim = n - 1;
+	u_int head = txkring->rhead, i, j, held, maxheld;
+	uint64_t now = 0;
+
+	mtx_lock(&txkring->q_lock);
+	/* publish the new slots to all the consumers */
+	for (i = 0; i < sna->num_rx_rings; i++) {
+		rxkring = &sna->rx_rings[i];
+		j = rxkring->nr_hwtail;
+		if (rxkring->nkr_bc_bufs == NULL || j == head)
+			continue;
+		if (rxkring->nkr_ts) {
+			if (now == 0)
+				now = nm_realtime_ns();
+			nm_slot_ts_range(rxkring, j, head, now);
+		}
+		for (; j != head; j = nm_next(j, lim))
+			rxkring->save_ring->slot[j] = ring->slot[j];
+		mb(); /* make sure the slots are updated before publishing them */
+		rxkring->nr_hwtail = head;
+		mb(); /* and nr_hwtail before notifying */
+		if (nm_kring_need_event(rxkring))
+			sna->nm_notify(sna, i, NR_RX, 0);
+	}
+	txkring->nr_hwcur = head;
+
+	/* reclaim the slots released by all the consumers */
+	for (;;) {
+		maxheld = 0;
+		slow = NULL;
+		mb(); /* paired with the rxsync of the consumers */
+		for (i = 0; i < sna->num_rx_rings; i++) {
+			rxkring = &sna->rx_rings[i];
+			if (rxkring->nkr_bc_bufs == NULL)
+				continue;
+			held = (head + n - rxkring->nr_hwcur) % n;
+			if (held > rxkring->nkr_bc_lag)
+				rxkring->nkr_bc_lag = held;
+			if (held > maxheld) {
+				maxheld = held;
+				slow = rxkring;
+			}
+		}
+		if (slow == NULL || maxheld < lim || !netmap_pipe_bcast_drop)
+			break;
+		netmap_pipe_bcast_kick(slow);
+	}
+	txkring->nr_hwtail = nm_prev((head + n - maxheld) % n, lim);
+	mtx_unlock(&txkring->q_lock);
+
+	nm_txsync_finalize(txkring);
+	return 0;
+}
+
+static int
+netmap_pipe_bcast_rxsync(struct netmap_kring *rxkring, int flags)
+{
+	struct netmap_kring *txkring = rxkring->pipe;
+	u_int const n = rxkring->nkr_num_slots;
+	uint32_t oldhwcur;
+
+	mtx_lock(&rxkring->q_lock);
+	oldhwcur = rxkring->nr_hwcur;
+	/* a concurrent drop may have moved nr_hwcur past rhead */
+	if ((rxkring->rhead + n - oldhwcur) % n <=
+	    (rxkring->nr_hwtail + n - oldhwcur) % n)
+		rxkring->nr_hwcur = rxkring->rhead;
+	mtx_unlock(&rxkring->q_lock);
+	nm_rxsync_finalize(rxkring);
+
+	if (oldhwcur != rxkring->nr_hwcur) {
+		/* let the master reclaim the slots */
+		mb(); /* make sure nr_hwcur is updated before notifying */
+		txkring->na->nm_notify(txkring->na, txkring->ring_id, NR_TX, 0);
+	}
+	return 0;
+}
+
+/* first rx ring of a broadcast slave not bound to a consumer.
+ * Call with NMG_LOCK held.
+ */
+u_int
+netmap_pipe_bcast_ring(struct netmap_adapter *na)
+{
+	struct netmap_pipe_adapter *pna = (struct netmap_pipe_adapter *)na;
+	u_int i;
+
+	for (i = 0; i < na->num_rx_rings; i++)
+		if (!(pna->bc_busy & (1U << i)))
+			break;
+	return i;
+}
+
+/*
+ * start feeding the rx ring of a consumer, from the next slot sent
+ * by the master. Call with NMG_LOCK held, after netmap_do_regif().
+ */
+int
+netmap_pipe_bcast_attach(struct netmap_priv_d *priv)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct netmap_pipe_adapter *pna = (struct netmap_pipe_adapter *)na;
+	struct netmap_kring *rxkring = &na->rx_rings[priv->np_rxqfirst];
+	struct netmap_kring *txkring = rxkring->pipe;
+	struct netmap_ring *ring = rxkring->ring;
+	u_int i, n = rxkring->nkr_num_slots;
+	uint32_t *bufs;
+
+	NMG_LOCK_ASSERT();
+	bufs = malloc(n * sizeof(*bufs), M_DEVBUF, M_NOWAIT);
+	if (bufs == NULL)
+		return ENOMEM;
+	for (i = 0; i < n; i++)
+		bufs[i] = ring->slot[i].buf_idx;
+
+	mtx_lock(&txkring->q_lock);
+	rxkring->nr_hwcur = rxkring->nr_hwtail = txkring->nr_hwcur;
+	rxkring->rhead = rxkring->rcur = rxkring->rtail = rxkring->nr_hwcur;
+	ring->head = ring->cur = rxkring->nr_hwcur;
+	nm_ring_set_tail(rxkring, rxkring->nr_hwtail);
+	rxkring->nkr_bc_lag = 0;
+	rxkring->nkr_bc_drops = 0;
+	rxkring->nkr_bc_bufs = bufs;
+	mtx_unlock(&txkring->q_lock);
+
+	pna->bc_busy |= 1U << priv->np_rxqfirst;
+	priv->np_bcast = rxkring;
+	return 0;
+}
+
+/* stop feeding the rx ring of a consumer. Call with NMG_LOCK held. */
+void
+netmap_pipe_bcast_detach(struct netmap_priv_d *priv)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct netmap_pipe_adapter *pna = (struct netmap_pipe_adapter *)na;
+	struct netmap_kring *rxkring = priv->np_bcast;
+	struct netmap_kring *txkring = rxkring->pipe;
+	struct netmap_ring *ring = rxkring->save_ring;
+	u_int i;
+	uint32_t *bufs;
+
+	NMG_LOCK_ASSERT();
+	mtx_lock(&txkring->q_lock);
+	bufs = rxkring->nkr_bc_bufs;
+	rxkring->nkr_bc_bufs = NULL;
+	mtx_unlock(&txkring->q_lock);
+
+	/* give the ring its own buffers back */
+	for (i = 0; i < rxkring->nkr_num_slots; i++)
+		ring->slot[i].buf_idx = bufs[i];
+	free(bufs, M_DEVBUF);
+	if (netmap_verbose || rxkring->nkr_bc_drops)
+		D("%s: max lag %u slots, %llu slots dropped", rxkring->name,
+			rxkring->nkr_bc_lag,
+			(unsigned long long)rxkring->nkr_bc_drops);
+
+	pna->bc_busy &= ~(1U << priv->np_rxqfirst);
+	priv->np_bcast = NULL;
+	/* the slots held by the consumer are free now */
+	txkring->na->nm_notify(txkring->na, txkring->ring_id, NR_TX, 0);
+}
+
 /* Pipe endpoints are created and destroyed together, so that endopoints do not
  * have to check for the existence of their peer at each ?xsync.
  *
@@ -315,7 +550,7 @@ static int
 netmap_pipe_krings_create(struct netmap_adapter *na)
 {
 	struct netmap_pipe_adapter *pna =
-		(struct netmap_pipe_adapter *)na;
+		(struct netmap_pipe_adapter *)na, *sna;
 	struct netmap_adapter *ona = &pna->peer->up;
 	int error = 0;
 	if (pna->peer_ref) {
@@ -343,7 +578,14 @@ netmap_pipe_krings_create(struct netmap_adapter *na)
 		for (i = 0; i < na->num_rx_rings + 1; i++)
 			na->rx_rings[i].save_ring = na->rx_rings[i].ring;
 
-		/* now, create krings and rings of the other end */
+		/* now, create krings and rings of the other end.
+		 * Slots are swapped between the two ends together
+		 * with their offsets, so both must use the same
+		 * offset configuration. Also use the same layout.
+		 */
+		ona->na_flags = (ona->na_flags & ~NAF_RING_CONFIG) |
+			(na->na_flags & NAF_RING_CONFIG);
+		ona->na_headroom = na->na_headroom;
 		error = netmap_krings_create(ona, 0);
 		if (error)
 			goto del_rings1;
@@ -357,12 +599,24 @@ netmap_pipe_krings_create(struct netmap_adapter *na)
 		for (i = 0; i < ona->num_rx_rings + 1; i++)
 			ona->rx_rings[i].save_ring = ona->rx_rings[i].ring;
 
-		/* cross link the krings */
+		/* cross link the krings. The rx slots are stamped
+		 * by the txsync of the other end
+		 */
 		for (i = 0; i < na->num_tx_rings; i++) {
 			na->tx_rings[i].pipe = pna->peer->up.rx_rings + i;
 			na->rx_rings[i].pipe = pna->peer->up.tx_rings + i;
 			pna->peer->up.tx_rings[i].pipe = na->rx_rings + i;
 			pna->peer->up.rx_rings[i].pipe = na->tx_rings + i;
+			na->rx_rings[i].nr_kflags |= NKR_SLOT_TS_SELF;
+			pna->peer->up.rx_rings[i].nr_kflags |= NKR_SLOT_TS_SELF;
+		}
+		/* the other rx rings of a broadcast slave are also
+		 * fed by the tx ring of the master
+		 */
+		sna = (pna->role == NR_REG_PIPE_SLAVE ? pna : pna->peer);
+		for (i = 1; i < sna->up.num_rx_rings; i++) {
+			sna->up.rx_rings[i].pipe = sna->peer->up.tx_rings;
+			sna->up.rx_rings[i].nr_kflags |= NKR_SLOT_TS_SELF;
 		}
 	} else {
 		int i;
@@ -564,10 +818,10 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	mna = netmap_pipe_find(pna, pipe_id);
 	if (mna) {
 		if (mna->role == role) {
-			ND("found %d directly at %d", pipe_id, mna->parent_slot);
+			ND("found %d directly", pipe_id);
 			req = mna;
 		} else {
-			ND("found %d indirectly at %d", pipe_id, mna->parent_slot);
+			ND("found %d indirectly", pipe_id);
 			req = mna->peer;
 		}
 		/* the pipe we have found already holds a ref to the parent,
@@ -615,6 +869,12 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	mna->up.num_rx_desc = nmr->nr_rx_slots;
 	nm_bound_var(&mna->up.num_rx_desc, pna->num_rx_desc,
 			1, NM_PIPE_MAXSLOTS, NULL);
+	if (nmr->nr_flags & NR_PIPE_BCAST) {
+		/* nr_rx_rings is the number of consumers */
+		mna->bcast = nmr->nr_rx_rings;
+		nm_bound_var(&mna->bcast, 4, 1, NM_PIPE_BCAST_MAX, NULL);
+		mna->up.nm_txsync = netmap_pipe_bcast_txsync;
+	}
 	error = netmap_attach_common(&mna->up);
 	if (error)
 		goto free_mna;
@@ -633,6 +893,14 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	*sna = *mna;
 	snprintf(sna->up.name, sizeof(sna->up.name), "%s}%d", pna->name, pipe_id);
 	sna->role = NR_REG_PIPE_SLAVE;
+	if (mna->bcast) {
+		/* one rx ring per consumer, slot by slot with the master */
+		sna->up.nm_txsync = netmap_pipe_txsync;
+		sna->up.nm_rxsync = netmap_pipe_bcast_rxsync;
+		sna->up.num_rx_rings = mna->bcast;
+		sna->up.num_rx_desc = mna->up.num_tx_desc;
+		sna->up.na_flags |= NAF_PIPE_BCAST;
+	}
 	error = netmap_attach_common(&sna->up);
 	if (error)
 		goto free_sna;
@@ -685,4 +953,463 @@ put_out:
 }
 
 
+/*
+ * Pipe load balancer (NR_PIPE_LB).
+ *
+ * A descriptor bound to the rx rings of a port with NR_PIPE_LB owns
+ * the masters of the first nr_arg1 pipes of the port, and the
+ * rxsync of its rings distributes the new slots to the rx rings
+ * of the slaves, by swapping the buffers. The workers open the
+ * slaves (e.g. eth0}3) and receive as usual. The slot of each
+ * packet is chosen by a symmetric hash of addresses and ports,
+ * so both directions of a flow go to the same pipe, or round-robin
+ * with NR_PIPE_LB_RR. Packets for a pipe whose ring is full are
+ * dropped and counted, and the counters are in
+ * dev.netmap.pipe_lb_stats.
+ *
+ * The rxsync is intercepted as monitors do, replacing nm_sync in
+ * the krings; it runs the original rxsync, distributes the new
+ * slots and then gives all of them back to the port on the next
+ * round. Userspace must not touch the rx rings of the descriptor,
+ * and only drives the balancer with poll() or NIOCRXSYNC, or not
+ * at all with NR_KTHREAD.
+ */
+struct nm_pipe_lb_pipe {
+	struct netmap_adapter *na;	/* the master, owned by us */
+	struct netmap_priv_d *kpriv;	/* its registration */
+	struct netmap_kring *rxkring;	/* rx kring of the slave */
+	uint64_t pkts;			/* under rxkring->q_lock */
+	uint64_t drops;
+};
+
+struct nm_pipe_lb_ring {
+	struct nm_pipe_lb *lb;
+	int (*saved_sync)(struct netmap_kring *kring, int flags);
+	u_int rr_next;
+	u_int *cnt;		/* new slots for each pipe */
+	uint16_t *dst;		/* pipe of each new slot */
+};
+
+struct nm_pipe_lb {
+	struct nm_pipe_lb *next;	/* in nm_pipe_lbs */
+	struct netmap_adapter *na;	/* the balanced port */
+	u_int npipes;
+	int rr;
+	struct nm_pipe_lb_pipe *pipes;
+	u_int qfirst, qlast;		/* balanced rx rings */
+	struct nm_pipe_lb_ring *rings;
+};
+
+/* all the balancers, for the stats. Protected by NMG_LOCK */
+static struct nm_pipe_lb *nm_pipe_lbs;
+
+static inline uint32_t
+nm_pipe_lb_rd16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t
+nm_pipe_lb_rd32(const uint8_t *p)
+{
+	return (nm_pipe_lb_rd16(p) << 16) | nm_pipe_lb_rd16(p + 2);
+}
+
+/*
+ * Symmetric hash of the IPv4/IPv6 addresses, protocol and TCP/UDP/SCTP
+ * ports (of the MAC addresses for other frames). Source and
+ * destination are combined with xor, so the result is the same in
+ * both directions. Fragments are hashed without the ports, so that
+ * all the fragments of a datagram go to the same pipe.
+ */
+static uint32_t
+nm_pipe_lb_hash(const uint8_t *p, u_int len)
+{
+	u_int ofs = 14, l4 = 0, proto = 0, type, i;
+	uint32_t h = 0;
+
+	if (len < 14)
+		return 0;
+	type = nm_pipe_lb_rd16(p + 12);
+	if (type == 0x8100 && len >= 18) {	/* one VLAN tag */
+		type = nm_pipe_lb_rd16(p + 16);
+		ofs = 18;
+	}
+	if (type == 0x0800 && len >= ofs + 20) {
+		const uint8_t *ip = p + ofs;
+
+		h = nm_pipe_lb_rd32(ip + 12) ^ nm_pipe_lb_rd32(ip + 16);
+		proto = ip[9];
+		if ((nm_pipe_lb_rd16(ip + 6) & 0x3fff) == 0)
+			l4 = ofs + (ip[0] & 0xf) * 4;
+	} else if (type == 0x86dd && len >= ofs + 40) {
+		const uint8_t *ip6 = p + ofs;
+
+		for (i = 8; i < 24; i += 4)
+			h ^= nm_pipe_lb_rd32(ip6 + i) ^
+				nm_pipe_lb_rd32(ip6 + i + 16);
+		proto = ip6[6];
+		l4 = ofs + 40;
+	} else {
+		h = nm_pipe_lb_rd32(p) ^ nm_pipe_lb_rd32(p + 6) ^
+			nm_pipe_lb_rd16(p + 4) ^ nm_pipe_lb_rd16(p + 10);
+	}
+	if (l4 && (proto == 6 || proto == 17 || proto == 132) &&
+	    len >= l4 + 4)
+		h ^= nm_pipe_lb_rd16(p + l4) ^ nm_pipe_lb_rd16(p + l4 + 2);
+	h ^= proto;
+	/* mix the bits (murmur3 finalizer) */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/*
+ * Move the slots in [head, tail) of kring that go to pipe p into
+ * the rx kring of the slave. Other rings of the port may push
+ * to the same pipe, so producers are serialized by the q_lock
+ * of the slave kring; the slave rxsync only moves nr_hwcur,
+ * as with the txsync of the master.
+ */
+static void
+nm_pipe_lb_push(struct netmap_kring *kring, struct nm_pipe_lb_ring *lr,
+	u_int p, u_int head, u_int tail)
+{
+	struct nm_pipe_lb_pipe *lp = &lr->lb->pipes[p];
+	struct netmap_kring *rxkring = lp->rxkring;
+	struct netmap_slot *slot = kring->ring->slot;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int const lim_rx = rxkring->nkr_num_slots - 1;
+	u_int k, j, space, sent = 0, want = lr->cnt[p];
+	int busy, notify = 0;
+
+	mtx_lock(&rxkring->q_lock);
+	j = rxkring->nr_hwtail;
+	busy = j - rxkring->nr_hwcur;
+	if (busy < 0)
+		busy += rxkring->nkr_num_slots;
+	space = lim_rx - busy;
+	for (k = head; k != tail && sent < want && sent < space;
+			k = nm_next(k, lim)) {
+		/* the ring is hidden while the slave is not registered */
+		struct netmap_slot *rs = &rxkring->save_ring->slot[j];
+		struct netmap_slot tmp;
+
+		if (lr->dst[k] != p)
+			continue;
+		tmp = *rs;
+		*rs = slot[k];
+		slot[k] = tmp;
+		slot[k].flags |= NS_BUF_CHANGED;
+		if (rxkring->nkr_ts)
+			rxkring->nkr_ts[j] = kring->nkr_ts[k];
+		j = nm_next(j, lim_rx);
+		sent++;
+	}
+	if (sent) {
+		mb(); /* the slots before the new tail */
+		rxkring->nr_hwtail = j;
+		notify = nm_kring_need_event(rxkring);
+	}
+	lp->pkts += sent;
+	lp->drops += want - sent;
+	mtx_unlock(&rxkring->q_lock);
+	if (sent < want)
+		RD(5, "%s: %u drops", rxkring->name, want - sent);
+	if (notify)
+		rxkring->na->nm_notify(rxkring->na, rxkring->ring_id, NR_RX, 0);
+}
+
+/* nm_sync callback of the balanced rx krings */
+static int
+netmap_pipe_lb_rxsync(struct netmap_kring *kring, int flags)
+{
+	struct nm_pipe_lb_ring *lr = kring->nkr_lb;
+	struct nm_pipe_lb *lb = lr->lb;
+	struct netmap_ring *ring = kring->ring;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int k, p, head, tail;
+	int error;
+
+	/* give back the slots of the previous round, get new ones */
+	error = lr->saved_sync(kring, flags);
+	if (error)
+		return error;
+	head = kring->nr_hwcur;
+	tail = kring->nr_hwtail;
+	if (head == tail)
+		return 0;
+
+	bzero(lr->cnt, lb->npipes * sizeof(lr->cnt[0]));
+	for (k = head; k != tail; k = nm_next(k, lim)) {
+		struct netmap_slot *slot = &ring->slot[k];
+
+		if (lb->rr) {
+			p = lr->rr_next++;
+			if (lr->rr_next == lb->npipes)
+				lr->rr_next = 0;
+		} else {
+			p = nm_pipe_lb_hash(NMB_O(kring, slot), slot->len) %
+				lb->npipes;
+		}
+		lr->dst[k] = p;
+		lr->cnt[p]++;
+	}
+	for (p = 0; p < lb->npipes; p++) {
+		if (lr->cnt[p])
+			nm_pipe_lb_push(kring, lr, p, head, tail);
+	}
+
+	/* the slots are consumed, release them on the next round */
+	ring->head = ring->cur = tail;
+	kring->rhead = kring->rcur = tail;
+	return 0;
+}
+
+/*
+ * Start balancing the rx rings of priv over the first npipes
+ * pipes of the port. Call with NMG_LOCK held, after netmap_do_regif().
+ */
+int
+netmap_pipe_lb_enable(struct netmap_priv_d *priv, u_int npipes, int rr)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct nm_pipe_lb *lb;
+	struct netmap_kring *kring;
+	u_int i;
+	int error = 0;
+
+	NMG_LOCK_ASSERT();
+	if (npipes == 0 || npipes > NM_MAXPIPES)
+		return EINVAL;
+	lb = malloc(sizeof(*lb), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (lb == NULL)
+		return ENOMEM;
+	lb->na = na;
+	lb->npipes = npipes;
+	lb->rr = rr;
+	/* only the hardware rings, not the host ones */
+	lb->qfirst = priv->np_rxqfirst;
+	lb->qlast = priv->np_rxqlast;
+	if (lb->qlast > na->num_rx_rings)
+		lb->qlast = na->num_rx_rings;
+	if (lb->qfirst >= lb->qlast) {
+		free(lb, M_DEVBUF);
+		return EINVAL;
+	}
+	for (i = lb->qfirst; i < lb->qlast; i++) {
+		/* one interceptor at a time (e.g. no monitors) */
+		if (na->rx_rings[i].nm_sync != na->nm_rxsync) {
+			free(lb, M_DEVBUF);
+			return EBUSY;
+		}
+	}
+	priv->np_lb = lb;
+
+	lb->pipes = malloc(npipes * sizeof(lb->pipes[0]), M_DEVBUF,
+		M_NOWAIT | M_ZERO);
+	lb->rings = malloc((lb->qlast - lb->qfirst) * sizeof(lb->rings[0]),
+		M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (lb->pipes == NULL || lb->rings == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+
+	/* register the masters */
+	for (i = 0; i < npipes; i++) {
+		struct nm_pipe_lb_pipe *lp = &lb->pipes[i];
+		struct netmap_adapter *pna;
+		struct nmreq pnmr;
+
+		bzero(&pnmr, sizeof(pnmr));
+		strncpy(pnmr.nr_name, na->name, sizeof(pnmr.nr_name) - 1);
+		pnmr.nr_flags = NR_REG_PIPE_MASTER;
+		pnmr.nr_ringid = i;
+		error = netmap_get_pipe_na(&pnmr, &pna, 1 /* create */);
+		if (error)
+			goto out;
+		if (pna->active_fds > 0 || NETMAP_OWNED_BY_KERN(pna)) {
+			netmap_adapter_put(pna);
+			error = EBUSY;
+			goto out;
+		}
+		if (((struct netmap_pipe_adapter *)pna)->bcast) {
+			/* the slots would not reach all the slaves */
+			netmap_adapter_put(pna);
+			error = EINVAL;
+			goto out;
+		}
+		/* the slots carry their offsets and timestamps */
+		if (pna->tx_rings == NULL) {
+			pna->na_flags = (pna->na_flags & ~NAF_RING_CONFIG) |
+				(na->na_flags & NAF_RING_CONFIG);
+			pna->na_headroom = na->na_headroom;
+		} else if (((pna->na_flags ^ na->na_flags) &
+				(NAF_OFFSETS | NAF_SLOT_TS)) ||
+			   pna->na_headroom != na->na_headroom) {
+			netmap_adapter_put(pna);
+			error = EINVAL;
+			goto out;
+		}
+		lp->kpriv = malloc(sizeof(*lp->kpriv), M_DEVBUF,
+			M_NOWAIT | M_ZERO);
+		if (lp->kpriv == NULL) {
+			netmap_adapter_put(pna);
+			error = ENOMEM;
+			goto out;
+		}
+		error = netmap_do_regif(lp->kpriv, pna, 0, NR_REG_ALL_NIC);
+		if (error) {
+			free(lp->kpriv, M_DEVBUF);
+			lp->kpriv = NULL;
+			netmap_adapter_put(pna);
+			goto out;
+		}
+		/* keep userspace away from the master */
+		pna->na_flags |= NAF_BUSY;
+		lp->na = pna;
+		lp->rxkring = pna->tx_rings[0].pipe;
+	}
+
+	/* intercept the rxsync of the rings */
+	for (i = lb->qfirst; i < lb->qlast; i++) {
+		struct nm_pipe_lb_ring *lr = &lb->rings[i - lb->qfirst];
+
+		kring = &na->rx_rings[i];
+		lr->lb = lb;
+		lr->cnt = malloc(npipes * sizeof(lr->cnt[0]), M_DEVBUF,
+			M_NOWAIT | M_ZERO);
+		lr->dst = malloc(kring->nkr_num_slots * sizeof(lr->dst[0]),
+			M_DEVBUF, M_NOWAIT | M_ZERO);
+		if (lr->cnt == NULL || lr->dst == NULL) {
+			error = ENOMEM;
+			goto out;
+		}
+	}
+	for (i = lb->qfirst; i < lb->qlast; i++) {
+		struct nm_pipe_lb_ring *lr = &lb->rings[i - lb->qfirst];
+
+		kring = &na->rx_rings[i];
+		lr->saved_sync = kring->nm_sync;
+		kring->nkr_lb = lr;
+		mb();
+		kring->nm_sync = netmap_pipe_lb_rxsync;
+	}
+	lb->next = nm_pipe_lbs;
+	nm_pipe_lbs = lb;
+	return 0;
+
+out:
+	netmap_pipe_lb_disable(priv);
+	return error;
+}
+
+/* stop the balancer of priv. Call with NMG_LOCK held. */
+void
+netmap_pipe_lb_disable(struct netmap_priv_d *priv)
+{
+	struct nm_pipe_lb *lb = priv->np_lb, **pp;
+	struct netmap_adapter *na = priv->np_na;
+	struct netmap_kring *kring;
+	u_int i;
+
+	NMG_LOCK_ASSERT();
+	if (lb == NULL)
+		return;
+	for (pp = &nm_pipe_lbs; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == lb) {
+			*pp = lb->next;
+			break;
+		}
+	}
+	for (i = lb->qfirst; lb->rings && i < lb->qlast; i++) {
+		struct nm_pipe_lb_ring *lr = &lb->rings[i - lb->qfirst];
+
+		kring = &na->rx_rings[i];
+		if (kring->nkr_lb == lr) {
+			/* wait for a running rxsync */
+			netmap_set_rxring(na, i, 1 /* stopped */);
+			if (kring->nm_sync == netmap_pipe_lb_rxsync)
+				kring->nm_sync = lr->saved_sync;
+#ifdef WITH_MONITOR
+			else if (kring->save_sync == netmap_pipe_lb_rxsync)
+				kring->save_sync = lr->saved_sync;
+#endif /* WITH_MONITOR */
+			kring->nkr_lb = NULL;
+			netmap_set_rxring(na, i, 0 /* enabled */);
+		}
+		if (lr->cnt)
+			free(lr->cnt, M_DEVBUF);
+		if (lr->dst)
+			free(lr->dst, M_DEVBUF);
+	}
+	for (i = 0; lb->pipes && i < lb->npipes; i++) {
+		struct nm_pipe_lb_pipe *lp = &lb->pipes[i];
+
+		if (lp->na == NULL)
+			continue;
+		lp->na->na_flags &= ~NAF_BUSY;
+		/* unregisters the master and drops our reference */
+		netmap_dtor_locked(lp->kpriv);
+		bzero(lp->kpriv, sizeof(*lp->kpriv));
+		free(lp->kpriv, M_DEVBUF);
+	}
+	if (lb->rings)
+		free(lb->rings, M_DEVBUF);
+	if (lb->pipes)
+		free(lb->pipes, M_DEVBUF);
+	free(lb, M_DEVBUF);
+	priv->np_lb = NULL;
+}
+
+/*
+ * Print the packets and drops of the pipes of all the balancers,
+ * for the pipe_lb_stats sysctl (FreeBSD) or module parameter (linux).
+ * Returns the number of bytes written, excluding the final NUL.
+ */
+int
+netmap_pipe_lb_print_stats(char *buf, int len)
+{
+	struct nm_pipe_lb *lb;
+	u_int i;
+	int n = 0;
+
+	buf[0] = '\0';
+	NMG_LOCK();
+	for (lb = nm_pipe_lbs; lb != NULL && n < len; lb = lb->next) {
+		n += snprintf(buf + n, len - n, "%s rings %u-%u %s\n",
+			lb->na->name, lb->qfirst, lb->qlast - 1,
+			lb->rr ? "round-robin" : "hash");
+		for (i = 0; i < lb->npipes && n < len; i++) {
+			n += snprintf(buf + n, len - n,
+				"  }%u pkts %llu drops %llu\n", i,
+				(unsigned long long)lb->pipes[i].pkts,
+				(unsigned long long)lb->pipes[i].drops);
+		}
+	}
+	NMG_UNLOCK();
+	return n < len ? n : len - 1;
+}
+
+#ifdef __FreeBSD__
+static int
+netmap_pipe_lb_stats_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	char *buf;
+	int len = 4096, error;
+
+	buf = malloc(len, M_DEVBUF, M_WAITOK | M_ZERO);
+	netmap_pipe_lb_print_stats(buf, len);
+	error = sysctl_handle_string(oidp, buf, len, req);
+	free(buf, M_DEVBUF);
+	return error;
+}
+SYSCTL_PROC(_dev_netmap, OID_AUTO, pipe_lb_stats,
+    CTLTYPE_STRING | CTLFLAG_RD, 0, 0, netmap_pipe_lb_stats_sysctl, "A",
+    "Packets and drops of the pipe load balancers");
+#endif /* __FreeBSD__ */
+
 #endif /* WITH_PIPES */
@@ -1014,6 +1014,8 @@ netmap_vp_krings_create(struct netmap_adapter *na)
 	for (i = 0; i < nrx; i++) { /* Receive rings */
 		na->rx_rings[i].nkr_leases = leases;
 		leases += na->num_rx_desc;
+		/* slots are stamped in nm_bdg_flush() */
+		na->rx_rings[i].nr_kflags |= NKR_SLOT_TS_SELF;
 	}
 
 	error = nm_alloc_bdgfwd(na);
@@ -1082,8 +1084,15 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 		ND("flags is 0x%x", slot->flags);
 		/* this slot goes into a list so initialize the link field */
 		ft[ft_i].ft_next = NM_FT_NULL;
-		buf = ft[ft_i].ft_buf = (slot->flags & NS_INDIRECT) ?
-			(void *)(uintptr_t)slot->ptr : NMB(&na->up, slot);
+		if (slot->flags & NS_INDIRECT) {
+			buf = ft[ft_i].ft_buf = (void *)(uintptr_t)slot->ptr;
+		} else {
+			u_int off = nm_get_offset(kring, slot);
+
+			buf = ft[ft_i].ft_buf = (char *)NMB(&na->up, slot) + off;
+			if (unlikely(slot->len > NETMAP_BUF_SIZE(&na->up) - off))
+				ft[ft_i].ft_len = NETMAP_BUF_SIZE(&na->up) - off;
+		}
 		if (unlikely(buf == NULL)) {
 			RD(5, "NULL %s buffer pointer from %s slot %d len %d",
 				(slot->flags & NS_INDIRECT) ? "INDIRECT" : "DIRECT",
@@ -1547,17 +1556,24 @@ retry:
 				do {
 					char *dst, *src = ft_p->ft_buf;
 					size_t copy_len = ft_p->ft_len, dst_len = copy_len;
+					u_int dst_off;
+					int aligned;
 
 					slot = &ring->slot[j];
-					dst = NMB(&dst_na->up, slot);
+					dst_off = nm_get_offset(kring, slot);
+					dst = (char *)NMB(&dst_na->up, slot) + dst_off;
 
 					ND("send [%d] %d(%d) bytes at %s:%d",
 							i, (int)copy_len, (int)dst_len,
 							NM_IFPNAME(dst_ifp), j);
-					/* round to a multiple of 64 */
-					copy_len = (copy_len + 63) & ~63;
+					/* round to a multiple of 64, unless the
+					 * slot offsets misalign the buffers
+					 */
+					aligned = ((((uintptr_t)src | (uintptr_t)dst) & 63) == 0);
+					if (aligned)
+						copy_len = (copy_len + 63) & ~63;
 
-					if (unlikely(copy_len > NETMAP_BUF_SIZE(&dst_na->up) ||
+					if (unlikely(copy_len + dst_off > NETMAP_BUF_SIZE(&dst_na->up) ||
 						     copy_len > NETMAP_BUF_SIZE(&na->up))) {
 						RD(5, "invalid len %d, down to 64", (int)copy_len);
 						copy_len = dst_len = 64; // XXX
@@ -1567,9 +1583,11 @@ retry:
 							// invalid user pointer, pretend len is 0
 							dst_len = 0;
 						}
-					} else {
+					} else if (likely(aligned)) {
 						//memcpy(dst, src, copy_len);
 						pkt_copy(src, dst, (int)copy_len);
+					} else {
+						memcpy(dst, src, copy_len);
 					}
 					slot->len = dst_len;
 					slot->flags = (cnt << 8)| NS_MOREFRAG;
@@ -1589,6 +1607,9 @@ retry:
 		    uint32_t update_pos;
 		    int still_locked = 1;
 
+		    /* one timestamp for the slots of this lease */
+		    if (kring->nkr_ts)
+			nm_slot_ts_range(kring, my_start, j, nm_realtime_ns());
 		    mtx_lock(&kring->q_lock);
 		    if (unlikely(howmany > 0)) {
 			/* not used all bufs. If i am the last one
@@ -1627,10 +1648,14 @@ retry:
 			 * means there are new buffers to report
 			 */
 			if (likely(j != my_start)) {
+				int notify;
+
 				kring->nr_hwtail = j;
+				notify = nm_kring_need_event(kring);
 				still_locked = 0;
 				mtx_unlock(&kring->q_lock);
-				dst_na->up.nm_notify(&dst_na->up, dst_nr, NR_RX, 0);
+				if (notify)
+					dst_na->up.nm_notify(&dst_na->up, dst_nr, NR_RX, 0);
 				/* this is netmap_notify for VALE ports and
 				 * netmap_bwrap_notify for bwrap. The latter will
 				 * trigger a txsync on the underlying hwna
@@ -1823,19 +1848,33 @@ netmap_vp_create(struct nmreq *nmr, struct ifnet *ifp, struct netmap_vp_adapter
         if (netmap_verbose)
 		D("max frame size %u", vpna->mfs);
 
-	na->na_flags |= NAF_BDG_MAYSLEEP | NAF_MEM_OWNER;
+	na->na_flags |= NAF_BDG_MAYSLEEP;
 	na->nm_txsync = netmap_vp_txsync;
 	na->nm_rxsync = netmap_vp_rxsync;
 	na->nm_register = netmap_vp_reg;
 	na->nm_krings_create = netmap_vp_krings_create;
 	na->nm_krings_delete = netmap_vp_krings_delete;
 	na->nm_dtor = netmap_vp_dtor;
-	na->nm_mem = netmap_mem_private_new(na->name,
-			na->num_tx_rings, na->num_tx_desc,
-			na->num_rx_rings, na->num_rx_desc,
-			nmr->nr_arg3, npipes, &error);
-	if (na->nm_mem == NULL)
-		goto err;
+	if (nmr->nr_arg2 == 0) {
+		na->nm_mem = netmap_mem_private_new(na->name,
+				na->num_tx_rings, na->num_tx_desc,
+				na->num_rx_rings, na->num_rx_desc,
+				nmr->nr_arg3, npipes, &error);
+		if (na->nm_mem == NULL)
+			goto err;
+	} else {
+		/* join an existing memory region, so that this port
+		 * can exchange buffers with the other ports using it
+		 */
+		na->nm_mem = netmap_mem_find(nmr->nr_arg2);
+		if (na->nm_mem == NULL) {
+			D("no memory region with id %d", nmr->nr_arg2);
+			error = EINVAL;
+			goto err;
+		}
+	}
+	if (na->nm_mem != &nm_mem)
+		na->na_flags |= NAF_MEM_OWNER;
 	na->nm_bdg_attach = netmap_vp_bdg_attach;
 	/* other nmd fields are set in the common routine */
 	error = netmap_attach_common(na);
@@ -1845,7 +1884,7 @@ netmap_vp_create(struct nmreq *nmr, struct ifnet *ifp, struct netmap_vp_adapter
 	return 0;
 
 err:
-	if (na->nm_mem != NULL)
+	if (na->na_flags & NAF_MEM_OWNER)
 		netmap_mem_private_delete(na->nm_mem);
 	free(vpna, M_DEVBUF);
 	return error;
@@ -2138,7 +2177,12 @@ netmap_bwrap_krings_create(struct netmap_adapter *na)
 	if (error)
 		return error;
 
-	/* also create the hwna krings */
+	/* also create the hwna krings. The bwrap accesses the hwna
+	 * rings directly, with the default layout, no offsets,
+	 * no slot timestamps and a single host ring pair
+	 */
+	hwna->na_flags &= ~NAF_RING_CONFIG;
+	hwna->num_host_rings = 1;
 	error = hwna->nm_krings_create(hwna);
 	if (error) {
 		netmap_vp_krings_delete(na);
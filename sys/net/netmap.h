@@ -51,6 +51,28 @@
  */
 #define NM_CACHE_ALIGN	128
 
+/*
+ * Ring layouts (see struct netmap_ring). Layout v2 is requested
+ * by or-ing NETMAP_RING_LAYOUT_V2 into nr_version, and selected in
+ * userspace by defining NETMAP_WITH_RING_V2 before including this
+ * file. NETMAP_RING_LAYOUT is the value matching the compiled layout.
+ */
+#define	NETMAP_RING_LAYOUT_V2	0x10000
+
+#ifdef NETMAP_WITH_RING_V2
+#define	NETMAP_RING_LAYOUT	NETMAP_RING_LAYOUT_V2
+#define	NM_RING_TAIL_V1		_tail_v1
+#define	NM_RING_TS_V1		_ts_v1
+#define	NM_RING_TAIL_V2		tail
+#define	NM_RING_TS_V2		ts
+#else
+#define	NETMAP_RING_LAYOUT	0
+#define	NM_RING_TAIL_V1		tail
+#define	NM_RING_TS_V1		ts
+#define	NM_RING_TAIL_V2		tail_v2
+#define	NM_RING_TS_V2		ts_v2
+#endif /* NETMAP_WITH_RING_V2 */
+
 /*
  * --- Netmap data structures ---
  *
@@ -115,6 +137,10 @@
  *   as the index. On close, ni_bufs_head must point to the list of
  *   buffers to be released.
  *
+ *   Once the port is bound, NIOCXBUFS can grow or shrink the list
+ *   at runtime (see below). Applications can then keep a received
+ *   packet by swapping the slot buffer with one from the list.
+ *
  * + NIOCREGIF can request space for extra rings (and buffers)
  *   allocated in the same memory space. The number of extra rings
  *   is in nr_arg1, and is advisory. This is a no-op on NICs where
@@ -149,6 +175,18 @@ struct netmap_slot {
 	uint64_t ptr;		/* pointer for indirect buffers */
 };
 
+	/*
+	 * On rings with per-slot offsets (ring->offset_mask != 0,
+	 * see NR_OFFSETS) the bits of 'ptr' in offset_mask contain
+	 * the offset of the packet data from the start of the
+	 * buffer, and 'len' does not include the offset.
+	 * Userspace sets the offset on tx slots, and on rx slots
+	 * to choose where the next packet will be written; the
+	 * kernel reports the offset actually used on rx slots.
+	 * Offsets are initialized to ring->headroom, and are not
+	 * supported on NICs in native mode and with NS_INDIRECT.
+	 */
+
 /*
  * The following flags control how the slot is used
  */
@@ -243,6 +281,19 @@ struct netmap_slot {
  *	'cur' can be moved further ahead if we want to wait for
  *		new packets without returning the previous ones.
  *
+ * RING LAYOUT:
+ *	In the default layout (v1) head, cur (written by userspace)
+ *	and tail, ts (written by the kernel) share a cache line,
+ *	which bounces between the cores when the producer and the
+ *	consumer run in parallel (e.g. on the two ends of a pipe).
+ *	In layout v2 (NETMAP_RING_LAYOUT_V2) the kernel writes tail
+ *	and ts on the next cache line instead, so that each line
+ *	has a single writer. Programs built with NETMAP_WITH_RING_V2
+ *	see those fields as 'tail' and 'ts', and only need to
+ *	or NETMAP_RING_LAYOUT into nr_version (nm_open() does it).
+ *	The layout is a property of the port, so all
+ *	descriptors bound to it must use the same one.
+ *
  * DATA OWNERSHIP/LOCKING:
  *	The netmap_ring, and all slots and buffers in the range
  *	[head .. tail-1] are owned by the user program;
@@ -265,14 +316,39 @@ struct netmap_ring {
 
 	uint32_t        head;		/* (u) first user slot */
 	uint32_t        cur;		/* (u) wakeup point */
-	uint32_t	tail;		/* (k) first kernel slot */
+	uint32_t	NM_RING_TAIL_V1;	/* (k) first kernel slot, v1 */
 
 	uint32_t	flags;
 
-	struct timeval	ts;		/* (k) time of last *sync() */
-
-	/* opaque room for a mutex or similar object */
-	uint8_t		sem[128] __attribute__((__aligned__(NM_CACHE_ALIGN)));
+	struct timeval	NM_RING_TS_V1;	/* (k) time of last *sync(), v1 */
+
+	/* per-slot data offsets, see NR_OFFSETS */
+	const uint64_t	offset_mask;	/* offset bits in slot->ptr */
+	const uint32_t	headroom;	/* initial offset of the slots */
+	/* per-slot timestamps, see NR_SLOT_TS */
+	const uint32_t	ts_ofs;		/* from the ring, 0 if none */
+	uint32_t	event_idx;	/* (u) wakeup index, see NR_EVENT_IDX */
+
+	union {
+		/* opaque room for a mutex or similar object */
+		uint8_t		sem[128];
+
+		/* (k) kernel-written fields: tail and ts in ring
+		 * layout v2, kflags and the monitor counters in
+		 * both layouts
+		 */
+		struct {
+			uint32_t	NM_RING_TAIL_V2;
+			uint32_t	kflags;
+			struct timeval	NM_RING_TS_V2;
+			uint64_t	mon_drops;	/* see NR_MONITOR_COPY */
+			uint64_t	mon_truncs;
+			/* rx rings of emulated (generic) adapters:
+			 * packets lost because the ring was full
+			 */
+			uint64_t	rx_drops;
+		};
+	} __attribute__((__aligned__(NM_CACHE_ALIGN)));
 
 	/* the slots follow. This struct has variable size */
 	struct netmap_slot slot[0];	/* array of slots. */
@@ -294,6 +370,29 @@ struct netmap_ring {
 	 * Enables the NS_FORWARD slot flag for the ring.
 	 */
 
+#define	NR_EVENT_IDX	0x0008		/* coalesce rx notifications */
+	/*
+	 * The kernel only wakes up the users of an rx ring when
+	 * 'tail' moves past 'event_idx', that is when the slot at
+	 * event_idx gets filled, instead of on every new batch.
+	 * A consumer that busy-polls leaves event_idx alone and gets
+	 * (almost) no wakeups; before sleeping in poll() it sets
+	 * event_idx to the tail it has seen, or further ahead to be
+	 * woken up after more packets (see nm_ring_event()).
+	 * Honoured by pipes, VALE ports and monitors.
+	 */
+
+/*
+ * KERNEL RING FLAGS (ring->kflags)
+ */
+#define	NR_KTHREAD_SLEEPING	0x0001	/* the sync kthread is asleep */
+	/*
+	 * Set by the sync kthread of the ring (see NR_KTHREAD) before
+	 * going to sleep. A program that moves head or cur must then
+	 * issue a NIOCTXSYNC or NIOCRXSYNC to wake it up, otherwise
+	 * the update is only seen when the kthread wakes up by itself.
+	 */
+
 
 /*
  * Netmap representation of an interface and its queue(s).
@@ -323,12 +422,15 @@ struct netmap_if {
 	const uint32_t	ni_rx_rings;	/* number of HW rx rings */
 
 	uint32_t	ni_bufs_head;	/* head index for extra bufs */
-	uint32_t	ni_spare1[5];
+	const uint32_t	ni_host_rings;	/* host ring pairs, 0 means 1 */
+	uint32_t	ni_spare1[4];
 	/*
 	 * The following array contains the offset of each netmap ring
 	 * from this structure, in the following order:
-	 * NIC tx rings (ni_tx_rings); host tx ring (1); extra tx rings;
-	 * NIC rx rings (ni_rx_rings); host tx ring (1); extra rx rings.
+	 * NIC tx rings (ni_tx_rings); host tx rings (ni_host_rings);
+	 * extra tx rings;
+	 * NIC rx rings (ni_rx_rings); host rx rings (ni_host_rings);
+	 * extra rx rings.
 	 *
 	 * The area is filled up by the kernel on NIOCREGIF,
 	 * and then only read by userspace code.
@@ -344,6 +446,8 @@ struct netmap_if {
  * NIOCTXSYNC, NIOCRXSYNC synchronize tx or rx queues,
  *	whose identity is set in NIOCREGIF through nr_ringid.
  *	These are non blocking and take no argument.
+ *	NIOCSYNCV (below) does the same on a list of rings and
+ *	descriptors.
  *
  * NIOCGINFO takes a struct ifreq, the interface name is the input,
  *	the outputs are number of queues and number of descriptor
@@ -368,6 +472,11 @@ struct netmap_if {
  * nr_version	(in/out)
  *	Must match NETMAP_API as used in the kernel, error otherwise.
  *	Always returns the desired value on output.
+ *	NIOCREGIF also accepts NETMAP_RING_LAYOUT_V2 or-ed in to
+ *	request ring layout v2 (see struct netmap_ring). It is
+ *	kept in the returned value if the rings use layout v2, and
+ *	EINVAL is returned if the port is already in use with the
+ *	other layout.
  *
  * nr_tx_slots, nr_tx_slots, nr_tx_rings, nr_rx_rings (in/out)
  *	On input, non-zero values may be used to reconfigure the port
@@ -405,6 +514,9 @@ struct netmap_if {
  *
  * nr_flags	is the recommended mode to indicate which rings should
  *		be bound to a file descriptor. Values are NR_REG_*
+ *		NR_REG_SW and NR_REG_NIC_SW bind all the host rings
+ *		(ni_host_rings in the netmap_if), NR_REG_ONE_SW only
+ *		the host ring pair in the low bits of nr_ringid.
  *
  * nr_arg1 (in)	The number of extra rings to be reserved.
  *		Especially when allocating a VALE port the system only
@@ -422,9 +534,122 @@ struct netmap_if {
  *		Region '1' is the global allocator, normally shared
  *		by all interfaces. Other values are private regions.
  *		If two ports the same region zero-copy is possible.
+ *		When a new VALE port is created, a non-zero nr_arg2
+ *		binds it to the existing region with that id (EINVAL
+ *		if there is none), e.g. the one returned when
+ *		registering another VALE port. The ports (and their
+ *		pipes) can then move buffers between their rings by
+ *		swapping buffer indexes. The region must be large
+ *		enough for all of them, see nr_arg1 and nr_arg3.
+ *		The region is released when the last port goes away.
  *
  * nr_arg3 (in/out)	number of extra buffers to be allocated.
  *
+ * nr_headroom (in)	with NR_OFFSETS in nr_flags, enables per-slot
+ *		data offsets in the rings of the port (see struct
+ *		netmap_slot), all initialized to nr_headroom bytes.
+ *		Tunnel and virtio-net headers can then be added or
+ *		removed by moving the offset instead of the data.
+ *		Rings are shared by all descriptors bound to a
+ *		port, so the values must match those of the other
+ *		descriptors (EINVAL otherwise). Values larger than
+ *		the buffer size minus 64 are clamped. Not available on
+ *		NICs in native mode (EOPNOTSUPP).
+ *
+ * NR_KTHREAD in nr_flags	starts a kernel thread for each ring
+ *		bound to the descriptor. The thread watches head and
+ *		cur and runs txsync/rxsync by itself, so that the
+ *		program can work in shared memory only. The thread
+ *		spins for dev.netmap.kthread_spin idle rounds, then
+ *		sleeps until the ring is notified or a NIOC*SYNC is
+ *		issued on the descriptor (see NR_KTHREAD_SLEEPING).
+ *		Threads are bound to consecutive CPUs starting at
+ *		dev.netmap.kthread_cpu, if not negative. A ring can
+ *		only be served by one kthread (EBUSY otherwise).
+ *
+ * NR_SLOT_TS in nr_flags	adds to each ring an array of 64-bit
+ *		timestamps parallel to the slots, at ring->ts_ofs
+ *		bytes from the ring (see NETMAP_SLOT_TS() in
+ *		netmap_user.h). On rx rings the entry of a slot holds
+ *		the time, in nanoseconds since the Epoch, at which the
+ *		packet reached the ring: VALE ports and pipes stamp
+ *		packets as they are delivered, all the other ports
+ *		(NICs, the emulated adapter, host rings, monitors)
+ *		when the rxsync imports them. No driver provides
+ *		hardware stamps yet. Packets arriving in the same
+ *		batch share a timestamp. As NR_OFFSETS,
+ *		the setting must match the other descriptors bound to
+ *		the port, and the rings must fit in the ring objects
+ *		of the allocator (ENOMEM otherwise, see
+ *		dev.netmap.ring_size).
+ *
+ * NR_PIPE_LB in nr_flags	turns the descriptor into a load
+ *		balancer for the rx rings it binds (host rings
+ *		excluded): the kernel takes the masters of the first
+ *		nr_arg1 pipes of the port ({0 .. {nr_arg1-1) and the
+ *		rxsync of the rings moves each received packet to the
+ *		rx ring of one of the slaves (}0, }1, ...) by swapping
+ *		buffers. The pipe is chosen by a symmetric hash of the
+ *		IP addresses, protocol and ports, so both directions
+ *		of a flow reach the same worker, or round-robin with
+ *		NR_PIPE_LB_RR as well. Packets for a full pipe are
+ *		dropped; per-pipe packet and drop counters are in
+ *		dev.netmap.pipe_lb_stats. The program must not use the
+ *		rx rings, it only drives the balancer with poll() or
+ *		NIOCRXSYNC, or not at all with NR_KTHREAD.
+ *		The masters must not be in use (EBUSY otherwise).
+ *
+ * NR_PIPE_BCAST in nr_flags	when the pipe is created by this request
+ *		(e.g. eth0{3 or eth0}3), makes it a broadcast pipe: every
+ *		packet sent on the master reaches all the slaves. Each
+ *		descriptor bound to the slave is a consumer with an rx
+ *		ring of its own, whose index is returned in nr_arg1;
+ *		nr_rx_rings (in) is the max number of consumers (default
+ *		4, max 32, EBUSY when they are all taken). The slaves
+ *		see the buffers of the master tx ring, which are not
+ *		copied: they must not modify or swap them, and a slot
+ *		goes back to the master only when all the consumers have
+ *		released it, so the master runs at the pace of the
+ *		slowest one. If dev.netmap.pipe_bcast_drop is set, a
+ *		consumer that holds the whole ring of the master is
+ *		dropped instead: its slots are released and its ring is
+ *		reinitialized on the next sync. With no consumers the
+ *		packets are discarded. The slaves have no tx ring.
+ *
+ * NR_MONITOR_COPY in nr_flags	with NR_MONITOR_TX and/or NR_MONITOR_RX,
+ *		makes a monitor that copies the packets of the
+ *		monitored rings into its own buffers, instead of
+ *		swapping them. Up to nr_arg1 bytes (the snaplen, 0 or
+ *		larger than the buffer size meaning the whole buffer)
+ *		are copied at the start of the buffer. slot->len is the
+ *		number of bytes copied and slot->ptr the original length
+ *		of the packet. Any number of copy monitors can watch
+ *		the same ring, while a zero-copy monitor needs the rings
+ *		for itself (EBUSY otherwise). The monitor rings do not
+ *		use NR_OFFSETS.
+ *
+ *		On each rx ring of a monitor, ring->mon_drops counts
+ *		the packets lost because the ring was full, and
+ *		ring->mon_truncs (copy monitors only) the packets cut
+ *		to the snaplen or to the value returned by the filter
+ *		(see NIOCSETMONF). The counters are cumulative and
+ *		start from 0 when the monitor is opened.
+ *
+ * NR_MONITOR_BLOCK in nr_flags	with NR_MONITOR_TX, the monitored tx
+ *		rings do not return the transmitted slots to their user
+ *		until the monitor has room for them, so no tx packet is
+ *		lost: the sender is slowed down to the pace of the
+ *		monitor, and stalls if the monitor stops reading.
+ *		Meant for debugging only.
+ *
+ * nr_busy_poll (in)	busy-poll budget of poll() on the descriptor,
+ *		in microseconds. Before going to sleep, poll() keeps
+ *		running the txsync/rxsync of the bound rings for up
+ *		to this time, trading CPU for wakeup latency.
+ *		0 means use the dev.netmap.busy_poll sysctl (default
+ *		0, no busy-polling). Statistics are reported in
+ *		dev.netmap.poll_stats.
+ *
  *
  *
  * nr_cmd (in)	if non-zero indicates a special command:
@@ -454,6 +679,21 @@ struct netmap_if {
  *
  * nr_arg1, nr_arg2, nr_arg3  (in/out)		command specific
  *
+ * NIOCXBUFS takes a struct nmreq on a file descriptor already
+ *	bound with NIOCREGIF, and operates on the list of extra
+ *	buffers at nifp->ni_bufs_head. nr_cmd selects the operation:
+ *
+ *	NETMAP_BUFS_ALLOC
+ *		allocate nr_arg3 buffers and prepend them to the list.
+ *
+ *	NETMAP_BUFS_FREE
+ *		return up to nr_arg3 buffers from the head of the list
+ *		to the allocator.
+ *
+ *	On return nr_arg3 contains the number of buffers actually
+ *	allocated or freed. Userspace must not modify ni_bufs_head
+ *	while the ioctl is in progress.
+ *
  *
  *
  */
@@ -491,6 +731,8 @@ struct nmreq {
 #define NETMAP_BDG_OFFSET	NETMAP_BDG_VNET_HDR	/* deprecated alias */
 #define NETMAP_BDG_NEWIF	6	/* create a virtual port */
 #define NETMAP_BDG_DELIF	7	/* destroy a virtual port */
+#define NETMAP_BUFS_ALLOC	8	/* NIOCXBUFS: add extra buffers */
+#define NETMAP_BUFS_FREE	9	/* NIOCXBUFS: release extra buffers */
 	uint16_t	nr_arg1;	/* reserve extra rings in NIOCREGIF */
 #define NETMAP_BDG_HOST		1	/* attach the host stack on ATTACH */
 
@@ -498,7 +740,8 @@ struct nmreq {
 	uint32_t	nr_arg3;	/* req. extra buffers in NIOCREGIF */
 	uint32_t	nr_flags;
 	/* various modes, extends nr_ringid */
-	uint32_t	spare2[1];
+	uint16_t	nr_headroom;	/* initial slot offset with NR_OFFSETS */
+	uint16_t	nr_busy_poll;	/* poll() busy-poll budget (us) */
 };
 
 #define NR_REG_MASK		0xf /* values for nr_flags */
@@ -509,10 +752,197 @@ enum {	NR_REG_DEFAULT	= 0,	/* backward compat, should not be used. */
 	NR_REG_ONE_NIC	= 4,
 	NR_REG_PIPE_MASTER = 5,
 	NR_REG_PIPE_SLAVE = 6,
+	NR_REG_ONE_SW	= 7,
 };
 /* monitor uses the NR_REG to select the rings to monitor */
 #define NR_MONITOR_TX	0x100
 #define NR_MONITOR_RX	0x200
+/* monitor with its own buffers, see NR_MONITOR_COPY below */
+#define NR_MONITOR_COPY	0x10000
+/* tx monitor that slows down the monitored rings, debug only */
+#define NR_MONITOR_BLOCK	0x20000
+/* per-slot data offsets (and nr_headroom) for the rings of the port */
+#define NR_OFFSETS	0x400
+#define NETMAP_OFFSET_MASK	0xffff	/* value of ring->offset_mask */
+/* run txsync/rxsync in kernel threads (one per bound ring) */
+#define NR_KTHREAD	0x800
+/* per-slot timestamps in the rings of the port */
+#define NR_SLOT_TS	0x1000
+/* distribute the received packets over the pipes of the port */
+#define NR_PIPE_LB	0x2000
+#define NR_PIPE_LB_RR	0x4000	/* round-robin instead of flow hash */
+/* one master, many read-only slaves (set when the pipe is created) */
+#define NR_PIPE_BCAST	0x8000
+
+
+/*
+ * NIOCMEMINFO returns the statistics of a memory allocator.
+ * On input nmi_id is the lowest allocator id of interest
+ * (allocators are numbered from 1), on output it is the id of the
+ * allocator actually reported; ENOENT means there are no more.
+ * Applications can scan all allocators by incrementing nmi_id.
+ * nmi_port selects which of the nmi_num_ports ports using the
+ * allocator is reported in the nmi_port_* fields.
+ * The same information is available in text form in the
+ * dev.netmap.mem_stats sysctl (the mem_stats module parameter
+ * on linux).
+ */
+struct nm_pool_info {
+	uint32_t	npi_total;	/* number of objects */
+	uint32_t	npi_free;	/* free objects */
+	uint32_t	npi_size;	/* object size */
+	uint32_t	npi_fail;	/* failed allocations */
+};
+
+struct nm_mem_info {
+	uint16_t	nmi_id;		/* (i/o) allocator id */
+	uint16_t	nmi_port;	/* (i) port index */
+	uint32_t	nmi_flags;	/* (o) allocator flags */
+	uint32_t	nmi_memsize;	/* (o) size of the shared region */
+	uint32_t	nmi_refcount;	/* (o) users of the allocator */
+	uint32_t	nmi_num_ports;	/* (o) ports with a netmap_if */
+	uint32_t	nmi_extra_bufs;	/* (o) extra buffers, all ports */
+	struct nm_pool_info nmi_pools[3]; /* (o) if, ring, buf pools */
+
+	char		nmi_port_name[IFNAMSIZ]; /* (o) port nmi_port */
+	uint32_t	nmi_port_fds;	/* (o) netmap_if on the port */
+	uint32_t	nmi_port_rings;	/* (o) rings of the port */
+	uint32_t	nmi_port_bufs;	/* (o) slots in the rings */
+	uint32_t	nmi_port_extra_bufs; /* (o) extra buffers */
+	uint32_t	nmi_spare[4];
+};
+
+
+/*
+ * NIOCSYNCV runs the txsync/rxsync of several rings, possibly bound
+ * to different file descriptors, in a single system call.
+ * nsv_reqs points to an array of nsv_num struct nm_sync_req.
+ * For each entry:
+ *
+ * nsr_fd	a netmap file descriptor already bound with NIOCREGIF,
+ *		or -1 for the descriptor the ioctl is issued on.
+ * nsr_ring	the ring to sync, which must be bound to nsr_fd, or
+ *		NETMAP_SYNC_ALL for all the rings bound to nsr_fd
+ *		(as NIOCTXSYNC/NIOCRXSYNC do).
+ * nsr_flags	NETMAP_SYNC_TX and/or NETMAP_SYNC_RX.
+ * nsr_txtail, nsr_rxtail (out)	the tail of the tx and rx ring after
+ *		the sync (of the first ring with NETMAP_SYNC_ALL).
+ * nsr_error (out)	0 or the errno for this entry, e.g. EBUSY
+ *		if the ring was busy, EBADF if nsr_fd is not a bound
+ *		netmap descriptor.
+ *
+ * Errors on individual entries do not stop the others. On return
+ * nsv_done is the number of entries processed, which is less than
+ * nsv_num only if the array could not be accessed (EFAULT).
+ */
+struct nm_sync_req {
+	int32_t		nsr_fd;
+	uint16_t	nsr_ring;
+#define NETMAP_SYNC_ALL		0xffff
+	uint16_t	nsr_flags;
+#define NETMAP_SYNC_TX		0x1
+#define NETMAP_SYNC_RX		0x2
+	uint32_t	nsr_txtail;
+	uint32_t	nsr_rxtail;
+	int32_t		nsr_error;
+	uint32_t	nsr_spare;
+};
+
+struct nm_syncv {
+	uint64_t	nsv_reqs;	/* (i) struct nm_sync_req array */
+	uint32_t	nsv_num;	/* (i) entries in the array */
+	uint32_t	nsv_done;	/* (o) entries processed */
+};
+
+
+/*
+ * NIOCSETEVFD attaches an eventfd to one ring bound to the
+ * descriptor, so that the ring signals it (adding 1 to its counter)
+ * on every notification, e.g. when new packets arrive on an rx ring
+ * or tx slots are released. The eventfd can then be used in
+ * epoll or any other event loop to learn which ring is ready,
+ * and the ring synced with NIOC*SYNC or NIOCSYNCV.
+ * poll() on the netmap descriptor works as before.
+ *
+ * nef_fd	the eventfd, or -1 to detach the current one.
+ * nef_ring	the ring, which must be bound to the descriptor.
+ * nef_flags	NETMAP_EVFD_TX or NETMAP_EVFD_RX, the kind of ring.
+ *
+ * A ring has at most one eventfd, owned by the descriptor that
+ * attached it (EBUSY for the others) and detached when the
+ * descriptor is closed. EOPNOTSUPP where eventfds are not available.
+ */
+struct nm_evfd_req {
+	int32_t		nef_fd;
+	uint16_t	nef_ring;
+	uint16_t	nef_flags;
+#define NETMAP_EVFD_TX		0x1
+#define NETMAP_EVFD_RX		0x2
+	uint32_t	nef_spare[2];
+};
+
+
+/*
+ * NIOCSETMONF sets the filter of a monitor (a descriptor registered
+ * with NR_MONITOR_TX and/or NR_MONITOR_RX). The filter runs in the
+ * sync of the monitored rings, before the slot is swapped or copied,
+ * so that the monitor only receives the packets it wants.
+ *
+ * nmf_insns	a classic BPF program, i.e. an array of struct bpf_insn
+ *		as produced by pcap_compile().
+ * nmf_len	the number of instructions, 0 to remove the program.
+ *		The program returns 0 to discard the packet; for copy
+ *		monitors a non-zero value also limits the bytes copied.
+ * nmf_sample	deliver one in nmf_sample of the accepted packets
+ *		(0 or 1 for all), counted on each monitor ring.
+ *
+ * The program is validated (EINVAL if invalid or longer than 4096
+ * instructions) and compiled by the kernel BPF JIT where available.
+ * The filter replaces the previous one and lasts until the
+ * descriptor is closed.
+ */
+struct nm_monf_req {
+	uint64_t	nmf_insns;	/* (i) struct bpf_insn array */
+	uint32_t	nmf_len;	/* (i) instructions in the array */
+	uint32_t	nmf_sample;	/* (i) 1-in-N sampling */
+	uint32_t	nmf_spare[2];
+};
+
+
+/*
+ * NIOCSETMIT reads, and optionally changes, the interrupt mitigation
+ * of one rx ring of an emulated (generic) port, bound to the
+ * descriptor. The ring is notified at most once every nmi_delay_ns:
+ * the delay adapts to the traffic, going from nmi_min_ns at low
+ * rates (lowest latency) to the time needed to receive about a
+ * quarter of the ring at high rates, and is cut down when the
+ * consumer takes over half of the ring at each sync (it is falling
+ * behind). It never exceeds nmi_max_ns.
+ *
+ * nmi_ring	the rx ring, which must be bound to the descriptor.
+ * nmi_flags	NETMAP_MIT_SET to set the bounds, 0 to just read them.
+ * nmi_min_ns, nmi_max_ns	the bounds of the delay. The initial
+ *		values come from dev.netmap.generic_mit_min and
+ *		dev.netmap.generic_mit; nmi_max_ns 0 notifies every
+ *		packet. EINVAL if nmi_min_ns > nmi_max_ns.
+ * nmi_delay_ns, nmi_rate, nmi_batch (out)	the current delay, the
+ *		packets per second on the ring and the average packets
+ *		taken by the consumer at each sync.
+ *
+ * EOPNOTSUPP on the ports that are not emulated, EBUSY (rarely) if
+ * the delay is being updated, try again.
+ */
+struct nm_mit_req {
+	uint16_t	nmi_ring;	/* (i) rx ring */
+	uint16_t	nmi_flags;	/* (i) */
+#define NETMAP_MIT_SET		0x1
+	uint32_t	nmi_min_ns;	/* (i/o) */
+	uint32_t	nmi_max_ns;	/* (i/o) */
+	uint32_t	nmi_delay_ns;	/* (o) */
+	uint32_t	nmi_rate;	/* (o) */
+	uint32_t	nmi_batch;	/* (o) */
+	uint32_t	nmi_spare[2];
+};
 
 
 /*
@@ -526,6 +956,12 @@ enum {	NR_REG_DEFAULT	= 0,	/* backward compat, should not be used. */
 #define NIOCTXSYNC	_IO('i', 148) /* sync tx queues */
 #define NIOCRXSYNC	_IO('i', 149) /* sync rx queues */
 #define NIOCCONFIG	_IOWR('i',150, struct nm_ifreq) /* for ext. modules */
+#define NIOCXBUFS	_IOWR('i', 151, struct nmreq) /* extra buffers */
+#define NIOCMEMINFO	_IOWR('i', 152, struct nm_mem_info) /* allocator stats */
+#define NIOCSYNCV	_IOWR('i', 153, struct nm_syncv) /* multi-ring sync */
+#define NIOCSETEVFD	_IOWR('i', 154, struct nm_evfd_req) /* ring eventfd */
+#define NIOCSETMONF	_IOWR('i', 155, struct nm_monf_req) /* monitor filter */
+#define NIOCSETMIT	_IOWR('i', 156, struct nm_mit_req) /* generic rx mitigation */
 #endif /* !NIOCREGIF */
 
 
@@ -48,6 +48,12 @@
  *	char *buf = NETMAP_BUF(ring, x) returns a pointer to
  *		the buffer numbered x
  *
+ *	char *buf = NETMAP_BUF_OFS(ring, slot) returns a pointer to
+ *		the packet data in the buffer of the slot, i.e. the
+ *		buffer plus the slot offset if NR_OFFSETS is in use.
+ *		NETMAP_OFFSET() and NETMAP_SET_OFFSET() read and
+ *		write the offset.
+ *
  * All ring indexes (head, cur, tail) should always move forward.
  * To compute the next index in a circular ring you can use
  *	i = nm_ring_next(ring, i);
@@ -85,8 +91,13 @@
 #define NETMAP_TXRING(nifp, index) _NETMAP_OFFSET(struct netmap_ring *, \
 	nifp, (nifp)->ring_ofs[index] )
 
+/* host ring pairs of the port, older kernels leave the field to 0 */
+#define NETMAP_HOST_RINGS(nifp)	\
+	((nifp)->ni_host_rings ? (nifp)->ni_host_rings : 1)
+
 #define NETMAP_RXRING(nifp, index) _NETMAP_OFFSET(struct netmap_ring *,	\
-	nifp, (nifp)->ring_ofs[index + (nifp)->ni_tx_rings + 1] )
+	nifp, (nifp)->ring_ofs[index + (nifp)->ni_tx_rings +		\
+		NETMAP_HOST_RINGS(nifp)] )
 
 #define NETMAP_BUF(ring, index)				\
 	((char *)(ring) + (ring)->buf_ofs + ((index)*(ring)->nr_buf_size))
@@ -95,6 +106,21 @@
 	( ((char *)(buf) - ((char *)(ring) + (ring)->buf_ofs) ) / \
 		(ring)->nr_buf_size )
 
+/* per-slot data offsets, zero unless the port uses NR_OFFSETS */
+#define NETMAP_OFFSET(ring, slot)			\
+	((uint32_t)((slot)->ptr & (ring)->offset_mask))
+
+#define NETMAP_SET_OFFSET(ring, slot, o)		\
+	((slot)->ptr = ((slot)->ptr & ~(ring)->offset_mask) |	\
+		((uint64_t)(o) & (ring)->offset_mask))
+
+#define NETMAP_BUF_OFS(ring, slot)			\
+	(NETMAP_BUF(ring, (slot)->buf_idx) + NETMAP_OFFSET(ring, slot))
+
+/* arrival time of slot i in ns (wall clock), only if ring->ts_ofs != 0 */
+#define NETMAP_SLOT_TS(ring, i)				\
+	(((uint64_t *)(void *)((char *)(ring) + (ring)->ts_ofs))[i])
+
 
 static inline uint32_t
 nm_ring_next(struct netmap_ring *r, uint32_t i)
@@ -103,6 +129,20 @@ nm_ring_next(struct netmap_ring *r, uint32_t i)
 }
 
 
+/*
+ * With NR_EVENT_IDX in ring->flags, ask to be woken up when the
+ * n-th (n >= 1) slot after the current tail of an rx ring is filled.
+ * Call before poll(), and check the ring again after it.
+ */
+static inline void
+nm_ring_event(struct netmap_ring *r, uint32_t n)
+{
+	uint32_t i = r->tail + n - 1;
+
+	r->event_idx = i % r->num_slots;
+}
+
+
 /*
  * Return 1 if we have pending transmissions in the tx ring.
  * When everything is complete ring->head = ring->tail + 1 (modulo ring size)
@@ -332,6 +372,32 @@ static int nm_inject(struct nm_desc *, const void *, size_t);
 static int nm_dispatch(struct nm_desc *, int, nm_cb_t, u_char *);
 static u_char *nm_nextpkt(struct nm_desc *, struct nm_pkthdr *);
 
+/*
+ * Extra buffers, see NIOCXBUFS in netmap.h.
+ * nm_xbufs_alloc() and nm_xbufs_free() grow or shrink the list of
+ * spare buffers at d->nifp->ni_bufs_head, and return the number of
+ * buffers actually allocated or released.
+ *
+ * nm_hold() keeps the buffer of a received slot, replacing it with
+ * one from the spare list; it returns the index of the held buffer,
+ * or 0 if no spare buffer is available. It must be called before
+ * the next rxsync on the ring, e.g. right after nm_nextpkt().
+ * nm_release() puts a held buffer back in the spare list.
+ */
+
+static uint32_t nm_xbufs_alloc(struct nm_desc *, uint32_t);
+static uint32_t nm_xbufs_free(struct nm_desc *, uint32_t);
+static uint32_t nm_hold(struct nm_desc *, struct netmap_ring *,
+	struct netmap_slot *);
+static void nm_release(struct nm_desc *, struct netmap_ring *, uint32_t);
+
+/*
+ * nm_kick() is for descriptors registered with NR_KTHREAD: call it
+ * after updating head/cur of a ring, it only issues the (cheap)
+ * NIOCTXSYNC when the sync kthread of the ring has gone to sleep.
+ */
+static void nm_kick(struct nm_desc *, struct netmap_ring *);
+
 
 /*
  * Try to open, return descriptor if successful, NULL otherwise.
@@ -384,11 +450,11 @@ nm_open(const char *ifname, const struct nmreq *req,
 			goto fail;
 		}
 		break;
-	case '^': /* only sw ring */
+	case '^': /* only sw rings, or the one in the suffix */
 		nr_flags = NR_REG_SW;
 		if (port[1]) {
-			errmsg = "invalid port for sw ring";
-			goto fail;
+			nr_flags = NR_REG_ONE_SW;
+			nr_ringid = atoi(port + 1);
 		}
 		break;
 	case '{':
@@ -421,12 +487,14 @@ nm_open(const char *ifname, const struct nmreq *req,
 
 	if (req)
 		d->req = *req;
-	d->req.nr_version = NETMAP_API;
+	d->req.nr_version = NETMAP_API | NETMAP_RING_LAYOUT;
 	d->req.nr_ringid &= ~NETMAP_RING_MASK;
 
-	/* these fields are overridden by ifname and flags processing */
+	/* these fields are overridden by ifname and flags processing,
+	 * the other nr_flags (e.g. NR_SLOT_TS) come from req
+	 */
 	d->req.nr_ringid |= nr_ringid;
-	d->req.nr_flags = nr_flags;
+	d->req.nr_flags = (d->req.nr_flags & ~NR_REG_MASK) | nr_flags;
 	memcpy(d->req.nr_name, ifname, namelen);
 	d->req.nr_name[namelen] = '\0';
 	/* optionally import info from parent */
@@ -467,6 +535,17 @@ nm_open(const char *ifname, const struct nmreq *req,
 		errmsg = "NIOCREGIF failed";
 		goto fail;
 	}
+	/* nr_version tells the layout of the rings. This only fails
+	 * for programs built with NETMAP_WITH_RING_V2 on kernels
+	 * without layout v2, which reset nr_version to NETMAP_API and
+	 * use the default layout. There is no retry: the program only
+	 * knows one layout. Kernels with layout v2 fail NIOCREGIF if
+	 * the port uses the other one.
+	 */
+	if ((d->req.nr_version & NETMAP_RING_LAYOUT_V2) != NETMAP_RING_LAYOUT) {
+		errmsg = "ring layout not supported";
+		goto fail;
+	}
 
 	if (IS_NETMAP_DESC(parent) && parent->mem &&
 	    parent->req.nr_arg2 == d->req.nr_arg2) {
@@ -495,26 +574,40 @@ nm_open(const char *ifname, const struct nmreq *req,
 			(char *)d->mem + d->memsize;
 	}
 
-	if (d->req.nr_flags ==  NR_REG_SW) { /* host stack */
-		d->first_tx_ring = d->last_tx_ring = d->req.nr_tx_rings;
-		d->first_rx_ring = d->last_rx_ring = d->req.nr_rx_rings;
-	} else if (d->req.nr_flags ==  NR_REG_ALL_NIC) { /* only nic */
+	if ((d->req.nr_flags & NR_REG_MASK) == NR_REG_SW) { /* host stack */
+		d->first_tx_ring = d->req.nr_tx_rings;
+		d->first_rx_ring = d->req.nr_rx_rings;
+		d->last_tx_ring = d->req.nr_tx_rings +
+			NETMAP_HOST_RINGS(d->nifp) - 1;
+		d->last_rx_ring = d->req.nr_rx_rings +
+			NETMAP_HOST_RINGS(d->nifp) - 1;
+	} else if ((d->req.nr_flags & NR_REG_MASK) == NR_REG_ONE_SW) {
+		d->first_tx_ring = d->last_tx_ring = d->req.nr_tx_rings +
+			(d->req.nr_ringid & NETMAP_RING_MASK);
+		d->first_rx_ring = d->last_rx_ring = d->req.nr_rx_rings +
+			(d->req.nr_ringid & NETMAP_RING_MASK);
+	} else if ((d->req.nr_flags & NR_REG_MASK) == NR_REG_ALL_NIC) { /* only nic */
 		d->first_tx_ring = 0;
 		d->first_rx_ring = 0;
 		d->last_tx_ring = d->req.nr_tx_rings - 1;
 		d->last_rx_ring = d->req.nr_rx_rings - 1;
-	} else if (d->req.nr_flags ==  NR_REG_NIC_SW) {
+	} else if ((d->req.nr_flags & NR_REG_MASK) == NR_REG_NIC_SW) {
 		d->first_tx_ring = 0;
 		d->first_rx_ring = 0;
-		d->last_tx_ring = d->req.nr_tx_rings;
-		d->last_rx_ring = d->req.nr_rx_rings;
-	} else if (d->req.nr_flags == NR_REG_ONE_NIC) {
+		d->last_tx_ring = d->req.nr_tx_rings +
+			NETMAP_HOST_RINGS(d->nifp) - 1;
+		d->last_rx_ring = d->req.nr_rx_rings +
+			NETMAP_HOST_RINGS(d->nifp) - 1;
+	} else if ((d->req.nr_flags & NR_REG_MASK) == NR_REG_ONE_NIC) {
 		/* XXX check validity */
 		d->first_tx_ring = d->last_tx_ring =
 		d->first_rx_ring = d->last_rx_ring = d->req.nr_ringid & NETMAP_RING_MASK;
 	} else { /* pipes */
 		d->first_tx_ring = d->last_tx_ring = 0;
 		d->first_rx_ring = d->last_rx_ring = 0;
+		if ((d->req.nr_flags & NR_REG_MASK) == NR_REG_PIPE_SLAVE &&
+		    d->req.nr_rx_rings > 1) /* broadcast consumer */
+			d->first_rx_ring = d->last_rx_ring = d->req.nr_arg1;
 	}
 
 #ifdef DEBUG_NETMAP_USER
@@ -557,7 +650,10 @@ nm_close(struct nm_desc *d)
 	 */
 	static void *__xxzt[] __attribute__ ((unused))  =
 		{ (void *)nm_open, (void *)nm_inject,
-		  (void *)nm_dispatch, (void *)nm_nextpkt } ;
+		  (void *)nm_dispatch, (void *)nm_nextpkt,
+		  (void *)nm_xbufs_alloc, (void *)nm_xbufs_free,
+		  (void *)nm_hold, (void *)nm_release,
+		  (void *)nm_kick } ;
 
 	if (d == NULL || d->self != d)
 		return EINVAL;
@@ -582,7 +678,7 @@ nm_inject(struct nm_desc *d, const void *buf, size_t size)
 	for (c = 0; c < n ; c++) {
 		/* compute current ring to use */
 		struct netmap_ring *ring;
-		uint32_t i, idx;
+		uint32_t i;
 		uint32_t ri = d->cur_tx_ring + c;
 
 		if (ri > d->last_tx_ring)
@@ -592,9 +688,8 @@ nm_inject(struct nm_desc *d, const void *buf, size_t size)
 			continue;
 		}
 		i = ring->cur;
-		idx = ring->slot[i].buf_idx;
 		ring->slot[i].len = size;
-		nm_pkt_copy(buf, NETMAP_BUF(ring, idx), size);
+		nm_pkt_copy(buf, NETMAP_BUF_OFS(ring, &ring->slot[i]), size);
 		d->cur_tx_ring = ri;
 		ring->head = ring->cur = nm_ring_next(ring, i);
 		return size;
@@ -603,6 +698,21 @@ nm_inject(struct nm_desc *d, const void *buf, size_t size)
 }
 
 
+/* fill tv with the timestamp of slot i, or of the ring */
+static void
+nm_slot_tv(struct netmap_ring *ring, u_int i, struct timeval *tv)
+{
+	uint64_t ns;
+
+	if (ring->ts_ofs == 0) {
+		*tv = ring->ts;
+		return;
+	}
+	ns = NETMAP_SLOT_TS(ring, i);
+	tv->tv_sec = ns / 1000000000;
+	tv->tv_usec = (ns % 1000000000) / 1000;
+}
+
 /*
  * Same prototype as pcap_dispatch(), only need to cast.
  */
@@ -628,12 +738,11 @@ nm_dispatch(struct nm_desc *d, int cnt, nm_cb_t cb, u_char *arg)
 		ring = NETMAP_RXRING(d->nifp, ri);
 		for ( ; !nm_ring_empty(ring) && cnt != got; got++) {
 			u_int i = ring->cur;
-			u_int idx = ring->slot[i].buf_idx;
-			u_char *buf = (u_char *)NETMAP_BUF(ring, idx);
+			u_char *buf = (u_char *)NETMAP_BUF_OFS(ring, &ring->slot[i]);
 
 			// __builtin_prefetch(buf);
 			d->hdr.len = d->hdr.caplen = ring->slot[i].len;
-			d->hdr.ts = ring->ts;
+			nm_slot_tv(ring, i, &d->hdr.ts);
 			cb(arg, &d->hdr, buf);
 			ring->head = ring->cur = nm_ring_next(ring, i);
 		}
@@ -652,16 +761,14 @@ nm_nextpkt(struct nm_desc *d, struct nm_pkthdr *hdr)
 		struct netmap_ring *ring = NETMAP_RXRING(d->nifp, ri);
 		if (!nm_ring_empty(ring)) {
 			u_int i = ring->cur;
-			u_int idx = ring->slot[i].buf_idx;
-			u_char *buf = (u_char *)NETMAP_BUF(ring, idx);
+			u_char *buf = (u_char *)NETMAP_BUF_OFS(ring, &ring->slot[i]);
 
 			// __builtin_prefetch(buf);
-			hdr->ts = ring->ts;
+			nm_slot_tv(ring, i, &hdr->ts);
 			hdr->len = hdr->caplen = ring->slot[i].len;
 			ring->cur = nm_ring_next(ring, i);
-			/* we could postpone advancing head if we want
-			 * to hold the buffer. This can be supported in
-			 * the future.
+			/* the buffer is only valid until the next
+			 * rxsync. Use nm_hold() to keep it longer.
 			 */
 			ring->head = ring->cur;
 			d->cur_rx_ring = ri;
@@ -674,6 +781,71 @@ nm_nextpkt(struct nm_desc *d, struct nm_pkthdr *hdr)
 	return NULL; /* nothing found */
 }
 
+
+static uint32_t
+nm_xbufs_ioctl(struct nm_desc *d, uint16_t cmd, uint32_t n)
+{
+	struct nmreq req;
+
+	bzero(&req, sizeof(req));
+	req.nr_version = NETMAP_API;
+	req.nr_cmd = cmd;
+	req.nr_arg3 = n;
+	if (ioctl(d->fd, NIOCXBUFS, &req) == -1)
+		return 0;
+	return req.nr_arg3;
+}
+
+
+static uint32_t
+nm_xbufs_alloc(struct nm_desc *d, uint32_t n)
+{
+	return nm_xbufs_ioctl(d, NETMAP_BUFS_ALLOC, n);
+}
+
+
+static uint32_t
+nm_xbufs_free(struct nm_desc *d, uint32_t n)
+{
+	return nm_xbufs_ioctl(d, NETMAP_BUFS_FREE, n);
+}
+
+
+static uint32_t
+nm_hold(struct nm_desc *d, struct netmap_ring *ring, struct netmap_slot *slot)
+{
+	struct netmap_if *nifp = d->nifp;
+	uint32_t spare = nifp->ni_bufs_head;
+	uint32_t idx = slot->buf_idx;
+
+	if (spare == 0)
+		return 0; /* no spare buffers */
+	nifp->ni_bufs_head = *(uint32_t *)NETMAP_BUF(ring, spare);
+	slot->buf_idx = spare;
+	slot->flags |= NS_BUF_CHANGED;
+	return idx;
+}
+
+
+static void
+nm_release(struct nm_desc *d, struct netmap_ring *ring, uint32_t idx)
+{
+	struct netmap_if *nifp = d->nifp;
+
+	*(uint32_t *)NETMAP_BUF(ring, idx) = nifp->ni_bufs_head;
+	nifp->ni_bufs_head = idx;
+}
+
+
+static void
+nm_kick(struct nm_desc *d, struct netmap_ring *ring)
+{
+	/* make head/cur visible before reading the flag */
+	__sync_synchronize();
+	if (ring->kflags & NR_KTHREAD_SLEEPING)
+		ioctl(d->fd, NIOCTXSYNC, NULL);
+}
+
 #endif /* !HAVE_NETMAP_WITH_LIBS */
 
 #endif /* NETMAP_WITH_LIBS */